@@ -0,0 +1,132 @@
+// code-point-table.h
+// CodePointTable: sparse map from code point to a small value.
+
+#ifndef SMQTUTIL_CODE_POINT_TABLE_H
+#define SMQTUTIL_CODE_POINT_TABLE_H
+
+// smbase
+#include "exc.h"                       // xassert
+#include "sm-macros.h"                 // NO_OBJECT_COPIES
+
+
+// Map from code point in [0,limit) to 'T', stored as a two-level page
+// table.  The code point space is divided into pages of 'PAGE_SIZE'
+// entries, and a page is allocated only once some entry on it is
+// written.  Entries that have never been written read as a
+// default-constructed 'T'.
+//
+// This is meant for things like Unicode fonts, which have a few
+// thousand glyphs scattered over a space of about a million code
+// points.
+//
+// Lookup is O(1): one bounds check and two loads.  Directory slots
+// for absent pages point at a shared page of default values rather
+// than being NULL, so lookup does not need to test for that.
+template <class T>
+class CodePointTable {
+  NO_OBJECT_COPIES(CodePointTable);
+
+public:      // types
+  enum {
+    PAGE_BITS = 8,
+    PAGE_SIZE = 1 << PAGE_BITS,
+    PAGE_MASK = PAGE_SIZE - 1,
+  };
+
+private:     // data
+  // Exclusive upper bound on valid code points.
+  int m_limit;
+
+  // Number of entries in 'm_directory'.
+  int m_numPages;
+
+  // Page of default values.  Owner.  It is never written.
+  T *m_defaultPage;
+
+  // Array of 'm_numPages' pointers to pages of 'PAGE_SIZE' entries.
+  // Each is either 'm_defaultPage' or an owner pointer to a page
+  // allocated by 'getForWrite'.
+  T **m_directory;
+
+  // Number of entries in 'm_directory' that are not 'm_defaultPage'.
+  int m_numAllocatedPages;
+
+public:      // funcs
+  // Make an empty table of code points in [0,limit).
+  explicit CodePointTable(int limit)
+    : m_limit(limit < 0? 0 : limit),
+      m_numPages((m_limit + PAGE_MASK) >> PAGE_BITS),
+      m_defaultPage(new T[PAGE_SIZE]()),
+      m_directory(new T*[m_numPages]),
+      m_numAllocatedPages(0)
+  {
+    for (int i=0; i < m_numPages; i++) {
+      m_directory[i] = m_defaultPage;
+    }
+  }
+
+  ~CodePointTable()
+  {
+    for (int i=0; i < m_numPages; i++) {
+      if (m_directory[i] != m_defaultPage) {
+        delete[] m_directory[i];
+      }
+    }
+    delete[] m_directory;
+    delete[] m_defaultPage;
+  }
+
+  // Exclusive upper bound on valid code points.
+  int limit() const { return m_limit; }
+
+  // Number of pages that have been allocated.
+  int numAllocatedPages() const { return m_numAllocatedPages; }
+
+  // Approximate number of bytes of storage used by the table.
+  long memoryUsage() const
+  {
+    return (long)sizeof(T*) * m_numPages +
+           (long)sizeof(T) * PAGE_SIZE * (1 + m_numAllocatedPages);
+  }
+
+  // True if 'cp' is on a page that has been allocated.  When this is
+  // false, the entry for 'cp' certainly has the default value.
+  bool hasPageFor(int cp) const
+  {
+    unsigned u = (unsigned)cp;
+    return u < (unsigned)m_limit &&
+           m_directory[u >> PAGE_BITS] != m_defaultPage;
+  }
+
+  // Get the entry for 'cp'.  Any 'cp' is allowed; values outside
+  // [0,limit) yield a default-constructed 'T'.
+  T const &get(int cp) const
+  {
+    // The unsigned comparison also rejects negative values.
+    unsigned u = (unsigned)cp;
+    if (u < (unsigned)m_limit) {
+      return m_directory[u >> PAGE_BITS][u & PAGE_MASK];
+    }
+    else {
+      return m_defaultPage[0];
+    }
+  }
+
+  T const &operator[] (int cp) const { return get(cp); }
+
+  // Get a writable reference to the entry for 'cp', allocating its
+  // page if necessary.  'cp' must be in [0,limit).
+  T &getForWrite(int cp)
+  {
+    xassert(0 <= cp && cp < m_limit);
+    T *&page = m_directory[cp >> PAGE_BITS];
+    if (page == m_defaultPage) {
+      page = new T[PAGE_SIZE]();
+      m_numAllocatedPages++;
+    }
+    return page[cp & PAGE_MASK];
+  }
+};
+
+
+#endif // SMQTUTIL_CODE_POINT_TABLE_H
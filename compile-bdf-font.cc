@@ -0,0 +1,87 @@
+// compile-bdf-font.cc
+// Program to compile a BDF font into QtBDFFontData source code.
+
+// Usage:
+//   compile-bdf-font <font.bdf> <name> <out.h> <out.cc>
+//
+// writes a header declaring a QtBDFFontData called <name> and a source
+// file defining it.  See qtbdffont-data.h.
+
+// this directory
+#include "qtbdffont.h"                 // QtBDFFont
+
+// smbase
+#include "bdffont.h"                   // BDFFont, parseBDFFile
+#include "exc.h"                       // xBase
+#include "sm-iostream.h"               // cerr
+
+// libc++
+#include <fstream>                     // std::ofstream
+
+// libc
+#include <ctype.h>                     // isalnum, toupper
+
+
+// Write the header declaring 'name' to 'os'.
+static void writeHeader(std::ostream &os, char const *name,
+                        char const *headerFname)
+{
+  // Include guard made from the file name.
+  string guard;
+  for (char const *p = headerFname; *p; p++) {
+    guard += isalnum((unsigned char)*p)? (char)toupper((unsigned char)*p)
+                                        : '_';
+  }
+
+  os << "// " << headerFname << "\n"
+     << "// Generated by compile-bdf-font.  Do not edit.\n"
+     << "\n"
+     << "#ifndef " << guard << "\n"
+     << "#define " << guard << "\n"
+     << "\n"
+     << "#include \"qtbdffont-data.h\"\n"
+     << "\n"
+     << "extern QtBDFFontData const " << name << ";\n"
+     << "\n"
+     << "#endif // " << guard << "\n";
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc != 5) {
+    cerr << "usage: " << argv[0] << " <font.bdf> <name> <out.h> <out.cc>\n";
+    return 2;
+  }
+  char const *bdfFname = argv[1];
+  char const *name = argv[2];
+  char const *headerFname = argv[3];
+  char const *sourceFname = argv[4];
+
+  try {
+    BDFFont font;
+    parseBDFFile(font, bdfFname);
+
+    std::ofstream header(headerFname);
+    writeHeader(header, name, headerFname);
+
+    std::ofstream source(sourceFname);
+    source << "// " << sourceFname << "\n"
+           << "// Compiled from " << bdfFname << ".\n";
+    QtBDFFont::writeCompiledFont(font, QtBDFFont::Options(), name, source);
+
+    if (!header || !source) {
+      cerr << argv[0] << ": error writing output\n";
+      return 2;
+    }
+  }
+  catch (xBase &x) {
+    cerr << argv[0] << ": " << bdfFname << ": " << x.why() << "\n";
+    return 2;
+  }
+
+  return 0;
+}
+
+
+// EOF
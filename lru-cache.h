@@ -0,0 +1,246 @@
+// lru-cache.h
+// LRUCache: bounded map that evicts the least recently used entries.
+
+#ifndef SMQTUTIL_LRU_CACHE_H
+#define SMQTUTIL_LRU_CACHE_H
+
+// smbase
+#include "sm-macros.h"                 // NO_OBJECT_COPIES
+
+// libc++
+#include <list>                        // std::list
+#include <map>                         // std::map
+#include <utility>                     // std::pair
+
+
+// Statistics about a cache, for clients that want to tune its budget.
+class CacheStats {
+public:      // data
+  // Number of lookups that found an entry.
+  long hits;
+
+  // Number of lookups that did not.
+  long misses;
+
+  // Number of entries currently stored.
+  int entries;
+
+  // Sum of the costs of the stored entries.  Costs are in whatever
+  // unit the cache uses; typically it is bytes.
+  long cost;
+
+  // Maximum 'cost' the cache will retain.
+  long budget;
+
+public:      // funcs
+  CacheStats()
+    : hits(0), misses(0), entries(0), cost(0), budget(0)
+  {}
+
+  // Fraction of lookups that were hits, or 0 if there were none.
+  double hitRate() const
+  {
+    long total = hits + misses;
+    return total? (double)hits / total : 0.0;
+  }
+};
+
+
+// Map from 'Key' to 'Value' with a limit on the total cost of the
+// entries.  When an insertion pushes the total over the budget, the
+// least recently used entries are discarded until it fits again.  The
+// most recently inserted entry is always kept, even if it alone is
+// over budget, so a pointer returned by 'insert' remains valid until
+// the next insertion or removal.
+//
+// 'Key' must have operator<.
+template <class Key, class Value>
+class LRUCache {
+  NO_OBJECT_COPIES(LRUCache);
+
+private:     // types
+  struct Entry {
+    Key m_key;
+    Value m_value;
+    long m_cost;
+
+    Entry(Key const &key, Value const &value, long cost)
+      : m_key(key), m_value(value), m_cost(cost)
+    {}
+  };
+
+  typedef std::list<Entry> EntryList;
+  typedef std::map<Key, typename EntryList::iterator> EntryIndex;
+
+private:     // data
+  // Entries ordered from most to least recently used.
+  EntryList m_entries;
+
+  // Map from key to its place in 'm_entries'.
+  EntryIndex m_index;
+
+  // Sum of 'm_cost' over 'm_entries'.
+  long m_cost;
+
+  // Maximum retained cost.
+  long m_budget;
+
+  // Lookup counters.
+  long m_hits;
+  long m_misses;
+
+private:     // funcs
+  // Discard least recently used entries, except the most recent one,
+  // until the cost fits in the budget.
+  void evict()
+  {
+    while (m_cost > m_budget && m_entries.size() > 1) {
+      Entry &victim = m_entries.back();
+      m_cost -= victim.m_cost;
+      m_index.erase(victim.m_key);
+      m_entries.pop_back();
+    }
+  }
+
+public:      // funcs
+  explicit LRUCache(long budget)
+    : m_entries(),
+      m_index(),
+      m_cost(0),
+      m_budget(budget),
+      m_hits(0),
+      m_misses(0)
+  {}
+
+  // Look up 'key'.  If present, mark it most recently used and return
+  // a pointer to its value, which remains valid until the entry is
+  // evicted or removed.  Otherwise return nullptr.  Either way, the
+  // hit/miss counters are updated.
+  Value *find(Key const &key)
+  {
+    typename EntryIndex::iterator it = m_index.find(key);
+    if (it == m_index.end()) {
+      m_misses++;
+      return nullptr;
+    }
+    m_hits++;
+
+    // Move to the front of the recency list.
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    return &(it->second->m_value);
+  }
+
+  // Like 'find', but neither updates the recency order nor counts.
+  Value const *peek(Key const &key) const
+  {
+    typename EntryIndex::const_iterator it = m_index.find(key);
+    return it == m_index.end()? nullptr : &(it->second->m_value);
+  }
+
+  // Add or replace the entry for 'key' as the most recently used, and
+  // return a pointer to the stored value.  This may evict others.
+  Value *insert(Key const &key, Value const &value, long cost)
+  {
+    remove(key);
+    m_entries.push_front(Entry(key, value, cost));
+    m_index.insert(std::make_pair(key, m_entries.begin()));
+    m_cost += cost;
+    evict();
+    return &(m_entries.front().m_value);
+  }
+
+  // Change the recorded cost of an existing entry.  Does nothing if
+  // 'key' is absent.  This may evict other entries.
+  void setCost(Key const &key, long cost)
+  {
+    typename EntryIndex::iterator it = m_index.find(key);
+    if (it != m_index.end()) {
+      m_cost += cost - it->second->m_cost;
+      it->second->m_cost = cost;
+      evict();
+    }
+  }
+
+  // Remove the entry for 'key' if there is one.
+  void remove(Key const &key)
+  {
+    typename EntryIndex::iterator it = m_index.find(key);
+    if (it != m_index.end()) {
+      m_cost -= it->second->m_cost;
+      m_entries.erase(it->second);
+      m_index.erase(it);
+    }
+  }
+
+  // Remove every entry for which 'pred(key)' returns true.
+  template <class Pred>
+  void removeIf(Pred pred)
+  {
+    for (typename EntryList::iterator it = m_entries.begin();
+         it != m_entries.end(); ) {
+      if (pred(it->m_key)) {
+        m_cost -= it->m_cost;
+        m_index.erase(it->m_key);
+        it = m_entries.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+
+  // Call 'func(key, value)' for every entry, letting it modify the
+  // value, and make the cost it returns the entry's new cost.  The
+  // recency order and counters do not change, but the new costs may
+  // cause evictions afterward.
+  template <class Func>
+  void updateAll(Func func)
+  {
+    for (typename EntryList::iterator it = m_entries.begin();
+         it != m_entries.end(); ++it) {
+      long cost = func(it->m_key, it->m_value);
+      m_cost += cost - it->m_cost;
+      it->m_cost = cost;
+    }
+    evict();
+  }
+
+  // Remove all entries.  The counters are not reset.
+  void clear()
+  {
+    m_entries.clear();
+    m_index.clear();
+    m_cost = 0;
+  }
+
+  // Get and set the budget.  Reducing it evicts immediately.
+  long getBudget() const { return m_budget; }
+  void setBudget(long budget)
+  {
+    m_budget = budget;
+    evict();
+  }
+
+  int size() const { return (int)m_entries.size(); }
+
+  CacheStats getStats() const
+  {
+    CacheStats ret;
+    ret.hits = m_hits;
+    ret.misses = m_misses;
+    ret.entries = size();
+    ret.cost = m_cost;
+    ret.budget = m_budget;
+    return ret;
+  }
+
+  // Reset the hit/miss counters to zero.
+  void resetStats()
+  {
+    m_hits = 0;
+    m_misses = 0;
+  }
+};
+
+
+#endif // SMQTUTIL_LRU_CACHE_H
@@ -0,0 +1,390 @@
+// qtbdffont-cache.cc
+// code for qtbdffont-cache.h; tests are in test-qtbdffont.cc
+
+#include "qtbdffont-cache.h"           // this module
+
+// this directory
+#include "qtutil.h"                    // toQString
+
+// smbase
+#include "bdffont.h"                   // BDFFont, parseBDFFile, parseBDFString
+#include "xassert.h"                   // xfailure
+
+// Qt
+#include <qdir.h>                      // QDir
+#include <qfile.h>                     // QFile
+#include <qfileinfo.h>                 // QFileInfo
+#include <qsavefile.h>                 // QSaveFile
+
+// libc
+#include <stdio.h>                     // snprintf
+#include <string.h>                    // memcmp, memcpy
+
+
+// Cache file layout.  Integers are in the byte order of the machine
+// that wrote the file; a file from a machine with the other order
+// fails the 'byteOrder' check and is rebuilt.
+//
+//   CacheHeader
+//   CacheFont                          \
+//   QtBDFFontGlyphData[numGlyphs]       |
+//   CachePage[numPages]                 | payload
+//   page bits, compact MonoLSB rows    /
+//
+// The header is a multiple of 8 bytes and everything before the bits
+// is made of 32-bit integers, so the glyph array is suitably aligned
+// for use in place when the file is mapped.
+enum {
+  // Incremented whenever the layout changes.
+  CACHE_FORMAT_VERSION = 1,
+
+  BYTE_ORDER_MARK = 0x01020304,
+};
+
+static char const CACHE_MAGIC[8] = { 'Q','t','B','D','F','A','t','l' };
+
+struct CacheHeader {
+  char magic[8];                       // CACHE_MAGIC
+  quint32 byteOrder;                   // BYTE_ORDER_MARK
+  quint32 formatVersion;               // CACHE_FORMAT_VERSION
+  quint64 key;                         // 'computeCacheKey'
+  quint64 payloadSize;                 // bytes after the header
+  quint64 payloadHash;                 // FNV-1a of the payload
+};
+
+// QtBDFFontData without the version and pointers.
+struct CacheFont {
+  qint32 glyphIndexLimit;
+  qint32 nominalWidth, nominalHeight;
+  qint32 nominalOriginX, nominalOriginY;
+  qint32 nominalOffsetX, nominalOffsetY;
+  qint32 numGlyphs;
+  qint32 numPages;
+};
+
+// QtBDFFontPageData with an offset in place of the pointer.
+struct CachePage {
+  qint32 width, height;
+  qint32 bytesPerLine;                 // always (width+7)/8
+  qint32 bitsOffset;                   // from the start of the payload
+};
+
+static_assert(sizeof(CacheHeader) % 8 == 0, "header alignment");
+static_assert(sizeof(QtBDFFontGlyphData) == 10 * sizeof(qint32),
+              "glyphs are stored as they are in memory");
+
+
+char const *toString(AtlasCacheResult result)
+{
+  switch (result) {
+    case ACR_HIT:     return "ACR_HIT";
+    case ACR_MISS:    return "ACR_MISS";
+    case ACR_REBUILT: return "ACR_REBUILT";
+    default:          break;
+  }
+  xfailure("bad AtlasCacheResult");
+  return nullptr;   // not reached
+}
+
+
+// 64-bit FNV-1a hash of 'len' bytes at 'data', continuing from 'hash'.
+static quint64 fnv1a(quint64 hash, void const *data, qint64 len)
+{
+  unsigned char const *p = (unsigned char const*)data;
+  for (qint64 i=0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static quint64 const FNV_OFFSET_BASIS = 14695981039346656037ULL;
+
+
+// Key identifying the atlas that 'options' make from 'bdfContents'.
+static quint64 computeCacheKey(QByteArray const &bdfContents,
+                               QtBDFFont::Options const &options)
+{
+  quint64 hash = fnv1a(FNV_OFFSET_BASIS, bdfContents.constData(),
+                       bdfContents.size());
+
+  // Anything else that affects the file contents.
+  qint32 extra[] = {
+    CACHE_FORMAT_VERSION,
+    QTBDFFONT_DATA_VERSION,
+    options.maxPageDimension,
+    options.padToNominalCell,
+  };
+  return fnv1a(hash, extra, sizeof(extra));
+}
+
+
+static string cacheFileName(quint64 key, rostring cacheDir)
+{
+  char hex[20];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+  return stringb(cacheDir << "/" << hex << ".qtbdfatlas");
+}
+
+
+string atlasCacheFileName(QByteArray const &bdfContents,
+                          rostring cacheDir,
+                          QtBDFFont::Options const &options)
+{
+  return cacheFileName(computeCacheKey(bdfContents, options), cacheDir);
+}
+
+
+// If the 'size' bytes at 'bytes' are a valid cache file for 'key',
+// make a font from them.  Otherwise return NULL.
+static std::unique_ptr<QtBDFFont> fontFromCacheBytes(
+  unsigned char const *bytes, qint64 size, quint64 key)
+{
+  std::unique_ptr<QtBDFFont> ret;
+
+  CacheHeader header;
+  if (size < (qint64)sizeof(header)) {
+    return ret;
+  }
+  memcpy(&header, bytes, sizeof(header));
+  if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+      header.byteOrder != BYTE_ORDER_MARK ||
+      header.formatVersion != CACHE_FORMAT_VERSION ||
+      header.key != key ||
+      header.payloadSize != (quint64)(size - sizeof(header))) {
+    return ret;
+  }
+
+  unsigned char const *payload = bytes + sizeof(header);
+  qint64 payloadSize = (qint64)header.payloadSize;
+  if (fnv1a(FNV_OFFSET_BASIS, payload, payloadSize) !=
+        header.payloadHash) {
+    return ret;
+  }
+
+  // The checksum catches accidental damage, but the rest must still
+  // be checked, since a bad offset or bbox would mean reading or
+  // drawing out of bounds.
+  CacheFont cf;
+  if (payloadSize < (qint64)sizeof(cf)) {
+    return ret;
+  }
+  memcpy(&cf, payload, sizeof(cf));
+  if (cf.glyphIndexLimit < 0 || cf.numGlyphs < 0 || cf.numPages < 1) {
+    return ret;
+  }
+
+  qint64 glyphsStart = sizeof(cf);
+  qint64 pagesStart =
+    glyphsStart + (qint64)cf.numGlyphs * sizeof(QtBDFFontGlyphData);
+  qint64 pagesEnd = pagesStart + (qint64)cf.numPages * sizeof(CachePage);
+  if (pagesEnd > payloadSize) {
+    return ret;
+  }
+
+  ArrayStack<QtBDFFontPageData> pages(cf.numPages);
+  for (int p=0; p < cf.numPages; p++) {
+    CachePage cp;
+    memcpy(&cp, payload + pagesStart + p * sizeof(cp), sizeof(cp));
+    if (cp.width < 0 || cp.height < 0 ||
+        cp.bytesPerLine != (cp.width + 7) / 8 ||
+        cp.bitsOffset < pagesEnd ||
+        cp.bitsOffset + (qint64)cp.height * cp.bytesPerLine >
+          payloadSize) {
+      return ret;
+    }
+
+    QtBDFFontPageData pd;
+    pd.width = cp.width;
+    pd.height = cp.height;
+    pd.bytesPerLine = cp.bytesPerLine;
+    pd.bits = payload + cp.bitsOffset;
+    pages.push(pd);
+  }
+
+  // The glyphs are used in place.
+  QtBDFFontGlyphData const *glyphs =
+    reinterpret_cast<QtBDFFontGlyphData const *>(payload + glyphsStart);
+  int prevIndex = -1;
+  for (int g=0; g < cf.numGlyphs; g++) {
+    QtBDFFontGlyphData const &gd = glyphs[g];
+    if (gd.index <= prevIndex || gd.index >= cf.glyphIndexLimit ||
+        gd.page < 0 || gd.page >= cf.numPages) {
+      return ret;
+    }
+    prevIndex = gd.index;
+
+    QtBDFFontPageData const &pd = pages[gd.page];
+    if (gd.bboxX < 0 || gd.bboxY < 0 ||
+        gd.bboxWidth < 0 || gd.bboxHeight < 0 ||
+        gd.bboxX + gd.bboxWidth > pd.width ||
+        gd.bboxY + gd.bboxHeight > pd.height) {
+      return ret;
+    }
+  }
+
+  QtBDFFontData data;
+  data.version = QTBDFFONT_DATA_VERSION;
+  data.glyphIndexLimit = cf.glyphIndexLimit;
+  data.nominalWidth = cf.nominalWidth;
+  data.nominalHeight = cf.nominalHeight;
+  data.nominalOriginX = cf.nominalOriginX;
+  data.nominalOriginY = cf.nominalOriginY;
+  data.nominalOffsetX = cf.nominalOffsetX;
+  data.nominalOffsetY = cf.nominalOffsetY;
+  data.numGlyphs = cf.numGlyphs;
+  data.glyphs = glyphs;
+  data.numPages = cf.numPages;
+  data.pages = &pages[0];
+
+  ret.reset(new QtBDFFont(data));
+  return ret;
+}
+
+
+// Make a font from cache file 'fname' if it is valid for 'key'.
+static std::unique_ptr<QtBDFFont> loadCacheFile(QString const &fname,
+                                                quint64 key)
+{
+  QFile file(fname);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return std::unique_ptr<QtBDFFont>();
+  }
+
+  qint64 size = file.size();
+  if (uchar *bytes = file.map(0, size)) {
+    std::unique_ptr<QtBDFFont> ret = fontFromCacheBytes(bytes, size, key);
+    file.unmap(bytes);
+    return ret;
+  }
+
+  // Mapping is not possible on every platform and file system, and
+  // fails for empty files.
+  QByteArray contents = file.readAll();
+  return fontFromCacheBytes((unsigned char const*)contents.constData(),
+                            contents.size(), key);
+}
+
+
+// Write the atlas and metrics of 'font' to cache file 'fname'.
+// Failures are ignored.
+static void writeCacheFile(QString const &fname, quint64 key,
+                           QtBDFFont &font)
+{
+  QtBDFFontData data;
+  ArrayStack<QtBDFFontGlyphData> glyphs;
+  ArrayStack<QtBDFFontPageData> pages;
+  font.getData(data, glyphs, pages);
+
+  QByteArray payload;
+
+  CacheFont cf;
+  cf.glyphIndexLimit = data.glyphIndexLimit;
+  cf.nominalWidth = data.nominalWidth;
+  cf.nominalHeight = data.nominalHeight;
+  cf.nominalOriginX = data.nominalOriginX;
+  cf.nominalOriginY = data.nominalOriginY;
+  cf.nominalOffsetX = data.nominalOffsetX;
+  cf.nominalOffsetY = data.nominalOffsetY;
+  cf.numGlyphs = data.numGlyphs;
+  cf.numPages = data.numPages;
+  payload.append((char const*)&cf, sizeof(cf));
+
+  payload.append((char const*)data.glyphs,
+                 data.numGlyphs * sizeof(QtBDFFontGlyphData));
+
+  qint32 bitsOffset = payload.size() + data.numPages * sizeof(CachePage);
+  for (int p=0; p < data.numPages; p++) {
+    QtBDFFontPageData const &pd = data.pages[p];
+    CachePage cp;
+    cp.width = pd.width;
+    cp.height = pd.height;
+    cp.bytesPerLine = (pd.width + 7) / 8;
+    cp.bitsOffset = bitsOffset;
+    payload.append((char const*)&cp, sizeof(cp));
+    bitsOffset += cp.height * cp.bytesPerLine;
+  }
+
+  // Drop the padding at the end of each QImage row.
+  for (int p=0; p < data.numPages; p++) {
+    QtBDFFontPageData const &pd = data.pages[p];
+    int rowBytes = (pd.width + 7) / 8;
+    for (int y=0; y < pd.height; y++) {
+      payload.append((char const*)(pd.bits + y * pd.bytesPerLine),
+                     rowBytes);
+    }
+  }
+  xassert(payload.size() == bitsOffset);
+
+  CacheHeader header;
+  memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.byteOrder = BYTE_ORDER_MARK;
+  header.formatVersion = CACHE_FORMAT_VERSION;
+  header.key = key;
+  header.payloadSize = payload.size();
+  header.payloadHash =
+    fnv1a(FNV_OFFSET_BASIS, payload.constData(), payload.size());
+
+  QDir().mkpath(QFileInfo(fname).path());
+
+  // QSaveFile writes a temporary file and renames it into place, so
+  // another process never maps a partly written file.
+  QSaveFile file(fname);
+  if (file.open(QIODevice::WriteOnly)) {
+    file.write((char const*)&header, sizeof(header));
+    file.write(payload);
+    file.commit();
+  }
+}
+
+
+std::unique_ptr<QtBDFFont> loadBDFFontCached(
+  rostring bdfFileName,
+  rostring cacheDir,
+  QtBDFFont::Options const &options,
+  AtlasCacheResult *result)
+{
+  std::unique_ptr<QtBDFFont> ret;
+
+  QFile bdfFile(toQString(bdfFileName));
+  if (!bdfFile.open(QIODevice::ReadOnly)) {
+    // Let the parser report the problem.
+    BDFFont bdf;
+    parseBDFFile(bdf, bdfFileName.c_str());
+    ret.reset(new QtBDFFont(bdf, options));
+    if (result) {
+      *result = ACR_MISS;
+    }
+    return ret;
+  }
+
+  // Hashing the contents is much faster than parsing them.
+  QByteArray contents = bdfFile.readAll();
+  quint64 key = computeCacheKey(contents, options);
+  QString cacheFname = toQString(cacheFileName(key, cacheDir));
+
+  bool exists = QFile::exists(cacheFname);
+  if (exists) {
+    ret = loadCacheFile(cacheFname, key);
+    if (ret) {
+      if (result) {
+        *result = ACR_HIT;
+      }
+      return ret;
+    }
+  }
+
+  // Parse what was hashed, in case the file has changed since.
+  BDFFont bdf;
+  parseBDFString(bdf, contents.constData());
+  ret.reset(new QtBDFFont(bdf, options));
+
+  writeCacheFile(cacheFname, key, *ret);
+  if (result) {
+    *result = exists? ACR_REBUILT : ACR_MISS;
+  }
+  return ret;
+}
+
+
+// EOF
@@ -0,0 +1,67 @@
+// qtbdffont-cache.h
+// loadBDFFontCached, loading QtBDFFonts through an on-disk atlas cache.
+
+#ifndef SMQTUTIL_QTBDFFONT_CACHE_H
+#define SMQTUTIL_QTBDFFONT_CACHE_H
+
+// this directory
+#include "qtbdffont.h"                 // QtBDFFont
+
+// smbase
+#include "str.h"                       // rostring
+
+// Qt
+#include <qbytearray.h>                // QByteArray
+
+// libc++
+#include <memory>                      // std::unique_ptr
+
+
+// How 'loadBDFFontCached' got the font.
+enum AtlasCacheResult {
+  ACR_HIT,                             // from a valid cache file
+  ACR_MISS,                            // from the BDF; no cache file
+  ACR_REBUILT,                         // from the BDF; cache file was bad
+
+  NUM_ATLAS_CACHE_RESULTS
+};
+
+// Return a string like "ACR_HIT".
+char const *toString(AtlasCacheResult result);
+
+
+// Load the BDF font in 'bdfFileName' as a QtBDFFont, using a binary
+// cache of its packed atlas and metrics in directory 'cacheDir'.
+//
+// The cache file is named after a hash of the BDF contents and
+// 'options', so editing the font or changing the options selects a
+// different file.  A valid cache file is memory-mapped (or read, where
+// mapping is not possible) and its bits are copied straight into the
+// atlas, skipping BDF parsing and glyph packing.  Otherwise the font
+// is built from the BDF as usual and the cache file is (re)written.
+// A file with the wrong format version, byte order, or key, or that is
+// truncated or fails its checksum, is treated as missing.
+//
+// A font loaded from the cache has a complete atlas even if 'options'
+// ask for a lazy one, and writing the cache completes a lazy atlas.
+//
+// Problems with the cache directory are ignored, since the cache only
+// affects speed; errors reading or parsing the BDF file throw as
+// 'parseBDFFile' does.
+//
+// If 'result' is not NULL, set it to say how the font was obtained.
+std::unique_ptr<QtBDFFont> loadBDFFontCached(
+  rostring bdfFileName,
+  rostring cacheDir,
+  QtBDFFont::Options const &options = QtBDFFont::Options(),
+  AtlasCacheResult *result = nullptr);
+
+// Name of the cache file that 'loadBDFFontCached' would use for a font
+// whose BDF file contains 'bdfContents'.  For testing.
+string atlasCacheFileName(QByteArray const &bdfContents,
+                          rostring cacheDir,
+                          QtBDFFont::Options const &options =
+                            QtBDFFont::Options());
+
+
+#endif // SMQTUTIL_QTBDFFONT_CACHE_H
@@ -0,0 +1,205 @@
+// qtbdffont-chain.cc
+// code for qtbdffont-chain.h; tests are in test-qtbdffont.cc
+
+#include "qtbdffont-chain.h"           // this module
+
+// this directory
+#include "qtbdffont.h"                 // QtBDFFont
+
+// smbase
+#include "xassert.h"                   // xassert
+
+
+QtBDFFontChain::QtBDFFontChain()
+  : m_fonts(),
+    m_minihexFont(nullptr),
+    m_resolved(new CodePointTable<unsigned char>(CODE_POINT_LIMIT)),
+    m_numSearches(0),
+    m_runOrigins(),
+    m_runIndices()
+{}
+
+
+QtBDFFontChain::~QtBDFFontChain()
+{}
+
+
+void QtBDFFontChain::addFont(QtBDFFont *font)
+{
+  xassert(font);
+  xassert(m_fonts.length() < MAX_FONTS);
+  m_fonts.push(font);
+
+  // A code point that resolved to R_NONE might be in the new font.
+  m_resolved.reset(new CodePointTable<unsigned char>(CODE_POINT_LIMIT));
+  m_numSearches = 0;
+}
+
+
+QtBDFFont &QtBDFFontChain::getFont(int i) const
+{
+  return *(m_fonts[i]);
+}
+
+
+void QtBDFFontChain::setMinihexFont(QtBDFFont *minihexFont)
+{
+  m_minihexFont = minihexFont;
+}
+
+
+// Return the index of the first font with 'codePoint', or -1.
+int QtBDFFontChain::searchFonts(int codePoint) const
+{
+  for (int i=0; i < m_fonts.length(); i++) {
+    if (m_fonts[i]->hasChar(codePoint)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+int QtBDFFontChain::fontIndexFor(int codePoint)
+{
+  if ((unsigned)codePoint >= (unsigned)CODE_POINT_LIMIT) {
+    // Not Unicode, so not worth remembering.
+    return searchFonts(codePoint);
+  }
+
+  unsigned char r = m_resolved->get(codePoint);
+  if (r == R_UNKNOWN) {
+    int index = searchFonts(codePoint);
+    m_numSearches++;
+    r = (index < 0)? (unsigned char)R_NONE : (unsigned char)(index + 1);
+    m_resolved->getForWrite(codePoint) = r;
+  }
+  return (r == R_NONE)? -1 : r - 1;
+}
+
+
+QtBDFFont *QtBDFFontChain::fontFor(int codePoint)
+{
+  int index = fontIndexFor(codePoint);
+  return (index < 0)? nullptr : m_fonts[index];
+}
+
+
+QPoint QtBDFFontChain::getCharOffset(int codePoint)
+{
+  int index = fontIndexFor(codePoint);
+  if (index >= 0) {
+    return m_fonts[index]->getCharOffset(codePoint);
+  }
+  else {
+    return getFont(0).getNominalCharOffset();
+  }
+}
+
+
+QPoint QtBDFFontChain::drawChar(QPainter &dest, QPoint pt, int codePoint)
+{
+  xassert(m_fonts.isNotEmpty());
+
+  int index = fontIndexFor(codePoint);
+  if (index >= 0) {
+    QtBDFFont &font = *(m_fonts[index]);
+    font.drawChar(dest, pt, codePoint);
+    return pt + font.getCharOffset(codePoint);
+  }
+  else {
+    QtBDFFont &primary = getFont(0);
+    if (m_minihexFont) {
+      primary.drawHexQuadCell(*m_minihexFont, dest, pt, codePoint);
+    }
+    return pt + primary.getNominalCharOffset();
+  }
+}
+
+
+// Draw the accumulated run for font 'fontIndex', if any.
+void QtBDFFontChain::flushRun(QPainter &dest, int fontIndex)
+{
+  if (m_runIndices.isNotEmpty()) {
+    m_fonts[fontIndex]->drawCharsAt(dest, &m_runOrigins[0],
+                                    &m_runIndices[0],
+                                    m_runIndices.length());
+    m_runOrigins.clear();
+    m_runIndices.clear();
+  }
+}
+
+
+QPoint QtBDFFontChain::drawCodePoints(QPainter &dest, QPoint pt,
+                                      int const *codePoints, int n)
+{
+  xassert(m_fonts.isNotEmpty());
+
+  // Font of the run in 'm_runIndices'.
+  int runFont = -1;
+
+  for (int i=0; i < n; i++) {
+    int codePoint = codePoints[i];
+    int index = fontIndexFor(codePoint);
+
+    if (index != runFont) {
+      flushRun(dest, runFont);
+      runFont = index;
+    }
+
+    if (index >= 0) {
+      m_runOrigins.push(pt);
+      m_runIndices.push(codePoint);
+      pt += m_fonts[index]->getCharOffset(codePoint);
+    }
+    else {
+      // Hex quads are not batched, but are cached blits.
+      pt = drawChar(dest, pt, codePoint);
+    }
+  }
+
+  flushRun(dest, runFont);
+  return pt;
+}
+
+
+void QtBDFFontChain::setFgColor(QColor const &color)
+{
+  for (int i=0; i < m_fonts.length(); i++) {
+    m_fonts[i]->setFgColor(color);
+  }
+  if (m_minihexFont) {
+    m_minihexFont->setFgColor(color);
+  }
+}
+
+
+void QtBDFFontChain::setBgColor(QColor const &color)
+{
+  for (int i=0; i < m_fonts.length(); i++) {
+    m_fonts[i]->setBgColor(color);
+  }
+  if (m_minihexFont) {
+    m_minihexFont->setBgColor(color);
+  }
+}
+
+
+void QtBDFFontChain::setTransparent(bool transparent)
+{
+  for (int i=0; i < m_fonts.length(); i++) {
+    m_fonts[i]->setTransparent(transparent);
+  }
+  if (m_minihexFont) {
+    m_minihexFont->setTransparent(transparent);
+  }
+}
+
+
+long QtBDFFontChain::resolutionMemoryUsage() const
+{
+  return m_resolved->memoryUsage();
+}
+
+
+// EOF
@@ -0,0 +1,139 @@
+// qtbdffont-chain.h
+// QtBDFFontChain class.
+
+#ifndef SMQTUTIL_QTBDFFONT_CHAIN_H
+#define SMQTUTIL_QTBDFFONT_CHAIN_H
+
+// this directory
+#include "code-point-table.h"          // CodePointTable
+
+// smbase
+#include "array.h"                     // ArrayStack
+#include "sm-macros.h"                 // NO_OBJECT_COPIES
+
+// Qt
+#include <QColor>
+#include <QPoint>
+
+// libc++
+#include <memory>                      // std::unique_ptr
+
+class QPainter;                        // qpainter.h
+class QtBDFFont;                       // qtbdffont.h
+
+
+// An ordered list of fonts, each code point being drawn with the first
+// font that has a glyph for it.  For example, a small, fast primary
+// font such as editor14r can be followed by a large font with broad
+// Unicode coverage.  Code points that no font has are drawn as hex
+// quads with an optional minihex font, in the nominal cell of the
+// primary font.
+//
+// The font chosen for each code point is remembered in a compact table
+// (one byte per code point, allocated in pages as the code points are
+// used), so after the first use of a code point, resolving it costs
+// one lookup no matter how long the chain is.
+//
+// The fonts are not owned and must outlive the chain.
+class QtBDFFontChain {
+  NO_OBJECT_COPIES(QtBDFFontChain);
+
+public:      // types
+  enum {
+    // Maximum number of fonts in a chain.
+    MAX_FONTS = 250,
+
+    // Exclusive upper bound on code points whose resolution is
+    // remembered.  This covers all of Unicode.
+    CODE_POINT_LIMIT = 0x110000,
+  };
+
+private:     // types
+  // Values in 'm_resolved' other than these are a font index plus one.
+  enum {
+    R_UNKNOWN = 0,                     // not yet resolved
+    R_NONE = 255,                      // no font has the code point
+  };
+
+private:     // data
+  // The fonts, in order of preference.
+  ArrayStack<QtBDFFont*> m_fonts;
+
+  // Font for hex quads, or NULL to leave missing code points blank.
+  QtBDFFont *m_minihexFont;
+
+  // Map from code point to its resolution.  Reset when the set of
+  // fonts changes.
+  std::unique_ptr<CodePointTable<unsigned char> > m_resolved;
+
+  // Number of code points resolved by searching the fonts, rather
+  // than found in 'm_resolved'.
+  long m_numSearches;
+
+  // Reused by 'drawCodePoints' to accumulate a run for one font.
+  ArrayStack<QPoint> m_runOrigins;
+  ArrayStack<int> m_runIndices;
+
+private:     // funcs
+  int searchFonts(int codePoint) const;
+  void flushRun(QPainter &dest, int fontIndex);
+
+public:      // funcs
+  // Make an empty chain.  Add fonts with 'addFont'.
+  QtBDFFontChain();
+  ~QtBDFFontChain();
+
+  // Append 'font' to the chain.  This discards remembered resolutions.
+  void addFont(QtBDFFont *font);
+
+  // Number of fonts in the chain.
+  int numFonts() const { return m_fonts.length(); }
+
+  // Font 'i' in the chain.  Font 0 is the primary font.
+  QtBDFFont &getFont(int i) const;
+
+  // Get and set the font used for hex quads.  It may be NULL.
+  QtBDFFont *getMinihexFont() const { return m_minihexFont; }
+  void setMinihexFont(QtBDFFont *minihexFont);
+
+  // Index of the first font that has 'codePoint', or -1 if none does.
+  int fontIndexFor(int codePoint);
+
+  // The first font that has 'codePoint', or NULL if none does.
+  QtBDFFont *fontFor(int codePoint);
+
+  // Offset from the origin of 'codePoint' to the origin of the next
+  // character.  For a code point no font has, this is the nominal
+  // offset of the primary font.
+  QPoint getCharOffset(int codePoint);
+
+  // Draw 'codePoint' at 'pt' with the font it resolves to, or as a hex
+  // quad, and return the origin for the next character.  The chain
+  // must have at least one font.
+  QPoint drawChar(QPainter &dest, QPoint pt, int codePoint);
+
+  // Draw the 'n' code points in 'codePoints' starting at 'pt', and
+  // return the origin for the next character.  The result is the same
+  // as calling 'drawChar' for each, but consecutive code points that
+  // resolve to the same font are drawn with one batched call to
+  // 'QtBDFFont::drawCharsAt'.
+  QPoint drawCodePoints(QPainter &dest, QPoint pt,
+                        int const *codePoints, int n);
+
+  // Set the colors and transparency of every font in the chain,
+  // including the minihex font.
+  void setFgColor(QColor const &color);
+  void setBgColor(QColor const &color);
+  void setTransparent(bool transparent);
+
+  // Number of code points resolved by searching the fonts since the
+  // resolutions were last discarded.  Each code point is searched at
+  // most once, so this is the number of distinct code points seen.
+  long numSearches() const { return m_numSearches; }
+
+  // Approximate number of bytes used to remember resolutions.
+  long resolutionMemoryUsage() const;
+};
+
+
+#endif // SMQTUTIL_QTBDFFONT_CHAIN_H
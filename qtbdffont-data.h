@@ -0,0 +1,80 @@
+// qtbdffont-data.h
+// QtBDFFontData, a QtBDFFont compiled at build time.
+
+#ifndef SMQTUTIL_QTBDFFONT_DATA_H
+#define SMQTUTIL_QTBDFFONT_DATA_H
+
+// The structures here are plain aggregates so that generated source
+// files can define them as 'constexpr' data, which the compiler places
+// in the read-only data segment with no run-time initialization.  The
+// 'compile-bdf-font' program writes such files from BDF fonts using
+// 'QtBDFFont::writeCompiledFont', and 'QtBDFFont(QtBDFFontData const&)'
+// turns the data back into a font without parsing or packing.
+//
+// All coordinates have the meanings of the corresponding fields of
+// QtBDFFont::Metrics.
+
+// Incremented whenever the layout or meaning of these structures
+// changes.  Sources written by 'writeCompiledFont' with a different
+// version fail to compile; other data with one is rejected at run time.
+enum { QTBDFFONT_DATA_VERSION = 1 };
+
+
+// Metrics of one present glyph.
+struct QtBDFFontGlyphData {
+  // Character index.
+  int index;
+
+  // Location of the glyph in its atlas page.
+  int bboxX, bboxY, bboxWidth, bboxHeight;
+
+  // Location of the glyph origin in its atlas page.
+  int originX, originY;
+
+  // Offset to the next origin.
+  int offsetX, offsetY;
+
+  // Index of the atlas page.
+  int page;
+};
+
+
+// One atlas page, as a 1-bit image.
+struct QtBDFFontPageData {
+  // Dimensions in pixels.
+  int width, height;
+
+  // Bytes from one row in 'bits' to the next, at least the
+  // '(width+7)/8' bytes a row needs.  Compiled data has no padding.
+  int bytesPerLine;
+
+  // 'height' rows of pixels, in QImage::Format_MonoLSB bit order
+  // (leftmost pixel in the least significant bit), 1 for foreground.
+  unsigned char const *bits;
+};
+
+
+// A whole font.
+struct QtBDFFontData {
+  // Must be QTBDFFONT_DATA_VERSION.
+  int version;
+
+  // Exclusive upper bound on character indices.
+  int glyphIndexLimit;
+
+  // Nominal font-wide metrics, as QtBDFFont::nominalFontMetrics.
+  int nominalWidth, nominalHeight;
+  int nominalOriginX, nominalOriginY;
+  int nominalOffsetX, nominalOffsetY;
+
+  // Present glyphs, in increasing order of 'index'.
+  int numGlyphs;
+  QtBDFFontGlyphData const *glyphs;
+
+  // Atlas pages.
+  int numPages;
+  QtBDFFontPageData const *pages;
+};
+
+
+#endif // SMQTUTIL_QTBDFFONT_DATA_H
@@ -11,21 +11,37 @@
 #include "bit2d.h"                     // Bit2d::Size
 #include "exc.h"                       // xbase
 #include "sm-test.h"                   // DEBUG_PVAL
-#include "strtokp.h"                   // StrtokParse
 
 // Qt
 #include <qimage.h>                    // QImage
 #include <qpainter.h>                  // QPainter
+#include <qvarlengtharray.h>           // QVarLengthArray
+
+// libc++
+#include <algorithm>                   // std::sort
+#include <ostream>                     // std::ostream
 
 // libc
+#include <limits.h>                    // INT_MIN, INT_MAX
+#include <math.h>                      // ceil, sqrt
 #include <stdio.h>                     // snprintf (needs C99 or C++11)
+#include <stdlib.h>                    // abs
+#include <string.h>                    // memchr, memcpy
+
+// SIMD intrinsics for expanding glyph bits in 'drawChar(QImage&)'.
+#if defined(__AVX2__)
+#  include <immintrin.h>               // _mm256_*
+#elif defined(__SSE2__)
+#  include <emmintrin.h>               // _mm_*
+#endif
 
 
 // --------------------- QtBDFFont::Metrics -----------------------
 QtBDFFont::Metrics::Metrics()
   : bbox(0,0,0,0),
     origin(0,0),
-    offset(0,0)
+    offset(0,0),
+    page(0)
 {}
 
 
@@ -43,7 +59,239 @@ bool QtBDFFont::Metrics::isPresent() const
 }
 
 
+// -------------------- QtBDFFont::AtlasPage ----------------------
+QtBDFFont::AtlasPage::AtlasPage()
+  : glyphMask(),
+    maskImage(),
+    indexedImage(),
+    stale(false)
+{}
+
+
+QtBDFFont::AtlasPage::~AtlasPage()
+{}
+
+
+// -------------------- QtBDFFont::ColorKey ----------------------
+QtBDFFont::ColorKey::ColorKey(QColor const &fgColor,
+                              QColor const &bgColor,
+                              bool t, int b)
+  : fg(fgColor.rgba()),
+    bg(t? 0 : bgColor.rgba()),
+    transparent(t),
+    backend(b)
+{}
+
+
+bool QtBDFFont::ColorKey::operator< (ColorKey const &obj) const
+{
+  if (fg != obj.fg) {
+    return fg < obj.fg;
+  }
+  if (bg != obj.bg) {
+    return bg < obj.bg;
+  }
+  if (transparent != obj.transparent) {
+    return transparent < obj.transparent;
+  }
+  return backend < obj.backend;
+}
+
+
+// -------------------- QtBDFFont::LineKey ----------------------
+QtBDFFont::LineKey::LineKey(ColorKey const &c, QByteArray const &t)
+  : colors(c),
+    text(t)
+{}
+
+
+bool QtBDFFont::LineKey::operator< (LineKey const &obj) const
+{
+  if (colors < obj.colors) {
+    return true;
+  }
+  if (obj.colors < colors) {
+    return false;
+  }
+  return text < obj.text;
+}
+
+
+// ------------------- QtBDFFont::HexQuadKey ---------------------
+QtBDFFont::HexQuadKey::HexQuadKey(QtBDFFont const &minihexFont,
+                                  int cp)
+  : minihexSerialNumber(minihexFont.serialNumber),
+    colors(minihexFont.fgColor, minihexFont.bgColor,
+           minihexFont.transparent, 0),
+    codePoint(cp)
+{}
+
+
+bool QtBDFFont::HexQuadKey::operator< (HexQuadKey const &obj) const
+{
+  if (minihexSerialNumber != obj.minihexSerialNumber) {
+    return minihexSerialNumber < obj.minihexSerialNumber;
+  }
+  if (colors < obj.colors) {
+    return true;
+  }
+  if (obj.colors < colors) {
+    return false;
+  }
+  return codePoint < obj.codePoint;
+}
+
+
+// ------------------- QtBDFFont::ByteMetrics ---------------------
+QtBDFFont::ByteMetrics::ByteMetrics()
+  : horizontal(true),
+    monospaceAdvance(0),
+    allPresent(false)
+{
+  for (int i=0; i < NUM_BYTES; i++) {
+    advanceX[i] = advanceY[i] = 0;
+    left[i] = top[i] = right[i] = bottom[i] = 0;
+    flags[i] = 0;
+  }
+}
+
+
+// -------------------- QtBDFFont::ElideKey ---------------------
+QtBDFFont::ElideKey::ElideKey(QByteArray const &t, int w, int m)
+  : text(t),
+    width(w),
+    mode(m)
+{}
+
+
+bool QtBDFFont::ElideKey::operator< (ElideKey const &obj) const
+{
+  if (width != obj.width) {
+    return width < obj.width;
+  }
+  if (mode != obj.mode) {
+    return mode < obj.mode;
+  }
+  return text < obj.text;
+}
+
+
+// -------------------- QtBDFFont::ElideCut ---------------------
+QtBDFFont::ElideCut::ElideCut()
+  : prefixLength(0),
+    suffixStart(0),
+    elided(false)
+{}
+
+
+// ------------------- QtBDFFont::CachedLine ---------------------
+QtBDFFont::CachedLine::CachedLine()
+  : pixmap(),
+    offset(0,0),
+    advance(0,0)
+{}
+
+
+// --------------------- QtBDFFont::Options -----------------------
+QtBDFFont::Options::Options()
+    // The Qt docs say that some window systems have trouble with
+    // pixmap dimensions exceeding 4k, so stay well under that.
+  : maxPageDimension(2048),
+    padToNominalCell(false),
+    lazyAtlas(false)
+{}
+
+
+// -------------------- QtBDFFont::LazyAtlas ----------------------
+class QtBDFFont::LazyAtlas {
+  NO_OBJECT_COPIES(LazyAtlas);
+
+public:      // types
+  // A glyph whose pixels have not been copied into the atlas.
+  class PendingGlyph {
+  public:    // data
+    // Upper-left corner of the pixels relative to the glyph's slot,
+    // which is larger than the pixels when padded to its cell.
+    QPoint corner;
+
+    // Size of the pixels.
+    QSize size;
+
+    // Offset in 'bits' of 'size.height()' rows of
+    // '(size.width()+7)/8' bytes each, in MonoLSB bit order.
+    int bitsOffset;
+  };
+
+  // A row of glyphs on the active page, as in the eager packing.
+  class Shelf {
+  public:    // data
+    int top;
+    int height;
+
+    // Left edge for the next glyph.
+    int x;
+  };
+
+public:      // data
+  // Map from character index to one plus the index of its entry in
+  // 'pending', or 0 if it has none.
+  CodePointTable<int> pendingIndex;
+
+  // Glyphs with pixels to copy, and those pixels.
+  ArrayStack<PendingGlyph> pending;
+  ArrayStack<uchar> bits;
+
+  // Number of glyphs in 'pending' not yet in the atlas.
+  int numUnplaced;
+
+  // Width of every page, except those holding a single glyph too big
+  // to share one.
+  int pageWidth;
+
+  // Copied from 'Options'.
+  int maxPageDimension;
+
+  // Index in 'pages' of the page that glyphs are being added to.  It
+  // is the last page, except that pages holding a single oversized
+  // glyph are added after it.
+  int activePage;
+
+  // Shelves on the active page, and the top of the next one.
+  ArrayStack<Shelf> shelves;
+  int bottom;
+
+  // True if some page is 'stale'.
+  bool anyStale;
+
+public:
+  LazyAtlas(int glyphIndexLimit, int pageWidth, int maxPageDimension);
+};
+
+
+QtBDFFont::LazyAtlas::LazyAtlas(int glyphIndexLimit, int pw, int mpd)
+  : pendingIndex(glyphIndexLimit),
+    pending(),
+    bits(),
+    numUnplaced(0),
+    pageWidth(pw),
+    maxPageDimension(mpd),
+    activePage(0),
+    shelves(),
+    bottom(0),
+    anyStale(false)
+{}
+
+
 // ------------------------- QtBDFFont --------------------------
+// True if a glyph of 'size' is too big to share a page whose
+// dimensions are limited to 'maxPageDimension'.
+static bool needsOwnPage(QSize size, int maxPageDimension)
+{
+  return size.width() > maxPageDimension ||
+         size.height() > maxPageDimension;
+}
+
+
 // Compute the 'origin' of QtBDFFont::Metrics from GlyphMetrics.
 static QPoint originFromGlyphMetrics(BDFFont::GlyphMetrics const &gmet)
 {
@@ -65,51 +313,127 @@ static QPoint originFromGlyphMetrics(BDFFont::GlyphMetrics const &gmet)
 }
 
 
-QtBDFFont::QtBDFFont(BDFFont const &font)
-  : glyphMask(),             // Null for now
-    colorPixmap(),
+unsigned long QtBDFFont::nextSerialNumber = 1;
+
+
+QtBDFFont::QtBDFFont(int glyphIndexLimit)
+  : pages(),
+    lazyAtlas(),
     fgColor(0,0,0),          // black
     bgColor(255,255,255),    // white
-    colorPixmapState(CPS_SOLID),
     allCharsBBox(0,0,0,0),
-    metrics(font.glyphIndexLimit()),
+    metrics(glyphIndexLimit),
     nominalFontMetrics(),
-    transparent(true)
-{
-  // The main thing this constructor does is build the 'glyphMask'
-  // bitmap and the 'metrics' array.  To do so, we pack the glyph
-  // images into a rectangular bitmap.  In general, optimal packing is
-  // NP-complete, and the benefit of efficiency here is not great, so
-  // I use a completely naive strategy of putting them horizontally
-  // adjacent, aligned at the bounding box top.
+    byteMetrics(),
+    leftToRight(true),
+    transparent(true),
+    backend(B_MASKED_PIXMAP),
+    indexedColorTable(),
+    colorPixmapCache(8 * 1024 * 1024),
+    currentColorPixmaps(NULL),
+    lineCache(0),
+    hexQuadCache(2 * 1024 * 1024),
+    prefixAdvanceCache(1024 * 1024),
+    elideCache(256 * 1024),
+    serialNumber(nextSerialNumber++)
+{
+  updateIndexedColorTable();
+}
+
+
+QtBDFFont::QtBDFFont(BDFFont const &font, Options const &options)
+  : QtBDFFont(font.glyphIndexLimit())
+{
+  ObjArrayStack<QImage> masks;
+  packGlyphs(font, options, masks);
+  installPages(masks);
+}
+
+
+// OR the 'w' pixels in 'src' into MonoLSB row 'destRow' starting at
+// pixel 'destX'.  'src' holds pixel 'x' in bit 'x%8' of byte 'x/8',
+// the MonoLSB and Bit2d order; bits past 'w' are ignored.  When
+// 'destX' is not a multiple of 8, each source byte is shifted across
+// the two destination bytes it straddles.
+static void orBitsIntoRow(uchar *destRow, int destX,
+                          uchar const *src, int w)
+{
+  uchar *dest = destRow + (destX >> 3);
+  int shift = destX & 7;
+  int numBytes = (w + 7) / 8;
+
+  // Bits shifted out of the previous byte.
+  unsigned carry = 0;
+
+  for (int b=0; b < numBytes; b++) {
+    unsigned v = src[b];
+    if (b == numBytes-1 && (w & 7)) {
+      v &= (1u << (w & 7)) - 1;
+    }
+    unsigned shifted = (v << shift) | carry;
+    dest[b] |= (uchar)shifted;
+    carry = shifted >> 8;
+  }
+
+  // Nonzero only if it holds pixels, which are then within the row.
+  if (carry) {
+    dest[numBytes] |= (uchar)carry;
+  }
+}
+
+
+// Compute 'metrics', 'nominalFontMetrics', 'allCharsBBox' and
+// 'leftToRight' from 'font', and put the glyph images into 'masks', one
+// MonoLSB image per atlas page.
+void QtBDFFont::packGlyphs(BDFFont const &font, Options const &options,
+                           ObjArrayStack<QImage> &tempMasks)
+{
+  // The main thing this function does is build the atlas pages
+  // and the 'metrics' array.  To do so, we pack the glyph images into
+  // rectangular bitmaps.  In general, optimal packing is NP-complete,
+  // and the benefit of efficiency here is not great, so I use a
+  // simple "shelf" strategy: sort the glyphs by decreasing height,
+  // then lay them out left to right in rows ("shelves") whose height
+  // is that of the first (tallest) glyph in the row.  When a page
+  // runs out of vertical room, start another page.
   //
-  // However, it seems likely that with just a bit more work, I could
-  // get a more efficient structure that tried to arrange glyphs in
-  // several regular-height rows, with taller-than-usual glyphs off to
-  // the side.  This would also have the advantage of reducing the
-  // maximum dimension of the pixmap; the Qt docs explain that some
-  // window systems have trouble with dimensions exceeding 4k.  But
-  // I'll save those optimizations for another time.
-
-  // maximum glyph height encountered so far
-  int maxHeight = 0;
-
-  // current horizontal position for the next glyph's left edge
-  int currentX = 0;
-
-  // Pass 1: Compute 'metrics'.
-  for (int i=0; i < metrics.allocatedSize(); i++) {
+  // The page width is chosen so that, if everything fits on one page,
+  // that page is roughly square.
+
+  // Glyphs that need space in the atlas, and their total area.
+  ArrayStack<int> toPack;
+  long totalArea = 0;
+  int maxWidth = 0;
+
+  // Grab font-wide metrics.
+  {
+    BDFFont::GlyphMetrics const &gmet = font.metrics;
+    this->nominalFontMetrics.bbox =
+      QRect(0, 0, gmet.bbSize.x, gmet.bbSize.y);
+    this->nominalFontMetrics.origin = originFromGlyphMetrics(gmet);
+
+    // It is a little sketchy to just assume that the bbox provides
+    // a good inter-character offset, but I don't have any other
+    // metric to use.
+    this->nominalFontMetrics.offset = QPoint(gmet.bbSize.x, 0);
+  }
+
+  // Origin-relative nominal cell, for 'padToNominalCell'.
+  QRect nominalCell = getNominalCharCell(QPoint(0,0));
+
+  // Pass 1: Compute 'metrics', except for the atlas location.
+  for (int i=0; i < metrics.limit(); i++) {
     BDFFont::Glyph const *glyph = font.getGlyph(i);
     if (!glyph) {
       // metrics[i] should already be zeroed
       continue;
     }
     BDFFont::GlyphMetrics const &gmet = glyph->metrics;
+    Metrics &met = metrics.getForWrite(i);
 
-    // place glyph 'i' here
-    metrics[i].bbox = QRect(currentX, 0,
-                            gmet.bbSize.x, gmet.bbSize.y);
-    metrics[i].origin = QPoint(currentX, 0) + originFromGlyphMetrics(gmet);
+    // Size of the glyph; it gets moved into place below.
+    met.bbox = QRect(0, 0, gmet.bbSize.x, gmet.bbSize.y);
+    met.origin = originFromGlyphMetrics(gmet);
 
     // Get movement offset, which might come from 'font'.
     point dWidth = gmet.hasDWidth()?
@@ -119,318 +443,2004 @@ QtBDFFont::QtBDFFont(BDFFont const &font)
     // Origin movement offset.  Same as 'dWidth', except again the 'y'
     // axis inverted.  Except, you'd never know, since in practice it
     // will always be 0.
-    metrics[i].offset = QPoint(dWidth.x, -dWidth.y);
+    met.offset = QPoint(dWidth.x, -dWidth.y);
+    if (met.offset.x() < 0 || met.offset.y() != 0) {
+      leftToRight = false;
+    }
 
-    // bump variables involved in packing calculation
-    maxHeight = max(maxHeight, gmet.bbSize.y);
-    currentX += gmet.bbSize.x;
+    if (options.padToNominalCell) {
+      // Enlarge the atlas slot to cover the glyph's cell: vertically
+      // the nominal cell, and horizontally from the origin to the
+      // next origin, so the cells of consecutive glyphs tile with no
+      // gaps.  The glyph pixels stay where they are relative to the
+      // origin; pass 2 finds them that way.
+      int cellWidth = met.offset.x() > 0? met.offset.x() :
+                                          nominalCell.width();
+      QRect slot(0, nominalCell.top(), cellWidth, nominalCell.height());
+      if (!met.bbox.isEmpty()) {
+        slot |= met.bbox.translated(-met.origin);
+      }
+      met.bbox = QRect(QPoint(0,0), slot.size());
+      met.origin = -slot.topLeft();
+    }
 
     // Update 'allCharsBBox'.  This call reads from 'metrics[i]'.
     allCharsBBox |= getCharBBox(i);
+
+    if (!met.bbox.isEmpty()) {
+      toPack.push(i);
+      totalArea += (long)met.bbox.width() * met.bbox.height();
+
+      // Glyphs that get pages of their own do not widen the others.
+      if (!needsOwnPage(met.bbox.size(), options.maxPageDimension)) {
+        maxWidth = max(maxWidth, met.bbox.width());
+      }
+    }
   }
 
-  // Grab font-wide metrics.
-  {
-    BDFFont::GlyphMetrics const &gmet = font.metrics;
-    this->nominalFontMetrics.bbox =
-      QRect(0, 0, gmet.bbSize.x, gmet.bbSize.y);
-    this->nominalFontMetrics.origin = originFromGlyphMetrics(gmet);
+  if (options.lazyAtlas) {
+    initLazyAtlas(font, options, toPack, maxWidth);
 
-    // It is a little sketchy to just assume that the bbox provides
-    // a good inter-character offset, but I don't have any other
-    // metric to use.
-    this->nominalFontMetrics.offset = QPoint(gmet.bbSize.x, 0);
+    // One empty page, which grows as glyphs are drawn.
+    tempMasks.push(newMaskImage(QSize(lazyAtlas->pageWidth, 0)));
+    return;
+  }
+
+  // Sort by decreasing height, then by index so the result is
+  // deterministic.
+  if (toPack.isNotEmpty()) {
+    int *begin = &(toPack[0]);
+    std::sort(begin, begin + toPack.length(),
+      [this](int a, int b) {
+        int ha = metrics[a].bbox.height();
+        int hb = metrics[b].bbox.height();
+        if (ha != hb) {
+          return ha > hb;
+        }
+        return a < b;
+      });
+  }
+
+  // Page width.  The 8/7 factor is slack for the space wasted at the
+  // ends of the shelves.
+  int pageWidth = (int)ceil(sqrt((double)totalArea * 8 / 7));
+  pageWidth = min(pageWidth, options.maxPageDimension);
+  pageWidth = max(pageWidth, maxWidth);
+  pageWidth = max(pageWidth, 1);
+
+  // Packing state.  'pageSizes[p]' is the extent used on page 'p'.
+  ArrayStack<QSize> pageSizes;
+  pageSizes.push(QSize(0,0));
+  int shelfX = 0;            // left edge for the next glyph
+  int shelfTop = 0;          // top of the current shelf
+  int shelfHeight = 0;       // height of the current shelf
+
+  // Glyphs too big for a page, placed after the others.
+  ArrayStack<int> oversized;
+
+  for (int k=0; k < toPack.length(); k++) {
+    int i = toPack[k];
+    Metrics &met = metrics.getForWrite(i);
+    int w = met.bbox.width();
+    int h = met.bbox.height();
+
+    if (needsOwnPage(met.bbox.size(), options.maxPageDimension)) {
+      oversized.push(i);
+      continue;
+    }
+
+    if (shelfX + w > pageWidth) {
+      // Start a new shelf.
+      shelfTop += shelfHeight;
+      shelfX = 0;
+      shelfHeight = 0;
+    }
+
+    if (shelfTop > 0 && shelfTop + h > options.maxPageDimension) {
+      // Start a new page.
+      pageSizes.push(QSize(0,0));
+      shelfTop = 0;
+      shelfX = 0;
+      shelfHeight = 0;
+    }
+
+    // Place glyph 'i' here.
+    met.page = pageSizes.length() - 1;
+    met.bbox.moveTo(shelfX, shelfTop);
+    met.origin += QPoint(shelfX, shelfTop);
+
+    // Bump variables involved in packing calculation.
+    shelfX += w;
+    shelfHeight = max(shelfHeight, h);
+    pageSizes.top() = pageSizes.top().expandedTo(
+      QSize(shelfX, shelfTop + shelfHeight));
+  }
+
+  // Give each oversized glyph a page of its own, exactly its size.
+  // Its 'bbox' and 'origin' are already relative to (0,0).
+  for (int k=0; k < oversized.length(); k++) {
+    Metrics &met = metrics.getForWrite(oversized[k]);
+    pageSizes.push(met.bbox.size());
+    met.page = pageSizes.length() - 1;
   }
 
-  // Allocate an image with the same size as 'glyphMask' will
-  // ultimately be.  I use a QImage here because I'm going to use the
-  // slow method of copying individual pixels, for now, and a
-  // QPixmap/QBitmap is very slow at accessing individual pixels.
+  // Allocate images with the same sizes as the page glyph masks will
+  // ultimately be.  I use a QImage here because pass 2 writes its
+  // bits directly, and a QPixmap/QBitmap has no such access.
   //
   // Using MonoLSB instead of Mono is a small optimization, since
-  // internally QBitmap::fromImage will convert to MonoLSB.
-  QImage tempMask(currentX,                      // width
-                  maxHeight,                     // height
-                  QImage::Format_MonoLSB);
+  // internally QBitmap::fromImage will convert to MonoLSB.  It also
+  // has the same bit order as Bit2d, so rows copy without reversal.
+  for (int p=0; p < pageSizes.length(); p++) {
+    tempMasks.push(newMaskImage(pageSizes[p]));
+  }
+
+  // Pass 2: Copy the glyph images using the positions calculated
+  // above.
+  QVarLengthArray<uchar, 64> rowBytes;
+  for (int k=0; k < toPack.length(); k++) {
+    int i = toPack[k];
+    BDFFont::Glyph const *glyph = font.getGlyph(i);
+    if (!glyph->bitmap) {
+      continue;      // nothing to copy
+    }
+    xassert(glyph->bitmap->Size() == glyph->metrics.bbSize);
+
+    QImage *tempMask = tempMasks[metrics[i].page];
+    uchar *maskBits = tempMask->bits();
+    int maskBytesPerLine = tempMask->bytesPerLine();
+
+    // Upper-left corner of the glyph pixels in the page.  This is
+    // 'bbox.topLeft()' unless the slot was padded.
+    QPoint glyphCorner = metrics[i].origin -
+                         originFromGlyphMetrics(glyph->metrics);
+    int w = glyph->metrics.bbSize.x;
+    int h = glyph->metrics.bbSize.y;
+    xassert(glyphCorner.x() >= 0 &&
+            glyphCorner.x() + w <= tempMask->width());
+    xassert(glyphCorner.y() >= 0 &&
+            glyphCorner.y() + h <= tempMask->height());
+
+    // Copy a row at a time, 8 pixels per step.  This used to call
+    // 'QImage::setPixel' for every set pixel, which for a large font
+    // is millions of out-of-line calls.
+    int numRowBytes = (w + 7) / 8;
+    rowBytes.resize(numRowBytes);
+    for (int y=0; y < h; y++) {
+      for (int b=0; b < numRowBytes; b++) {
+        rowBytes[b] = glyph->bitmap->getByte(point(b*8, y));
+      }
+      orBitsIntoRow(maskBits + (glyphCorner.y() + y) * maskBytesPerLine,
+                    glyphCorner.x(), rowBytes.constData(), w);
+    }
+  }
+
+}
+
+
+// Make a blank MonoLSB image of 'size' for building an atlas page.
+QImage *QtBDFFont::newMaskImage(QSize size)
+{
+  QImage *mask = new QImage(size, QImage::Format_MonoLSB);
 
   // Strangely, although QImage defaults to 0=black and 1=white,
   // QBitmap::fromImage expects the opposite, and will invert the
   // bits if we don't pre-set the colors.
-  tempMask.setColor(0, QColor(Qt::color0).rgb());
-  tempMask.setColor(1, QColor(Qt::color1).rgb());
+  mask->setColor(0, QColor(Qt::color0).rgb());
+  mask->setColor(1, QColor(Qt::color1).rgb());
 
   // Start with 0 (transparent).
-  tempMask.fill(0);
+  mask->fill(0);
+  return mask;
+}
 
-  // Pass 2: Copy the glyph images using the positions calculated
-  // above.
-  for (int i=0; i < metrics.allocatedSize(); i++) {
+
+// Make the atlas 'pages' from the images built by 'packGlyphs', and
+// finish initialization.
+void QtBDFFont::installPages(ObjArrayStack<QImage> const &masks)
+{
+  for (int p=0; p < masks.length(); p++) {
+    AtlasPage *page = new AtlasPage;
+    pages.push(page);
+
+    // Keep the temporary image; it is needed by other backends.
+    page->maskImage = *(masks[p]);
+
+    // Create the glyph mask from the temporary image.  This
+    // allocates, converts the data from QImage to QBitmap, and copies
+    // it to the window system.
+    page->glyphMask = QBitmap::fromImage(page->maskImage);
+  }
+
+  computeByteMetrics();
+}
+
+
+// Width of lazy atlas pages, unless a glyph is wider.  Narrower than
+// eager pages, since a lazy page grows down one shelf at a time and
+// each growth re-uploads the whole page.
+enum { LAZY_PAGE_WIDTH = 512 };
+
+
+// For 'Options::lazyAtlas', keep the pixels of the glyphs in 'toPack'
+// so they can be placed later.  'maxWidth' is the greatest width among
+// those that do not need a page of their own.
+void QtBDFFont::initLazyAtlas(BDFFont const &font, Options const &options,
+                              ArrayStack<int> const &toPack, int maxWidth)
+{
+  int pageWidth = min((int)LAZY_PAGE_WIDTH, options.maxPageDimension);
+  pageWidth = max(pageWidth, maxWidth);
+  pageWidth = max(pageWidth, 1);
+  lazyAtlas.reset(new LazyAtlas(metrics.limit(), pageWidth,
+                                options.maxPageDimension));
+  LazyAtlas &lazy = *lazyAtlas;
+
+  for (int k=0; k < toPack.length(); k++) {
+    int i = toPack[k];
     BDFFont::Glyph const *glyph = font.getGlyph(i);
-    if (!glyph) {
-      continue;
+    Metrics &met = metrics.getForWrite(i);
+    met.page = -1;
+
+    LazyAtlas::PendingGlyph pg;
+    pg.corner = met.origin - originFromGlyphMetrics(glyph->metrics);
+    pg.size = QSize(0,0);
+    pg.bitsOffset = lazy.bits.length();
+
+    if (glyph->bitmap) {
+      // Same row format as pass 2 of 'packGlyphs' uses.
+      xassert(glyph->bitmap->Size() == glyph->metrics.bbSize);
+      pg.size = QSize(glyph->metrics.bbSize.x, glyph->metrics.bbSize.y);
+      int numRowBytes = (pg.size.width() + 7) / 8;
+      for (int y=0; y < pg.size.height(); y++) {
+        for (int b=0; b < numRowBytes; b++) {
+          lazy.bits.push(glyph->bitmap->getByte(point(b*8, y)));
+        }
+      }
     }
 
-    if (!glyph->bitmap) {
-      continue;      // nothing to copy
+    lazy.pending.push(pg);
+    lazy.pendingIndex.getForWrite(i) = lazy.pending.length();
+    lazy.numUnplaced++;
+  }
+}
+
+
+// Copy glyph 'index', which must be unplaced, into the atlas, growing
+// the active page or adding one as needed.  This marks the page stale;
+// 'syncPages' must be called before drawing from it with a QPainter.
+void QtBDFFont::placeGlyph(int index)
+{
+  LazyAtlas &lazy = *lazyAtlas;
+  Metrics &met = metrics.getForWrite(index);
+  xassert(met.page < 0);
+  int w = met.bbox.width();
+  int h = met.bbox.height();
+
+  // Upper-left corner of the glyph's slot in its page.
+  QPoint corner(0,0);
+
+  if (needsOwnPage(QSize(w, h), lazy.maxPageDimension)) {
+    // Put it on a page of its own, leaving the active page as is.
+    std::unique_ptr<QImage> mask(newMaskImage(QSize(w, h)));
+    AtlasPage *page = new AtlasPage;
+    page->maskImage = *mask;
+    pages.push(page);
+    met.page = pages.length() - 1;
+  }
+
+  else {
+    // Use the shortest shelf that is tall enough and has room.
+    LazyAtlas::Shelf *shelf = nullptr;
+    for (int s=0; s < lazy.shelves.length(); s++) {
+      LazyAtlas::Shelf &cand = lazy.shelves[s];
+      if (cand.height >= h && cand.x + w <= lazy.pageWidth &&
+          (!shelf || cand.height < shelf->height)) {
+        shelf = &cand;
+      }
     }
-    xassert(glyph->bitmap->Size() == glyph->metrics.bbSize);
 
-    // Copy the pixels one by one.
-    //
-    // This could be made faster by doing low-level bit manipulation,
-    // but the Qt docs are a little vague about exactly what would be
-    // required, and this isn't a bottleneck anyway.
-    for (int y=0; y < glyph->metrics.bbSize.y; y++) {
-      for (int x=0; x < glyph->metrics.bbSize.x; x++) {
-        if (glyph->bitmap->get(point(x,y))) {
-          tempMask.setPixel(metrics[i].bbox.x() + x,
-                            metrics[i].bbox.y() + y,
-                            1);
-        }
+    if (!shelf) {
+      if (lazy.bottom > 0 && lazy.bottom + h > lazy.maxPageDimension) {
+        // Start a new page.
+        std::unique_ptr<QImage> mask(
+          newMaskImage(QSize(lazy.pageWidth, 0)));
+        AtlasPage *page = new AtlasPage;
+        page->maskImage = *mask;
+        pages.push(page);
+        lazy.activePage = pages.length() - 1;
+        lazy.shelves.clear();
+        lazy.bottom = 0;
+      }
+
+      LazyAtlas::Shelf newShelf;
+      newShelf.top = lazy.bottom;
+      newShelf.height = h;
+      newShelf.x = 0;
+      lazy.shelves.push(newShelf);
+      lazy.bottom += h;
+      shelf = &(lazy.shelves.top());
+    }
+
+    corner = QPoint(shelf->x, shelf->top);
+    shelf->x += w;
+    met.page = lazy.activePage;
+
+    QImage &mask = pages[lazy.activePage]->maskImage;
+    if (mask.height() < lazy.bottom) {
+      // Grow the page, doubling to keep the copying linear overall.
+      int height = max(lazy.bottom, mask.height() * 2);
+      height = min(height, max(lazy.bottom, lazy.maxPageDimension));
+      std::unique_ptr<QImage> grown(
+        newMaskImage(QSize(lazy.pageWidth, height)));
+      for (int y=0; y < mask.height(); y++) {
+        memcpy(grown->scanLine(y), mask.constScanLine(y),
+               mask.bytesPerLine());
+      }
+      mask = *grown;
+    }
+  }
+
+  // Place glyph 'index' here.
+  met.bbox.moveTo(corner);
+  met.origin += corner;
+  AtlasPage *page = pages[met.page];
+  QImage &mask = page->maskImage;
+
+  // Copy the pixels.
+  LazyAtlas::PendingGlyph const &pg =
+    lazy.pending[lazy.pendingIndex[index] - 1];
+  QPoint glyphCorner = corner + pg.corner;
+  int numRowBytes = (pg.size.width() + 7) / 8;
+  for (int y=0; numRowBytes > 0 && y < pg.size.height(); y++) {
+    orBitsIntoRow(mask.scanLine(glyphCorner.y() + y), glyphCorner.x(),
+                  &lazy.bits[pg.bitsOffset + y * numRowBytes],
+                  pg.size.width());
+  }
+
+  page->stale = true;
+  lazy.anyStale = true;
+  lazy.numUnplaced--;
+}
+
+
+// Place any unplaced glyphs among the 'len' characters in 'str', and
+// bring the pages up to date, so the string can be drawn.
+void QtBDFFont::placeChars(char const *str, int len)
+{
+  if (!lazyAtlas) {
+    return;
+  }
+
+  for (int i=0; i < len; i++) {
+    int index = (unsigned char)str[i];
+    if (metrics[index].page < 0) {
+      placeGlyph(index);
+    }
+  }
+  syncPages();
+}
+
+
+// Place every glyph, making the atlas complete.
+void QtBDFFont::placeAllGlyphs()
+{
+  if (!lazyAtlas || lazyAtlas->numUnplaced == 0) {
+    return;
+  }
+
+  for (int i=0; i < metrics.limit(); i++) {
+    if (metrics.hasPageFor(i) && metrics[i].page < 0) {
+      placeGlyph(i);
+    }
+  }
+  syncPages();
+}
+
+
+// Remake the images derived from the 'maskImage' of stale pages.
+// Drawing with a QPainter uses those images, so this must be called
+// after placing glyphs and before drawing them that way.
+void QtBDFFont::syncPages()
+{
+  if (!lazyAtlas || !lazyAtlas->anyStale) {
+    return;
+  }
+
+  ArrayStack<int> stalePages;
+  for (int p=0; p < pages.length(); p++) {
+    AtlasPage *page = pages[p];
+    if (page->stale) {
+      page->glyphMask = QBitmap::fromImage(page->maskImage);
+      page->indexedImage = QImage();
+      page->stale = false;
+      stalePages.push(p);
+    }
+  }
+
+  // In every color combination, forget the pixmaps of the stale pages
+  // so they are remade when next needed, but keep the others.  Pages
+  // may have been added or grown, which changes the cost.
+  int numPages = pages.length();
+  long cost = colorPixmapsBytes();
+  colorPixmapCache.updateAll(
+    [&stalePages, numPages, cost](ColorKey const &, ColorPixmaps &pixmaps) {
+      pixmaps.resize(numPages);
+      for (int s=0; s < stalePages.length(); s++) {
+        pixmaps[stalePages[s]] = QPixmap();
       }
+      return cost;
+    });
+
+  // The new costs may have evicted the current entry.
+  currentColorPixmaps = NULL;
+
+  lazyAtlas->anyStale = false;
+}
+
+
+int QtBDFFont::numUnplacedGlyphs() const
+{
+  return lazyAtlas? lazyAtlas->numUnplaced : 0;
+}
+
+
+QtBDFFont::QtBDFFont(QtBDFFontData const &data)
+  : QtBDFFont(data.glyphIndexLimit)
+{
+  // Generated sources check this at compile time, but the data can
+  // also come from elsewhere, such as the atlas cache.
+  xassert(data.version == QTBDFFONT_DATA_VERSION);
+
+  nominalFontMetrics.bbox =
+    QRect(0, 0, data.nominalWidth, data.nominalHeight);
+  nominalFontMetrics.origin =
+    QPoint(data.nominalOriginX, data.nominalOriginY);
+  nominalFontMetrics.offset =
+    QPoint(data.nominalOffsetX, data.nominalOffsetY);
+
+  for (int g=0; g < data.numGlyphs; g++) {
+    QtBDFFontGlyphData const &gd = data.glyphs[g];
+    Metrics &met = metrics.getForWrite(gd.index);
+    met.bbox = QRect(gd.bboxX, gd.bboxY, gd.bboxWidth, gd.bboxHeight);
+    met.origin = QPoint(gd.originX, gd.originY);
+    met.offset = QPoint(gd.offsetX, gd.offsetY);
+    met.page = gd.page;
+
+    if (met.offset.x() < 0 || met.offset.y() != 0) {
+      leftToRight = false;
+    }
+    allCharsBBox |= getCharBBox(gd.index);
+  }
+
+  // The page bits only need to be copied into place.
+  ObjArrayStack<QImage> masks;
+  for (int p=0; p < data.numPages; p++) {
+    QtBDFFontPageData const &pd = data.pages[p];
+    QImage *mask = newMaskImage(QSize(pd.width, pd.height));
+    int rowBytes = (pd.width + 7) / 8;
+    for (int y=0; y < pd.height; y++) {
+      memcpy(mask->scanLine(y), pd.bits + y * pd.bytesPerLine, rowBytes);
+    }
+    masks.push(mask);
+  }
+  installPages(masks);
+}
+
+
+void QtBDFFont::getData(QtBDFFontData &data,
+                        ArrayStack<QtBDFFontGlyphData> &glyphs,
+                        ArrayStack<QtBDFFontPageData> &pageData)
+{
+  placeAllGlyphs();
+
+  glyphs.clear();
+  for (int i=0; i < metrics.limit(); i++) {
+    if (!hasChar(i)) {
+      continue;
+    }
+    Metrics const &met = metrics[i];
+    QtBDFFontGlyphData gd;
+    gd.index = i;
+    gd.bboxX = met.bbox.x();
+    gd.bboxY = met.bbox.y();
+    gd.bboxWidth = met.bbox.width();
+    gd.bboxHeight = met.bbox.height();
+    gd.originX = met.origin.x();
+    gd.originY = met.origin.y();
+    gd.offsetX = met.offset.x();
+    gd.offsetY = met.offset.y();
+    gd.page = met.page;
+    glyphs.push(gd);
+  }
+
+  pageData.clear();
+  for (int p=0; p < pages.length(); p++) {
+    QImage const &mask = pages[p]->maskImage;
+    QtBDFFontPageData pd;
+    pd.width = mask.width();
+    pd.height = mask.height();
+    pd.bytesPerLine = mask.bytesPerLine();
+    pd.bits = mask.constBits();
+    pageData.push(pd);
+  }
+
+  data.version = QTBDFFONT_DATA_VERSION;
+  data.glyphIndexLimit = metrics.limit();
+  data.nominalWidth = nominalFontMetrics.bbox.width();
+  data.nominalHeight = nominalFontMetrics.bbox.height();
+  data.nominalOriginX = nominalFontMetrics.origin.x();
+  data.nominalOriginY = nominalFontMetrics.origin.y();
+  data.nominalOffsetX = nominalFontMetrics.offset.x();
+  data.nominalOffsetY = nominalFontMetrics.offset.y();
+  data.numGlyphs = glyphs.length();
+  data.glyphs = glyphs.isEmpty()? nullptr : &glyphs[0];
+  data.numPages = pageData.length();
+  data.pages = pageData.isEmpty()? nullptr : &pageData[0];
+}
+
+
+// Write a byte array initializer.
+static void writeByteArray(std::ostream &os, unsigned char const *bytes,
+                           int len)
+{
+  for (int i=0; i < len; i++) {
+    os << ((i % 16 == 0)? "\n  " : " ") << (int)bytes[i] << ",";
+  }
+  os << "\n";
+}
+
+
+void QtBDFFont::writeCompiledFont(BDFFont const &font,
+                                  Options const &options,
+                                  char const *name, std::ostream &os)
+{
+  // A font with everything but the atlas pages, which would need the
+  // window system.  The data is for a complete atlas.
+  Options eagerOptions(options);
+  eagerOptions.lazyAtlas = false;
+  QtBDFFont qfont(font.glyphIndexLimit());
+  ObjArrayStack<QImage> masks;
+  qfont.packGlyphs(font, eagerOptions, masks);
+
+  os << "// Generated by compile-bdf-font.  Do not edit.\n"
+     << "\n"
+     << "#include \"qtbdffont-data.h\"\n"
+     << "\n"
+     << "static_assert(QTBDFFONT_DATA_VERSION == "
+     << (int)QTBDFFONT_DATA_VERSION << ",\n"
+     << "              \"QtBDFFontData layout changed; "
+     << "regenerate this file\");\n"
+     << "\n"
+     << "extern QtBDFFontData const " << name << ";\n"
+     << "\n";
+
+  for (int p=0; p < masks.length(); p++) {
+    QImage const &mask = *(masks[p]);
+    int bytesPerLine = (mask.width() + 7) / 8;
+    os << "static constexpr unsigned char page" << p << "Bits[] = {";
+    for (int y=0; y < mask.height(); y++) {
+      writeByteArray(os, mask.constScanLine(y), bytesPerLine);
+    }
+    if (bytesPerLine * mask.height() == 0) {
+      os << "  0  // arrays cannot be empty\n";
+    }
+    os << "};\n\n";
+  }
+
+  os << "static constexpr QtBDFFontPageData pages[] = {\n";
+  for (int p=0; p < masks.length(); p++) {
+    QImage const &mask = *(masks[p]);
+    os << "  { " << mask.width() << ", " << mask.height() << ", "
+       << (mask.width() + 7) / 8 << ", page" << p << "Bits },\n";
+  }
+  os << "};\n\n";
+
+  int numGlyphs = 0;
+  os << "static constexpr QtBDFFontGlyphData glyphs[] = {\n";
+  for (int i=0; i < qfont.metrics.limit(); i++) {
+    if (!qfont.hasChar(i)) {
+      continue;
+    }
+    Metrics const &met = qfont.metrics[i];
+    os << "  { " << i << ", "
+       << met.bbox.x() << ", " << met.bbox.y() << ", "
+       << met.bbox.width() << ", " << met.bbox.height() << ", "
+       << met.origin.x() << ", " << met.origin.y() << ", "
+       << met.offset.x() << ", " << met.offset.y() << ", "
+       << met.page << " },\n";
+    numGlyphs++;
+  }
+  if (numGlyphs == 0) {
+    os << "  { 0 }  // arrays cannot be empty\n";
+  }
+  os << "};\n\n";
+
+  Metrics const &nom = qfont.nominalFontMetrics;
+  os << "constexpr QtBDFFontData " << name << " = {\n"
+     << "  " << (int)QTBDFFONT_DATA_VERSION << ",\n"
+     << "  " << qfont.metrics.limit() << ",\n"
+     << "  " << nom.bbox.width() << ", " << nom.bbox.height() << ",\n"
+     << "  " << nom.origin.x() << ", " << nom.origin.y() << ",\n"
+     << "  " << nom.offset.x() << ", " << nom.offset.y() << ",\n"
+     << "  " << numGlyphs << ", glyphs,\n"
+     << "  " << masks.length() << ", pages,\n"
+     << "};\n"
+     << "\n"
+     << "// EOF\n";
+}
+
+
+void QtBDFFont::computeByteMetrics()
+{
+  ByteMetrics &bm = byteMetrics;
+
+  // Common advance of the present characters so far, or -1 if they
+  // differ.  0 means none have been seen.
+  int common = 0;
+  bm.allPresent = true;
+  bm.horizontal = true;
+
+  for (int i=0; i < ByteMetrics::NUM_BYTES; i++) {
+    QPoint offset = getCharOffset(i);
+    QRect bbox = getCharBBox(i);
+
+    bm.advanceX[i] = offset.x();
+    bm.advanceY[i] = offset.y();
+    bm.left[i] = bbox.left();
+    bm.top[i] = bbox.top();
+    bm.right[i] = bbox.right();
+    bm.bottom[i] = bbox.bottom();
+    bm.flags[i] = (hasChar(i)? ByteMetrics::BF_PRESENT : 0) |
+                  (bbox.isNull()? 0 : ByteMetrics::BF_INK);
+
+    if (offset.y() != 0) {
+      bm.horizontal = false;
+    }
+
+    if (hasChar(i)) {
+      if (offset.y() != 0 || offset.x() <= 0) {
+        common = -1;
+      }
+      else if (common == 0) {
+        common = offset.x();
+      }
+      else if (common != offset.x()) {
+        common = -1;
+      }
+    }
+    else if (i != 0) {
+      bm.allPresent = false;
+    }
+  }
+
+  bm.monospaceAdvance = (common > 0)? common : 0;
+}
+
+
+QtBDFFont::~QtBDFFont()
+{}
+
+
+int QtBDFFont::maxValidChar() const
+{
+  int ret = metrics.limit() - 1;
+  while (ret >= 0 && !hasChar(ret)) {
+    if (!metrics.hasPageFor(ret)) {
+      // Skip the rest of an unallocated page.
+      ret = (ret & ~(int)CodePointTable<Metrics>::PAGE_MASK) - 1;
+      continue;
+    }
+    ret--;
+  }
+  return ret;
+}
+
+
+// The accessors below do not check 'hasChar' because the metrics for a
+// missing glyph, including any out-of-range index, are all zero, which
+// is exactly what they are documented to return in that case.  This
+// keeps the 'drawString' inner loop free of extra branches.
+
+bool QtBDFFont::hasChar(int index) const
+{
+  return metrics[index].isPresent();
+}
+
+
+QRect QtBDFFont::getCharBBox(int index) const
+{
+  Metrics const &met = metrics[index];
+  return met.bbox.translated(- met.origin);
+}
+
+
+QPoint QtBDFFont::getCharOffset(int index) const
+{
+  return metrics[index].offset;
+}
+
+
+QRect QtBDFFont::getNominalCharCell(QPoint pt) const
+{
+  QRect ret(this->nominalFontMetrics.bbox);
+  ret.translate(- this->nominalFontMetrics.origin);
+  ret.translate(pt);
+  return ret;
+}
+
+
+QPoint QtBDFFont::getNominalCharOffset() const
+{
+  return this->nominalFontMetrics.offset;
+}
+
+
+QPoint QtBDFFont::getCharsAdvance(char const *str, int len) const
+{
+  ByteMetrics const &bm = byteMetrics;
+  unsigned char const *p = (unsigned char const*)str;
+
+  if (!bm.horizontal) {
+    QPoint ret(0,0);
+    for (int i=0; i < len; i++) {
+      ret += QPoint(bm.advanceX[p[i]], bm.advanceY[p[i]]);
+    }
+    return ret;
+  }
+
+  if (bm.monospaceAdvance && bm.allPresent) {
+    // Every byte except NUL advances by the same amount.  NUL is
+    // rare, so check for it with 'memchr' rather than counting.
+    if (!memchr(str, 0, len)) {
+      return QPoint(len * bm.monospaceAdvance, 0);
+    }
+  }
+
+  int i = 0;
+  int sum = 0;
+
+#if defined(__AVX2__)
+  {
+    // Look up eight advances at a time with a gather.
+    __m256i acc = _mm256_setzero_si256();
+    for (; i+8 <= len; i += 8) {
+      __m256i indices = _mm256_cvtepu8_epi32(
+        _mm_loadl_epi64((__m128i const*)(p+i)));
+      acc = _mm256_add_epi32(acc,
+        _mm256_i32gather_epi32(bm.advanceX, indices, 4));
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                 _mm256_extracti128_si256(acc, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+    sum = _mm_cvtsi128_si32(half);
+  }
+#else
+  {
+    // Without a gather instruction, independent accumulators let the
+    // table loads overlap.
+    int s0=0, s1=0, s2=0, s3=0;
+    for (; i+4 <= len; i += 4) {
+      s0 += bm.advanceX[p[i]];
+      s1 += bm.advanceX[p[i+1]];
+      s2 += bm.advanceX[p[i+2]];
+      s3 += bm.advanceX[p[i+3]];
+    }
+    sum = s0 + s1 + s2 + s3;
+  }
+#endif
+
+  for (; i < len; i++) {
+    sum += bm.advanceX[p[i]];
+  }
+  return QPoint(sum, 0);
+}
+
+
+QRect QtBDFFont::getCharsBBox(char const *str, int len) const
+{
+  ByteMetrics const &bm = byteMetrics;
+  unsigned char const *p = (unsigned char const*)str;
+
+  // Skip to the first present glyph.  The result is relative to its
+  // origin.
+  int i = 0;
+  while (i < len && !(bm.flags[p[i]] & ByteMetrics::BF_PRESENT)) {
+    i++;
+  }
+  if (i == len) {
+    // No valid glyphs.
+    return QRect(0,0,0,0);
+  }
+
+  // If the first present glyph has no ink, the result is its null
+  // bbox unless a later glyph has ink.  This mimics QRect::operator|,
+  // which ignores null rectangles.
+  QRect first(getCharBBox(p[i]));
+  bool haveInk = false;
+  int l=0, t=0, r=0, b=0;
+
+  int x = 0, y = 0;
+  for (; i < len; i++) {
+    int c = p[i];
+    if (bm.flags[c] & ByteMetrics::BF_INK) {
+      int gl = bm.left[c] + x;
+      int gt = bm.top[c] + y;
+      int gr = bm.right[c] + x;
+      int gb = bm.bottom[c] + y;
+      if (!haveInk) {
+        l = gl; t = gt; r = gr; b = gb;
+        haveInk = true;
+      }
+      else {
+        l = min(l, gl);
+        t = min(t, gt);
+        r = max(r, gr);
+        b = max(b, gb);
+      }
+    }
+    x += bm.advanceX[c];
+    y += bm.advanceY[c];
+  }
+
+  if (!haveInk) {
+    return first;
+  }
+  return QRect(QPoint(l, t), QPoint(r, b));
+}
+
+
+// Return the prefix sums of the horizontal advances of [str,str+len),
+// from the cache if possible.
+QVector<int> const &QtBDFFont::getPrefixAdvances(char const *str, int len)
+{
+  // Look up without copying the string.
+  QVector<int> const *sums =
+    prefixAdvanceCache.find(QByteArray::fromRawData(str, len));
+  if (!sums) {
+    QVector<int> newSums(len+1);
+    int x = 0;
+    for (int i=0; i < len; i++) {
+      newSums[i] = x;
+      x += byteMetrics.advanceX[(unsigned char)str[i]];
+    }
+    newSums[len] = x;
+
+    long cost = (long)sizeof(int) * (len+1) + len;
+    sums = prefixAdvanceCache.insert(QByteArray(str, len), newSums, cost);
+  }
+  return *sums;
+}
+
+
+int QtBDFFont::xForCharIndex(char const *str, int len, int index)
+{
+  index = max(0, min(index, len));
+
+  ByteMetrics const &bm = byteMetrics;
+  if (bm.monospaceAdvance && bm.allPresent && !memchr(str, 0, index)) {
+    return index * bm.monospaceAdvance;
+  }
+
+  return getPrefixAdvances(str, len)[index];
+}
+
+
+int QtBDFFont::hitTestChars(char const *str, int len, int x)
+{
+  ByteMetrics const &bm = byteMetrics;
+  if (bm.monospaceAdvance && bm.allPresent && !memchr(str, 0, len)) {
+    // Round to the nearest boundary, ties going left.
+    int adv = bm.monospaceAdvance;
+    if (x <= 0) {
+      return 0;
+    }
+    return min(len, (x + (adv-1)/2) / adv);
+  }
+
+  QVector<int> const &sums = getPrefixAdvances(str, len);
+  int const *begin = sums.constData();
+  int const *end = begin + len + 1;
+
+  if (!leftToRight) {
+    // The sums are not monotonic, so search them all.
+    int best = 0;
+    for (int i=1; i <= len; i++) {
+      if (abs(sums[i] - x) < abs(sums[best] - x)) {
+        best = i;
+      }
+    }
+    return best;
+  }
+
+  // First boundary at or right of 'x'.
+  int right = std::lower_bound(begin, end, x) - begin;
+  if (right == 0) {
+    return 0;
+  }
+  if (right > len) {
+    // Right of the end; use the first boundary at the end.
+    return std::lower_bound(begin, end, sums[len]) - begin;
+  }
+
+  // The boundary to the left, and the first index sharing its x.
+  int leftX = sums[right-1];
+  if (x - leftX <= sums[right] - x) {
+    return std::lower_bound(begin, end, leftX) - begin;
+  }
+  return right;
+}
+
+
+long QtBDFFont::getHitTestCacheBudget() const
+{
+  return prefixAdvanceCache.getBudget();
+}
+
+
+void QtBDFFont::setHitTestCacheBudget(long bytes)
+{
+  prefixAdvanceCache.setBudget(bytes);
+}
+
+
+CacheStats QtBDFFont::getHitTestCacheStats() const
+{
+  return prefixAdvanceCache.getStats();
+}
+
+
+// The ellipsis used for elision.  There is no ellipsis character in
+// the byte range, so use three periods.
+static char const ELLIPSIS[] = "...";
+enum { ELLIPSIS_LENGTH = 3 };
+
+
+bool QtBDFFont::getElideCut(char const *str, int len, int width,
+                            Qt::TextElideMode mode,
+                            int &prefixLength, int &suffixStart)
+{
+  ElideKey key(QByteArray::fromRawData(str, len), width, mode);
+  ElideCut const *cut = elideCache.find(key);
+  if (!cut) {
+    ElideCut newCut;
+    newCut.prefixLength = newCut.suffixStart = len;
+
+    QVector<int> const &sums = getPrefixAdvances(str, len);
+
+    if (mode != Qt::ElideNone && getCharsBBox(str, len).width() > width) {
+      newCut.elided = true;
+
+      // Widths are measured on the ink, as 'drawAlignedString' aligns
+      // by it, so overhanging glyphs count.  To measure any cut in
+      // constant time, record the ink extents, relative to the string
+      // origin, of each prefix [0,i) and suffix [i,len).  Extents
+      // without ink are [INT_MAX,INT_MIN].
+      ByteMetrics const &bm = byteMetrics;
+      unsigned char const *p = (unsigned char const*)str;
+      QVector<int> prefixLeft(len+1), prefixRight(len+1);
+      QVector<int> suffixLeft(len+1), suffixRight(len+1);
+      prefixLeft[0] = suffixLeft[len] = INT_MAX;
+      prefixRight[0] = suffixRight[len] = INT_MIN;
+      for (int i=0; i < len; i++) {
+        int c = p[i];
+        bool ink = bm.flags[c] & ByteMetrics::BF_INK;
+        prefixLeft[i+1] = ink? min(prefixLeft[i], sums[i] + bm.left[c])
+                             : prefixLeft[i];
+        prefixRight[i+1] = ink? max(prefixRight[i], sums[i] + bm.right[c])
+                              : prefixRight[i];
+      }
+      for (int i=len-1; i >= 0; i--) {
+        int c = p[i];
+        bool ink = bm.flags[c] & ByteMetrics::BF_INK;
+        suffixLeft[i] = ink? min(suffixLeft[i+1], sums[i] + bm.left[c])
+                           : suffixLeft[i+1];
+        suffixRight[i] = ink? max(suffixRight[i+1], sums[i] + bm.right[c])
+                            : suffixRight[i+1];
+      }
+
+      int ellipsisAdvance = getCharsAdvance(ELLIPSIS, ELLIPSIS_LENGTH).x();
+      QRect ellipsisInk = getCharsBBox(ELLIPSIS, ELLIPSIS_LENGTH);
+
+      // Ink width of [0,prefix), then the ellipsis, then [suffix,len).
+      auto cutWidth = [&](int prefix, int suffix) -> int {
+        int l = prefixLeft[prefix];
+        int r = prefixRight[prefix];
+        int ellipsisX = sums[prefix];
+        if (!ellipsisInk.isNull()) {
+          l = min(l, ellipsisX + ellipsisInk.left());
+          r = max(r, ellipsisX + ellipsisInk.right());
+        }
+        if (suffixRight[suffix] != INT_MIN) {
+          int shift = ellipsisX + ellipsisAdvance - sums[suffix];
+          l = min(l, suffixLeft[suffix] + shift);
+          r = max(r, suffixRight[suffix] + shift);
+        }
+        return r < l? 0 : r-l+1;
+      };
+
+      // Longest prefix that, with the ellipsis, fits in 'room'.  The
+      // binary search only ever returns a length that was checked to
+      // fit, or 0.
+      auto prefixFitting = [&](int room) -> int {
+        int lo = 0, hi = len;
+        while (lo < hi) {
+          int mid = (lo+hi+1) / 2;
+          if (cutWidth(mid, len) <= room) {
+            lo = mid;
+          }
+          else {
+            hi = mid-1;
+          }
+        }
+        return lo;
+      };
+
+      // Start of the longest suffix that fits in 'width' after
+      // [0,prefix) and the ellipsis.  Similarly, it returns either a
+      // start that was checked, or 'len'.
+      auto suffixFitting = [&](int prefix) -> int {
+        int lo = prefix, hi = len;
+        while (lo < hi) {
+          int mid = (lo+hi) / 2;
+          if (cutWidth(prefix, mid) <= width) {
+            hi = mid;
+          }
+          else {
+            lo = mid+1;
+          }
+        }
+        return lo;
+      };
+
+      switch (mode) {
+        case Qt::ElideLeft:
+          newCut.prefixLength = 0;
+          newCut.suffixStart = suffixFitting(0);
+          break;
+
+        case Qt::ElideMiddle:
+          // Give the first half of the room beyond the ellipsis to
+          // the prefix, and whatever it leaves to the suffix.
+          newCut.prefixLength =
+            prefixFitting(min(width, width - (width - ellipsisAdvance) / 2));
+          newCut.suffixStart = suffixFitting(newCut.prefixLength);
+          break;
+
+        default:
+          newCut.prefixLength = prefixFitting(width);
+          newCut.suffixStart = len;
+          break;
+      }
+    }
+
+    cut = elideCache.insert(
+      ElideKey(QByteArray(str, len), width, mode), newCut,
+      (long)len + (long)sizeof(ElideKey) + (long)sizeof(ElideCut));
+  }
+
+  prefixLength = cut->prefixLength;
+  suffixStart = cut->suffixStart;
+  return cut->elided;
+}
+
+
+long QtBDFFont::getElideCacheBudget() const
+{
+  return elideCache.getBudget();
+}
+
+
+void QtBDFFont::setElideCacheBudget(long bytes)
+{
+  elideCache.setBudget(bytes);
+}
+
+
+CacheStats QtBDFFont::getElideCacheStats() const
+{
+  return elideCache.getStats();
+}
+
+
+// Return the approximate number of bytes used by one set of
+// ColorPixmaps, assuming 32 bits per pixel.
+long QtBDFFont::colorPixmapsBytes() const
+{
+  long ret = 0;
+  for (int p=0; p < pages.length(); p++) {
+    QSize size = pages[p]->glyphMask.size();
+    ret += (long)size.width() * size.height() * 4;
+  }
+  return ret;
+}
+
+
+// Make the color pixmap for 'page' and the current colors.
+QPixmap QtBDFFont::createColorPixmap(AtlasPage const *page) const
+{
+  if (backend == B_ALPHA_PIXMAP) {
+    return createAlphaColorPixmap(page);
+  }
+
+  QPixmap ret(page->glyphMask.size());
+
+  if (transparent) {
+    // Solid foreground, with the background pixels masked out.
+    ret.fill(fgColor);
+    ret.setMask(page->glyphMask);
+    return ret;
+  }
+
+  // Fill the entire pixmap with the background color.
+  ret.fill(bgColor);
+
+  // Create a new pixmap to act as the source for the masked blit.
+  //
+  // TODO: It's possible there is a way to do this without making a
+  // temporary pixmap, but I'm not sure right now because it's not
+  // clear exactly when a QPixmap's mask is used.
+  QPixmap temp(ret.size());
+  temp.fill(fgColor);
+
+  // Do a masked blit of 'fgColor' onto 'ret'.
+  temp.setMask(page->glyphMask);
+  QPainter painter(&ret);
+  painter.drawPixmap(0,0, temp);
+  painter.end();
+
+  return ret;
+}
+
+
+// Make the B_ALPHA_PIXMAP color pixmap for 'page'.
+QPixmap QtBDFFont::createAlphaColorPixmap(AtlasPage const *page) const
+{
+  QImage const &mask = page->maskImage;
+  QImage image(mask.size(), QImage::Format_ARGB32_Premultiplied);
+
+  // Premultiplied pixel values for the two kinds of pixel.  The
+  // foreground is premultiplied too, in case it is translucent.
+  QRgb const fgPixel = qPremultiply(fgColor.rgba());
+  QRgb const bgPixel = transparent? 0 : qPremultiply(bgColor.rgba());
+
+  for (int y=0; y < mask.height(); y++) {
+    uchar const *src = mask.constScanLine(y);
+    QRgb *dest = reinterpret_cast<QRgb*>(image.scanLine(y));
+    for (int x=0; x < mask.width(); x++) {
+      // MonoLSB stores the leftmost pixel in the low bit.
+      bool isFg = (src[x >> 3] >> (x & 7)) & 1;
+      dest[x] = isFg? fgPixel : bgPixel;
+    }
+  }
+
+  return QPixmap::fromImage(image);
+}
+
+
+// Get the color pixmap for page 'pageIndex' and the current colors,
+// creating it if necessary.
+QPixmap const &QtBDFFont::getColorPixmap(int pageIndex)
+{
+  if (!currentColorPixmaps) {
+    ColorKey key(fgColor, bgColor, transparent, backend);
+    currentColorPixmaps = colorPixmapCache.find(key);
+    if (!currentColorPixmaps) {
+      currentColorPixmaps = colorPixmapCache.insert(key,
+        ColorPixmaps(pages.length()), colorPixmapsBytes());
+    }
+  }
+
+  QPixmap &ret = (*currentColorPixmaps)[pageIndex];
+  if (ret.isNull()) {
+    ret = createColorPixmap(pages[pageIndex]);
+  }
+  return ret;
+}
+
+
+// React to a change in the colors or 'transparent'.
+void QtBDFFont::colorsChanged()
+{
+  // Forget the cache entry; 'getColorPixmap' will look up the new one
+  // when it is needed.
+  currentColorPixmaps = NULL;
+
+  updateIndexedColorTable();
+}
+
+
+// Recompute 'indexedColorTable' from the colors and 'transparent'.
+void QtBDFFont::updateIndexedColorTable()
+{
+  indexedColorTable.resize(2);
+  indexedColorTable[0] = transparent? qRgba(0,0,0,0) : bgColor.rgba();
+  indexedColorTable[1] = fgColor.rgba();
+}
+
+
+// Draw the glyph with metrics 'met' using B_INDEXED_IMAGE.  'pt' is
+// the upper-left corner of the destination rectangle.
+void QtBDFFont::drawCharIndexed(QPainter &dest, QPoint pt,
+                                Metrics const &met)
+{
+  AtlasPage *page = pages[met.page];
+  QImage &atlas = page->indexedImage;
+  if (atlas.isNull()) {
+    // Conversion keeps the pixel values 0 and 1; the color table we
+    // attach below gives them meaning.
+    atlas = page->maskImage.convertToFormat(QImage::Format_Indexed8);
+  }
+
+  // Make an image that refers to the glyph's rectangle within the
+  // atlas without copying it.  An Indexed8 image has one byte per
+  // pixel, so any rectangle can be addressed this way.  Since the
+  // data pointer is not const, attaching the color table does not
+  // force a copy either.
+  int bpl = atlas.bytesPerLine();
+  QImage glyph(atlas.bits() + met.bbox.y() * bpl + met.bbox.x(),
+               met.bbox.width(), met.bbox.height(), bpl,
+               QImage::Format_Indexed8);
+  glyph.setColorTable(indexedColorTable);
+
+  dest.drawImage(pt, glyph);
+}
+
+
+void QtBDFFont::drawChar(QPainter &dest, QPoint pt, int index)
+{
+  Metrics const &met = metrics[index];
+
+  if (met.bbox.isEmpty()) {
+    // This covers missing glyphs, whose bbox is empty.  But it also
+    // has to be excluded as a special case because
+    // QPainter::drawPixmap treats w=h=0 as meaning "draw the entire
+    // source image".
+    return;
+  }
+
+  if (lazyAtlas) {
+    if (met.page < 0) {
+      placeGlyph(index);
+    }
+    syncPages();
+  }
+
+  // Upper-left corner of rectangle to copy, in the 'dest' coords.
+  pt -= (met.origin - met.bbox.topLeft());
+
+  if (backend == B_INDEXED_IMAGE) {
+    drawCharIndexed(dest, pt, met);
+    return;
+  }
+
+
+  // Copy the image.
+  dest.drawPixmap(pt,                  // upper-left of dest rectangle
+                  getColorPixmap(met.page), // source pixmap
+                  met.bbox);           // source rectangle
+}
+
+
+QPoint QtBDFFont::drawChars(QPainter &dest, QPoint pt,
+                            char const *str, int len)
+{
+  // A single glyph is already one blit, so there is nothing to gain
+  // by caching it.
+  if (lineCache.getBudget() > 0 && len >= 2) {
+    return drawCharsCached(dest, pt, str, len);
+  }
+  else {
+    return drawCharsUncached(dest, pt, str, len);
+  }
+}
+
+
+QPoint QtBDFFont::drawChars(QPainter &dest, QPoint pt,
+                            char const *str, int len,
+                            QRect const &visible)
+{
+  if (!leftToRight) {
+    return drawChars(dest, pt, str, len);
+  }
+
+  // Every glyph lies within 'allCharsBBox' of its origin, and the
+  // origins of a line share a 'y' coordinate.
+  QRect const &ext = allCharsBBox;
+  int i = 0;
+  int end = 0;
+  QPoint startPt(pt);
+
+  if (pt.y() + ext.bottom() < visible.top() ||
+      pt.y() + ext.top() > visible.bottom()) {
+    // The whole line is above or below.
+  }
+  else if (lineCache.getBudget() > 0) {
+    // Draw it all, so the cache sees whole lines rather than whatever
+    // part is currently exposed.
+    return drawChars(dest, pt, str, len);
+  }
+  else {
+    // Skip characters entirely to the left.  Origins only move right,
+    // so once one is not, none of the rest are.
+    while (i < len && pt.x() + ext.right() < visible.left()) {
+      pt += metrics[(unsigned char)str[i]].offset;
+      i++;
+    }
+
+    // Find the end of the characters that are not entirely to the
+    // right.
+    startPt = pt;
+    end = i;
+    while (end < len && pt.x() + ext.left() <= visible.right()) {
+      pt += metrics[(unsigned char)str[end]].offset;
+      end++;
+    }
+
+    if (end > i) {
+      drawChars(dest, startPt, str + i, end - i);
+    }
+    i = end;
+  }
+
+  // Account for the rest.
+  for (; i < len; i++) {
+    pt += metrics[(unsigned char)str[i]].offset;
+  }
+  return pt;
+}
+
+
+QPoint QtBDFFont::drawCharsCached(QPainter &dest, QPoint pt,
+                                  char const *str, int len)
+{
+  // The backend does not affect the pixels, so it is not part of the
+  // key.
+  // Look up without copying the string.
+  LineKey key(ColorKey(fgColor, bgColor, transparent, 0),
+              QByteArray::fromRawData(str, len));
+
+  CachedLine const *line = lineCache.find(key);
+  if (!line) {
+    CachedLine newLine;
+
+    // Measure the string relative to its starting origin.
+    QRect bbox;
+    QPoint advance(0,0);
+    for (int i=0; i < len; i++) {
+      Metrics const &met = metrics[(unsigned char)str[i]];
+      if (!met.bbox.isEmpty()) {
+        bbox |= getCharBBox((unsigned char)str[i]).translated(advance);
+      }
+      advance += met.offset;
+    }
+    newLine.offset = bbox.topLeft();
+    newLine.advance = advance;
+
+    // Render it onto a transparent pixmap.  Every pixel the glyphs
+    // touch is either fully opaque or, when 'transparent' is true,
+    // left alone, so drawing the result reproduces the glyphs exactly.
+    if (!bbox.isEmpty()) {
+      newLine.pixmap = QPixmap(bbox.size());
+      newLine.pixmap.fill(Qt::transparent);
+      QPainter paint(&newLine.pixmap);
+      drawCharsUncached(paint, -bbox.topLeft(), str, len);
+    }
+
+    long cost = (long)bbox.width() * bbox.height() * 4 + len;
+    line = lineCache.insert(LineKey(key.colors, QByteArray(str, len)),
+                            newLine, cost);
+  }
+
+  if (!line->pixmap.isNull()) {
+    dest.drawPixmap(pt + line->offset, line->pixmap);
+  }
+  return pt + line->advance;
+}
+
+
+QPoint QtBDFFont::drawCharsUncached(QPainter &dest, QPoint pt,
+                                    char const *str, int len)
+{
+  // Place all of the new glyphs before syncing the pages once.
+  placeChars(str, len);
+
+  if (backend == B_INDEXED_IMAGE) {
+    // There is no pixmap to batch against.
+    for (int i=0; i < len; i++) {
+      int charIndex = (unsigned char)str[i];
+      drawChar(dest, pt, charIndex);
+      pt += getCharOffset(charIndex);
+    }
+    return pt;
+  }
+
+  // Origins of the characters, for the batched drawing.
+  QVarLengthArray<QPoint, 256> origins(len);
+  QVarLengthArray<int, 256> indices(len);
+  for (int i=0; i < len; i++) {
+    int charIndex = (unsigned char)str[i];
+    origins[i] = pt;
+    indices[i] = charIndex;
+    pt += metrics[charIndex].offset;
+  }
+
+  drawGlyphFragments(dest, origins.constData(), indices.constData(), len);
+  return pt;
+}
+
+
+// Draw placed glyphs 'indices[i]' at 'origins[i]', batched into
+// 'drawPixmapFragments' calls on the color pixmaps.  This is the
+// common part of 'drawCharsUncached' and 'drawCharsAt'.
+void QtBDFFont::drawGlyphFragments(QPainter &dest, QPoint const *origins,
+                                   int const *indices, int n)
+{
+  // Accumulated fragments, all from atlas page 'fragPage'.
+  QVarLengthArray<QPainter::PixmapFragment, 256> frags;
+  int fragPage = -1;
+
+  // Draw the accumulated fragments.  Glyphs are batched only while
+  // they come from the same page, so they are drawn in the original
+  // order, and overlapping opaque bboxes come out the same as with
+  // individual 'drawChar' calls.
+  auto flush = [&]() {
+    if (frags.size() > 0) {
+      dest.drawPixmapFragments(frags.constData(), frags.size(),
+                               getColorPixmap(fragPage));
+      frags.clear();
+    }
+  };
+
+  for (int i=0; i < n; i++) {
+    Metrics const &met = metrics[indices[i]];
+
+    // As in 'drawChar', skip empty bboxes, which includes missing
+    // glyphs.
+    if (met.bbox.isEmpty()) {
+      continue;
+    }
+
+    if (met.page != fragPage) {
+      flush();
+      fragPage = met.page;
+    }
+
+    // A fragment is positioned by the center of its destination
+    // rectangle.  Since the width and height are integers, the center
+    // is exactly representable and the destination corner is
+    // recovered exactly.
+    QPoint upperLeft = origins[i] - (met.origin - met.bbox.topLeft());
+    QPointF center(upperLeft.x() + met.bbox.width() / 2.0,
+                   upperLeft.y() + met.bbox.height() / 2.0);
+    frags.append(QPainter::PixmapFragment::create(center,
+                                                  QRectF(met.bbox)));
+  }
+
+  flush();
+}
+
+
+void QtBDFFont::drawCharsAt(QPainter &dest, QPoint const *origins,
+                            int const *indices, int n)
+{
+  if (lazyAtlas) {
+    for (int i=0; i < n; i++) {
+      if (metrics[indices[i]].page < 0) {
+        placeGlyph(indices[i]);
+      }
+    }
+    syncPages();
+  }
+
+  if (backend == B_INDEXED_IMAGE) {
+    for (int i=0; i < n; i++) {
+      drawChar(dest, origins[i], indices[i]);
+    }
+    return;
+  }
+
+  drawGlyphFragments(dest, origins, indices, n);
+}
+
+
+// ---------------- direct drawing into QImage -------------------
+// The routines in this section expand 1-bit glyph rows from a page's
+// 'maskImage' directly into the scan lines of a destination QImage.
+// Each 8-pixel chunk of a row is expanded with SIMD compare and
+// select operations when the compiler targets SSE2 or AVX2 (SSE2 is
+// always available on x86-64), and with scalar code otherwise.
+
+// Return up to 8 bits of a MonoLSB row starting at bit 'x', in the low
+// bits of the result, leftmost pixel in bit 0.  'count' is in [1,8];
+// bytes beyond the one holding bit 'x+count-1' are not read.
+static inline unsigned fetchBits(uchar const *row, int x, int count)
+{
+  uchar const *p = row + (x >> 3);
+  int shift = x & 7;
+  unsigned bits = p[0] >> shift;
+  if (shift + count > 8) {
+    bits |= (unsigned)p[1] << (8 - shift);
+  }
+  return bits & ((1u << count) - 1);
+}
+
+
+// Expand 'w' bits of 'srcRow', starting at bit 'srcX', into 'dest',
+// writing 'fg' for 1 bits and, unless 'transparent', 'bg' for 0 bits.
+// This is the scalar version, used for leftovers and non-x86 targets.
+template <class Pixel>
+static void expandRowScalar(Pixel *dest, uchar const *srcRow, int srcX,
+                            int w, Pixel fg, Pixel bg, bool transparent)
+{
+  for (int i=0; i < w; i++) {
+    int x = srcX + i;
+    if ((srcRow[x >> 3] >> (x & 7)) & 1) {
+      dest[i] = fg;
+    }
+    else if (!transparent) {
+      dest[i] = bg;
+    }
+  }
+}
+
+
+// Expand a row into 32-bit pixels.
+static void expandRow32(quint32 *dest, uchar const *srcRow, int srcX,
+                        int w, quint32 fg, quint32 bg, bool transparent)
+{
+  int i = 0;
+
+#if defined(__AVX2__)
+  {
+    // One 8-bit chunk of the glyph row becomes one 256-bit vector of
+    // eight pixels.  Lane 'k' tests bit 'k'.
+    __m256i const sel = _mm256_setr_epi32(1,2,4,8,16,32,64,128);
+    __m256i const fgv = _mm256_set1_epi32(fg);
+    __m256i const bgv = _mm256_set1_epi32(bg);
+    for (; i+8 <= w; i += 8) {
+      __m256i bits = _mm256_set1_epi32(fetchBits(srcRow, srcX+i, 8));
+      __m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(bits, sel), sel);
+      __m256i *d = reinterpret_cast<__m256i*>(dest + i);
+      __m256i other = transparent? _mm256_loadu_si256(d) : bgv;
+      _mm256_storeu_si256(d, _mm256_blendv_epi8(other, fgv, m));
+    }
+  }
+#elif defined(__SSE2__)
+  {
+    // One 8-bit chunk becomes two 128-bit vectors of four pixels.
+    __m128i const selLo = _mm_setr_epi32(1,2,4,8);
+    __m128i const selHi = _mm_setr_epi32(16,32,64,128);
+    __m128i const fgv = _mm_set1_epi32(fg);
+    __m128i const bgv = _mm_set1_epi32(bg);
+    for (; i+8 <= w; i += 8) {
+      __m128i bits = _mm_set1_epi32(fetchBits(srcRow, srcX+i, 8));
+      __m128i mLo = _mm_cmpeq_epi32(_mm_and_si128(bits, selLo), selLo);
+      __m128i mHi = _mm_cmpeq_epi32(_mm_and_si128(bits, selHi), selHi);
+      __m128i *d = reinterpret_cast<__m128i*>(dest + i);
+      __m128i otherLo = transparent? _mm_loadu_si128(d) : bgv;
+      __m128i otherHi = transparent? _mm_loadu_si128(d+1) : bgv;
+      _mm_storeu_si128(d, _mm_or_si128(_mm_and_si128(mLo, fgv),
+                                       _mm_andnot_si128(mLo, otherLo)));
+      _mm_storeu_si128(d+1, _mm_or_si128(_mm_and_si128(mHi, fgv),
+                                         _mm_andnot_si128(mHi, otherHi)));
+    }
+  }
+#endif
+
+  expandRowScalar(dest+i, srcRow, srcX+i, w-i, fg, bg, transparent);
+}
+
+
+// Expand a row into 16-bit pixels.
+static void expandRow16(quint16 *dest, uchar const *srcRow, int srcX,
+                        int w, quint16 fg, quint16 bg, bool transparent)
+{
+  int i = 0;
+
+#if defined(__SSE2__)
+  {
+    // One 8-bit chunk becomes one 128-bit vector of eight pixels.
+    __m128i const sel = _mm_setr_epi16(1,2,4,8,16,32,64,128);
+    __m128i const fgv = _mm_set1_epi16((short)fg);
+    __m128i const bgv = _mm_set1_epi16((short)bg);
+    for (; i+8 <= w; i += 8) {
+      __m128i bits = _mm_set1_epi16((short)fetchBits(srcRow, srcX+i, 8));
+      __m128i m = _mm_cmpeq_epi16(_mm_and_si128(bits, sel), sel);
+      __m128i *d = reinterpret_cast<__m128i*>(dest + i);
+      __m128i other = transparent? _mm_loadu_si128(d) : bgv;
+      _mm_storeu_si128(d, _mm_or_si128(_mm_and_si128(m, fgv),
+                                       _mm_andnot_si128(m, other)));
+    }
+  }
+#endif
+
+  expandRowScalar(dest+i, srcRow, srcX+i, w-i, fg, bg, transparent);
+}
+
+
+// Convert 'c' to the RGB16 (5-6-5) format the same way Qt does, by
+// truncating each component.
+static quint16 convertRgbTo16(QRgb c)
+{
+  return (quint16)(((qRed(c) >> 3) << 11) |
+                   ((qGreen(c) >> 2) << 5) |
+                   (qBlue(c) >> 3));
+}
+
+
+bool QtBDFFont::canDrawDirectly(QImage const &dest) const
+{
+  switch (dest.format()) {
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGB32:
+    case QImage::Format_RGB16:
+      break;
+
+    default:
+      return false;
+  }
+
+  // With translucent colors, QPainter would blend, and this code does
+  // not try to replicate that.
+  return fgColor.alpha() == 255 &&
+         (transparent || bgColor.alpha() == 255);
+}
+
+
+// Draw the glyph with metrics 'met' directly into 'dest', which must
+// satisfy 'canDrawDirectly'.
+void QtBDFFont::drawCharDirect(QImage &dest, QPoint pt,
+                               Metrics const &met) const
+{
+  if (met.bbox.isEmpty()) {
+    return;
+  }
+
+  // Where the glyph's bbox goes in 'dest', and the part of that
+  // within the bounds of 'dest'.
+  QRect destRect(pt - (met.origin - met.bbox.topLeft()),
+                 met.bbox.size());
+  QRect clipped = destRect & dest.rect();
+  if (clipped.isEmpty()) {
+    return;
+  }
+
+  // Corresponding upper-left corner in the atlas page.
+  int srcX = met.bbox.x() + (clipped.x() - destRect.x());
+  int srcY = met.bbox.y() + (clipped.y() - destRect.y());
+  QImage const &mask = pages[met.page]->maskImage;
+
+  if (dest.depth() == 32) {
+    // Since the colors are opaque, their ARGB values are what QPainter
+    // would store in any of the 32-bit formats.
+    quint32 fg = fgColor.rgba();
+    quint32 bg = bgColor.rgba();
+    for (int y=0; y < clipped.height(); y++) {
+      quint32 *d = reinterpret_cast<quint32*>(
+        dest.scanLine(clipped.y() + y)) + clipped.x();
+      expandRow32(d, mask.constScanLine(srcY + y), srcX,
+                  clipped.width(), fg, bg, transparent);
+    }
+  }
+  else {
+    xassert(dest.depth() == 16);
+    quint16 fg = convertRgbTo16(fgColor.rgb());
+    quint16 bg = convertRgbTo16(bgColor.rgb());
+    for (int y=0; y < clipped.height(); y++) {
+      quint16 *d = reinterpret_cast<quint16*>(
+        dest.scanLine(clipped.y() + y)) + clipped.x();
+      expandRow16(d, mask.constScanLine(srcY + y), srcX,
+                  clipped.width(), fg, bg, transparent);
     }
   }
+}
 
-  // Create 'glyphs' from 'tempGlyphs'.  This allocates, converts the
-  // data from QImage to QBitmap, and copies it to the window system.
-  glyphMask = QBitmap::fromImage(tempMask);
-
-  // Create 'colorPixmap', initially just solid 'fgColor'.
-  colorPixmap = QPixmap(glyphMask.size());
-  colorPixmap.fill(fgColor);
 
-  // Associate it as the mask due to 'transparent'.
-  colorPixmap.setMask(glyphMask);
+void QtBDFFont::drawChar(QImage &dest, QPoint pt, int index)
+{
+  if (canDrawDirectly(dest)) {
+    // Direct drawing reads 'maskImage', which placing updates, so
+    // there is no need to sync.
+    if (lazyAtlas && metrics[index].page < 0) {
+      placeGlyph(index);
+    }
+    drawCharDirect(dest, pt, metrics[index]);
+  }
+  else {
+    QPainter painter(&dest);
+    drawChar(painter, pt, index);
+  }
 }
 
 
-QtBDFFont::~QtBDFFont()
-{}
+// --------------------- color attributes ------------------------
+void QtBDFFont::setFgColor(QColor const &newFgColor)
+{
+  if (fgColor != newFgColor) {
+    fgColor = newFgColor;
+    colorsChanged();
+  }
+}
 
 
-int QtBDFFont::maxValidChar() const
+void QtBDFFont::setBgColor(QColor const &newBgColor)
 {
-  int ret = metrics.allocatedSize() - 1;
-  while (ret >= 0 && !hasChar(ret)) {
-    ret--;
+  if (bgColor != newBgColor) {
+    bgColor = newBgColor;
+    colorsChanged();
   }
-  return ret;
 }
 
 
-bool QtBDFFont::hasChar(int index) const
+void QtBDFFont::setSameFgBgColors(QtBDFFont const &other)
 {
-  if (0 <= index && index < metrics.allocatedSize()) {
-    return metrics[index].isPresent();
-  }
-  else {
-    return false;
-  }
+  this->setFgColor(other.getFgColor());
+  this->setBgColor(other.getBgColor());
 }
 
 
-QRect QtBDFFont::getCharBBox(int index) const
+void QtBDFFont::setTransparent(bool newTransparent)
 {
-  if (hasChar(index)) {
-    QRect ret(metrics[index].bbox);
-    ret.translate(- metrics[index].origin);
-    return ret;
-  }
-  else {
-    return QRect(0,0,0,0);
+  if (transparent != newTransparent) {
+    transparent = newTransparent;
+    colorsChanged();
   }
 }
 
 
-QPoint QtBDFFont::getCharOffset(int index) const
+void QtBDFFont::setTransparent(bool newTransparent, Backend newBackend)
 {
-  if (hasChar(index)) {
-    return metrics[index].offset;
-  }
-  else {
-    return QPoint(0,0);
+  setTransparent(newTransparent);
+  setBackend(newBackend);
+}
+
+
+void QtBDFFont::setBackend(Backend newBackend)
+{
+  xassert(0 <= newBackend && newBackend < NUM_BACKENDS);
+  if (backend != newBackend) {
+    backend = newBackend;
+
+    // The color pixmap format depends on the backend.
+    currentColorPixmaps = NULL;
   }
 }
 
 
-QRect QtBDFFont::getNominalCharCell(QPoint pt) const
+long QtBDFFont::getColorPixmapCacheBudget() const
 {
-  QRect ret(this->nominalFontMetrics.bbox);
-  ret.translate(- this->nominalFontMetrics.origin);
-  ret.translate(pt);
-  return ret;
+  return colorPixmapCache.getBudget();
 }
 
 
-QPoint QtBDFFont::getNominalCharOffset() const
+void QtBDFFont::setColorPixmapCacheBudget(long bytes)
 {
-  return this->nominalFontMetrics.offset;
+  // This never evicts the current entry because it is always the
+  // most recently used.
+  colorPixmapCache.setBudget(bytes);
 }
 
 
-// Set 'colorPixmapState' to 'CPS_MIX', and modify 'colorPixmap'
-// accordingly.
-void QtBDFFont::createMixedColorPixmap()
+CacheStats QtBDFFont::getColorPixmapCacheStats() const
 {
-  // This should only be called when 'transparent' is false, which
-  // means that 'glyphMask' is note associated with any pixmaps right
-  // now.
-  xassert(transparent == false);
+  return colorPixmapCache.getStats();
+}
 
-  // Fill the entire 'colorPixmap' with the background color.
-  colorPixmap.fill(bgColor);
 
-  // Create a new pixmap to act as the source for the masked blit.
-  //
-  // TODO: It's possible there is a way to do this without making a
-  // temporary pixmap, but I'm not sure right now because it's not
-  // clear exactly when a QPixmap's mask is used.
-  QPixmap temp(colorPixmap.size());
-  temp.fill(fgColor);
+long QtBDFFont::getLineCacheBudget() const
+{
+  return lineCache.getBudget();
+}
 
-  // Do a masked blit of 'fgColor' onto 'colorPixmap'.
-  temp.setMask(glyphMask);
-  QPainter painter(&(this->colorPixmap));
-  painter.drawPixmap(0,0, temp);
 
-  // Reflect new state.
-  colorPixmapState = CPS_MIX;
+void QtBDFFont::setLineCacheBudget(long bytes)
+{
+  lineCache.setBudget(bytes);
+  if (bytes <= 0) {
+    // Do not hold on to the one entry the LRU cache always keeps.
+    lineCache.clear();
+  }
 }
 
 
-// Set 'colorPixmapState' to 'CPS_SOLID' and modify 'colorPixmap'
-// accordingly.
-void QtBDFFont::createSolidColorPixmap()
+CacheStats QtBDFFont::getLineCacheStats() const
 {
-  colorPixmap.fill(fgColor);
-  colorPixmapState = CPS_SOLID;
+  return lineCache.getStats();
 }
 
 
-void QtBDFFont::drawChar(QPainter &dest, QPoint pt, int index)
+void QtBDFFont::drawHexQuadCell(QtBDFFont &minihexFont, QPainter &dest,
+                                QPoint pt, int codePoint)
 {
-  if (!hasChar(index)) {
-    return;
-  }
-  Metrics const &met = metrics[index];
+  HexQuadKey key(minihexFont, codePoint);
+
+  CachedLine const *quad = hexQuadCache.find(key);
+  if (!quad) {
+    CachedLine newQuad;
+    newQuad.advance = getNominalCharOffset();
+
+    // 'drawHexQuad' does not clip to the cell, so render into an area
+    // with room for the digits to stick out, then trim to what was
+    // actually drawn.
+    QRect cell = getNominalCharCell(QPoint(0,0));
+    QRect const &digit = minihexFont.getAllCharsBBox();
+    QRect area = cell.adjusted(-digit.width(), -digit.height(),
+                               digit.width(), digit.height());
+
+    QImage image(area.size(), QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+    {
+      QPainter paint(&image);
+      paint.translate(-area.topLeft());
+      drawHexQuad(minihexFont, paint, cell, codePoint);
+    }
 
-  if (met.bbox.isEmpty()) {
-    // This has to be excluded as a special case because
-    // QPainter::drawPixmap treats w=h=0 as meaning "draw
-    // the entire source image".
-    return;
+    QRect used;
+    for (int y=0; y < image.height(); y++) {
+      QRgb const *line = (QRgb const *)image.constScanLine(y);
+      for (int x=0; x < image.width(); x++) {
+        if (qAlpha(line[x]) != 0) {
+          used |= QRect(x, y, 1, 1);
+        }
+      }
+    }
+
+    if (!used.isEmpty()) {
+      newQuad.pixmap = QPixmap::fromImage(image.copy(used));
+      newQuad.offset = used.topLeft() + area.topLeft();
+    }
+
+    long cost = (long)used.width() * used.height() * 4;
+    quad = hexQuadCache.insert(key, newQuad, cost);
   }
 
-  // Make sure 'transparent' and 'colorPixmapState' agree.
-  if (transparent==false && colorPixmapState!=CPS_MIX) {
-    createMixedColorPixmap();
+  if (!quad->pixmap.isNull()) {
+    dest.drawPixmap(pt + quad->offset, quad->pixmap);
   }
+}
 
-  // Upper-left corner of rectangle to copy, in the 'dest' coords.
-  pt -= (met.origin - met.bbox.topLeft());
 
-  // Copy the image.
-  dest.drawPixmap(pt,                  // upper-left of dest rectangle
-                  colorPixmap,         // source pixmap
-                  met.bbox);           // source rectangle
+long QtBDFFont::getHexQuadCacheBudget() const
+{
+  return hexQuadCache.getBudget();
 }
 
 
-void QtBDFFont::setFgColor(QColor const &newFgColor)
+void QtBDFFont::setHexQuadCacheBudget(long bytes)
 {
-  if (fgColor != newFgColor) {
-    fgColor = newFgColor;
-    createSolidColorPixmap();
-  }
+  hexQuadCache.setBudget(bytes);
 }
 
 
-void QtBDFFont::setBgColor(QColor const &newBgColor)
+CacheStats QtBDFFont::getHexQuadCacheStats() const
 {
-  if (bgColor != newBgColor) {
-    bgColor = newBgColor;
-    if (colorPixmapState == CPS_MIX) {
-      createSolidColorPixmap();
-    }
-  }
+  return hexQuadCache.getStats();
 }
 
 
-void QtBDFFont::setSameFgBgColors(QtBDFFont const &other)
+// ------------------- global functions ----------------------
+// If drawing on 'dest' is known to be confined to some rectangle, set
+// 'visible' to it, in logical coordinates, and return true.
+static bool getVisibleRect(QPainter &dest, QRect &visible)
 {
-  this->setFgColor(other.getFgColor());
-  this->setBgColor(other.getBgColor());
+  if (dest.hasClipping()) {
+    visible = dest.clipBoundingRect().toAlignedRect();
+    return true;
+  }
+
+  // Without a clip, the bounds of a raster device limit what is
+  // drawn.  Other devices, such as QPicture and QSvgGenerator, report
+  // sizes that are not bounds (for QPicture, the extent recorded so
+  // far, which starts empty), so nothing is culled for them.
+  QPaintDevice const *device = dest.device();
+  if (!device) {
+    return false;
+  }
+  int devType = device->devType();
+  if (devType != QInternal::Image &&
+      devType != QInternal::Pixmap &&
+      devType != QInternal::Widget) {
+    return false;
+  }
+
+  // Only translations are handled since they cover the common cases
+  // and mapping the rectangle through anything else is not worth it.
+  // A fractional translation can expose part of one more pixel on
+  // each side, which 'toAlignedRect' includes.
+  QTransform xform = dest.combinedTransform();
+  if (xform.type() <= QTransform::TxTranslate) {
+    visible = QRectF(0, 0, device->width(), device->height())
+                .translated(-xform.dx(), -xform.dy()).toAlignedRect();
+    return true;
+  }
+
+  return false;
 }
 
 
-void QtBDFFont::setTransparent(bool newTransparent)
+void drawString(QtBDFFont &font, QPainter &dest,
+                QPoint pt, rostring str)
 {
-  if (transparent != newTransparent) {
-    transparent = newTransparent;
-
-    if (transparent) {
-      // The foreground pixels should already have the
-      // foreground color, so mask out the bg pixels.
-      colorPixmap.setMask(glyphMask);
-    }
-    else {
-      // Prepare by setting the entire pixmap to the fg
-      // color and the state to CPS_SOLID.  'drawChar'
-      // will then be able to set things up properly.
-      // (This is a weird design.  It arose due to
-      // porting Qt3 code to Qt5.)
-      this->createSolidColorPixmap();
-    }
+  // Each byte is interpreted as an unsigned character index, because
+  // no encoding system uses negative indices.  The whole string is
+  // submitted together so its glyphs can be batched.
+  QRect visible;
+  if (getVisibleRect(dest, visible)) {
+    font.drawChars(dest, pt, str.c_str(), str.length(), visible);
+  }
+  else {
+    font.drawChars(dest, pt, str.c_str(), str.length());
   }
 }
 
 
-// ------------------- global functions ----------------------
 void drawString(QtBDFFont &font, QPainter &dest,
+                QPoint pt, rostring str, QRect const &visible)
+{
+  font.drawChars(dest, pt, str.c_str(), str.length(), visible);
+}
+
+
+void drawString(QtBDFFont &font, QImage &dest,
                 QPoint pt, rostring str)
 {
-  for (char const *p = str.c_str(); *p; p++) {
-    // Interpret each byte as a character index, unsigned
-    // because no encoding system uses negative indices.
-    int charIndex = (unsigned char)*p;
+  if (!font.canDrawDirectly(dest)) {
+    QPainter painter(&dest);
+    drawString(font, painter, pt, str);
+    return;
+  }
+
+  // Like the QPainter path, draw every byte, not just those before
+  // the first NUL.
+  unsigned char const *p = (unsigned char const*)str.c_str();
+  int len = str.length();
+  int const *advanceX = font.getByteAdvances();
+  int const *advanceY = font.getByteAdvancesY();
+  for (int i=0; i < len; i++) {
+    int charIndex = p[i];
 
     font.drawChar(dest, pt, charIndex);
-    pt += font.getCharOffset(charIndex);
+    pt += QPoint(advanceX[charIndex], advanceY[charIndex]);
   }
 }
 
 
 QRect getStringBBox(QtBDFFont &font, rostring str)
 {
-  // Loop to search for the first valid glyph.
-  for (char const *p = str.c_str(); *p; p++) {
-    int charIndex = (unsigned char)*p;
+  return font.getCharsBBox(str.c_str(), str.length());
+}
 
-    if (font.hasChar(charIndex)) {
-      // Begin actual bbox calculation.
 
-      // Accumulated bbox.  Start with first character's bbox.
-      QRect ret(font.getCharBBox(charIndex));
+QPoint getStringAdvance(QtBDFFont const &font, rostring str)
+{
+  return font.getCharsAdvance(str.c_str(), str.length());
+}
 
-      // Virtual cursor; where to place next glyph.
-      QPoint cursor = font.getCharOffset(charIndex);
 
-      // Add the bboxes for subsequent characters.
-      for (p++; *p; p++) {
-        int charIndex = (unsigned char)*p;
-        QRect glyphBBox = font.getCharBBox(charIndex);
-        glyphBBox.translate(cursor.x(), cursor.y());
-        ret |= glyphBBox;
+int xForIndex(QtBDFFont &font, rostring str, int index)
+{
+  return font.xForCharIndex(str.c_str(), str.length(), index);
+}
 
-        cursor += font.getCharOffset(charIndex);
-      }
 
-      return ret;
-    }
-  }
+int hitTestString(QtBDFFont &font, rostring str, int x)
+{
+  return font.hitTestChars(str.c_str(), str.length(), x);
+}
 
-  // No valid glyphs.
-  return QRect(0,0,0,0);
+
+int measureStringAdvances(QtBDFFont const &font, string const *strs,
+                          int n, int *advances)
+{
+  int ret = 0;
+  for (int i=0; i < n; i++) {
+    advances[i] = font.getCharsAdvance(strs[i].c_str(),
+                                       strs[i].length()).x();
+    ret = max(ret, advances[i]);
+  }
+  return ret;
 }
 
 
@@ -442,13 +2452,11 @@ void drawCenteredString(QtBDFFont &font, QPainter &dest,
 }
 
 
-void drawAlignedString(QtBDFFont &font, QPainter &dest,
-  QRect const &rect, Qt::Alignment alignment, string const &str)
+// Return the origin at which to draw a string whose bbox relative to
+// its origin is 'bbox' so it is aligned in 'rect' per 'alignment'.
+static QPoint alignedOrigin(QRect const &rect, Qt::Alignment alignment,
+                            QRect const &bbox)
 {
-  // Calculate a bounding rectangle for the entire string if it were to
-  // be drawn at (0,0).
-  QRect bbox = getStringBBox(font, str);
-
   // Desired rectangle left edge.
   int left = (alignment & Qt::AlignLeft)?
                rect.left() :
@@ -470,24 +2478,122 @@ void drawAlignedString(QtBDFFont &font, QPainter &dest,
 
   // Shift to where the beginning of the baseline should go.
   pt -= bbox.topLeft();
+  return pt;
+}
+
+
+void drawAlignedString(QtBDFFont &font, QPainter &dest,
+  QRect const &rect, Qt::Alignment alignment, string const &str)
+{
+  // Calculate a bounding rectangle for the entire string if it were to
+  // be drawn at (0,0).
+  QRect bbox = getStringBBox(font, str);
+
+  // Draw at the baseline point that aligns it.
+  drawString(font, dest, alignedOrigin(rect, alignment, bbox), str);
+}
 
-  // Draw at that baseline point.
-  drawString(font, dest, pt, str);
+
+string elideString(QtBDFFont &font, rostring str, int width,
+                   Qt::TextElideMode mode)
+{
+  int prefixLength, suffixStart;
+  if (!font.getElideCut(str.c_str(), str.length(), width, mode,
+                        prefixLength, suffixStart)) {
+    return str;
+  }
+
+  string ret(str.c_str(), prefixLength);
+  ret += ELLIPSIS;
+  ret += string(str.c_str() + suffixStart, str.length() - suffixStart);
+  return ret;
+}
+
+
+void drawElidedString(QtBDFFont &font, QPainter &dest,
+  QRect const &rect, Qt::Alignment alignment, rostring str,
+  Qt::TextElideMode mode)
+{
+  drawAlignedString(font, dest, rect, alignment,
+                    elideString(font, str, rect.width(), mode));
 }
 
 
 void drawMultilineString(QtBDFFont &font, QPainter &dest,
                          QPoint upLeft, rostring str)
 {
+  QRect visible;
+  if (!getVisibleRect(dest, visible)) {
+    // Effectively unbounded.
+    visible = QRect(QPoint(INT_MIN/2, INT_MIN/2),
+                    QPoint(INT_MAX/2, INT_MAX/2));
+  }
+  drawMultilineString(font, dest, upLeft, str, visible);
+}
+
+
+void drawMultilineString(QtBDFFont &font, QPainter &dest,
+                         QPoint upLeft, rostring str,
+                         QRect const &visible)
+{
+  QRect const &ext = font.getAllCharsBBox();
+  int lineHeight = ext.height();
+
   // adjust 'upLeft' so it is the starting origin
-  upLeft += -font.getAllCharsBBox().topLeft();
+  upLeft += -ext.topLeft();
+
+  // Walk the lines in place.  As with splitting on "\r\n" using
+  // StrtokParse, runs of line terminators act as one separator, so
+  // empty lines take no space.
+  char const *p = str.c_str();
+  char const *end = p + str.length();
+  while (p < end) {
+    if (*p == '\r' || *p == '\n') {
+      p++;
+      continue;
+    }
+
+    // Lines are drawn top to bottom, so once one is entirely below
+    // the visible area, the rest are too.
+    if (upLeft.y() + ext.top() > visible.bottom()) {
+      break;
+    }
+
+    char const *lineEnd = p;
+    while (lineEnd < end && *lineEnd != '\r' && *lineEnd != '\n') {
+      lineEnd++;
+    }
+
+    if (upLeft.y() + ext.bottom() >= visible.top()) {
+      font.drawChars(dest, upLeft, p, lineEnd - p, visible);
+    }
+
+    upLeft.setY(upLeft.y() + lineHeight);
+    p = lineEnd;
+  }
+}
+
+
+QRect scrollTextLines(QtBDFFont const &font, QPixmap &pixmap,
+                      QRect const &area, int lines)
+{
+  int dy = -lines * font.getAllCharsBBox().height();
+  if (dy >= area.height() || -dy >= area.height()) {
+    // Nothing that was visible stays visible.
+    return area;
+  }
+  if (dy == 0) {
+    return QRect();
+  }
 
-  // split 'str' into lines
-  StrtokParse tok(str, "\r\n");
-  for (int i=0; i < tok.tokc(); i++) {
-    drawString(font, dest, upLeft, tok[i]);
+  pixmap.scroll(0, dy, area);
 
-    upLeft.setY(upLeft.y() + font.getAllCharsBBox().height());
+  if (dy < 0) {
+    // Scrolled up; the bottom is exposed.
+    return QRect(area.left(), area.bottom()+1 + dy, area.width(), -dy);
+  }
+  else {
+    return QRect(area.left(), area.top(), area.width(), dy);
   }
 }
 
@@ -517,12 +2623,214 @@ QPoint drawCharOrHexQuad(QtBDFFont &mainFont, QtBDFFont &minihexFont,
     pt += mainFont.getCharOffset(codePoint);
   }
   else {
-    QRect bounds = mainFont.getNominalCharCell(pt);
-    drawHexQuad(minihexFont, dest, bounds, codePoint);
+    mainFont.drawHexQuadCell(minihexFont, dest, pt, codePoint);
     pt += mainFont.getNominalCharOffset();
   }
   return pt;
 }
 
 
+// ------------------------- UTF-8 -----------------------------
+// Code point substituted for malformed UTF-8.
+enum { REPLACEMENT_CHARACTER = 0xFFFD };
+
+
+// Return the number of bytes at the start of [p,end) that are ASCII.
+// This is the fast path for the common case of text that is entirely,
+// or mostly, ASCII.
+static int asciiPrefixLength(char const *p, char const *end)
+{
+  char const *start = p;
+
+#if defined(__SSE2__)
+  // Check 16 bytes at a time: a byte is non-ASCII iff its high bit is
+  // set, and 'movemask' collects the high bits.
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((__m128i const *)p);
+    if (_mm_movemask_epi8(v) != 0) {
+      break;         // the scalar loop finds which byte
+    }
+    p += 16;
+  }
+#endif // __SSE2__
+
+  while (p < end && !(*p & 0x80)) {
+    p++;
+  }
+  return p - start;
+}
+
+
+// Decode one code point from the UTF-8 sequence at 'p', which must be
+// less than 'end', and advance 'p' past it.  Malformed sequences
+// (bad lead or continuation bytes, truncation, overlong encodings,
+// surrogates, and values beyond U+10FFFF) yield U+FFFD and consume
+// one byte, so decoding resynchronizes at the next byte.
+static int decodeUTF8(char const *&p, char const *end)
+{
+  unsigned char const *u = (unsigned char const *)p;
+  unsigned lead = u[0];
+
+  int len;
+  unsigned cp;
+  unsigned minValue;
+  if (lead < 0x80) {
+    p++;
+    return lead;
+  }
+  else if ((lead & 0xE0) == 0xC0) {
+    len = 2;
+    cp = lead & 0x1F;
+    minValue = 0x80;
+  }
+  else if ((lead & 0xF0) == 0xE0) {
+    len = 3;
+    cp = lead & 0x0F;
+    minValue = 0x800;
+  }
+  else if ((lead & 0xF8) == 0xF0) {
+    len = 4;
+    cp = lead & 0x07;
+    minValue = 0x10000;
+  }
+  else {
+    p++;
+    return REPLACEMENT_CHARACTER;
+  }
+
+  if (end - p < len) {
+    p++;
+    return REPLACEMENT_CHARACTER;
+  }
+  for (int i=1; i < len; i++) {
+    if ((u[i] & 0xC0) != 0x80) {
+      p++;
+      return REPLACEMENT_CHARACTER;
+    }
+    cp = (cp << 6) | (u[i] & 0x3F);
+  }
+
+  if (cp < minValue ||
+      cp > 0x10FFFF ||
+      (0xD800 <= cp && cp <= 0xDFFF)) {
+    p++;
+    return REPLACEMENT_CHARACTER;
+  }
+
+  p += len;
+  return cp;
+}
+
+
+// Walk the UTF-8 string 'utf8'.  Call 'asciiRun(str, len)' for each
+// maximal run of ASCII characters that 'font' has glyphs for, and
+// 'other(codePoint)' for every other code point.
+template <class AsciiRunFunc, class OtherFunc>
+static void forEachUTF8Run(QtBDFFont const &font, rostring utf8,
+                           AsciiRunFunc asciiRun, OtherFunc other)
+{
+  char const *p = utf8.c_str();
+  char const *end = p + utf8.length();
+
+  // When the font has every byte character, only NUL can be missing,
+  // so the ASCII runs need not be checked a byte at a time.
+  bool allPresent = font.hasAllByteChars();
+  bool nulPresent = font.hasChar(0);
+
+  while (p < end) {
+    char const *asciiEnd = p + asciiPrefixLength(p, end);
+
+    // Split the ASCII part at characters missing from the font.
+    while (p < asciiEnd) {
+      char const *q = p;
+      if (allPresent) {
+        q = nulPresent? NULL :
+              (char const *)memchr(p, 0, asciiEnd - p);
+        if (!q) {
+          q = asciiEnd;
+        }
+      }
+      else {
+        while (q < asciiEnd && font.hasChar((unsigned char)*q)) {
+          q++;
+        }
+      }
+      if (q > p) {
+        asciiRun(p, q - p);
+      }
+      if (q < asciiEnd) {
+        other((unsigned char)*q);
+        q++;
+      }
+      p = q;
+    }
+
+    if (p < end) {
+      other(decodeUTF8(p, end));
+    }
+  }
+}
+
+
+QPoint drawUTF8String(QtBDFFont &font, QPainter &dest, QPoint pt,
+                      rostring utf8, QtBDFFont *minihexFont)
+{
+  forEachUTF8Run(font, utf8,
+    [&](char const *str, int len) {
+      pt = font.drawChars(dest, pt, str, len);
+    },
+    [&](int codePoint) {
+      if (font.hasChar(codePoint)) {
+        font.drawChar(dest, pt, codePoint);
+        pt += font.getCharOffset(codePoint);
+      }
+      else {
+        if (minihexFont) {
+          font.drawHexQuadCell(*minihexFont, dest, pt, codePoint);
+        }
+        pt += font.getNominalCharOffset();
+      }
+    });
+  return pt;
+}
+
+
+QRect getUTF8StringBBox(QtBDFFont &font, rostring utf8)
+{
+  QRect ret(0,0,0,0);
+  QPoint cursor(0,0);
+
+  auto addChar = [&](int codePoint) {
+    if (font.hasChar(codePoint)) {
+      ret |= font.getCharBBox(codePoint).translated(cursor);
+      cursor += font.getCharOffset(codePoint);
+    }
+    else {
+      ret |= font.getNominalCharCell(cursor);
+      cursor += font.getNominalCharOffset();
+    }
+  };
+
+  forEachUTF8Run(font, utf8,
+    [&](char const *str, int len) {
+      // Measure the whole run with the byte tables.  As with the
+      // union above, a run without ink contributes nothing.
+      ret |= font.getCharsBBox(str, len).translated(cursor);
+      cursor += font.getCharsAdvance(str, len);
+    },
+    addChar);
+  return ret;
+}
+
+
+void drawAlignedUTF8String(QtBDFFont &font, QPainter &dest,
+  QRect const &rect, Qt::Alignment alignment, rostring utf8,
+  QtBDFFont *minihexFont)
+{
+  QRect bbox = getUTF8StringBBox(font, utf8);
+  drawUTF8String(font, dest, alignedOrigin(rect, alignment, bbox),
+                 utf8, minihexFont);
+}
+
+
 // EOF
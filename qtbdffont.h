@@ -36,36 +36,60 @@
 //
 // Transparent backgrounds are slower, but far more flexible from a
 // client's perspective.  The speed tends to be adequate for things
-// like drawing programs with sparse amounts of text.
+// like drawing programs with sparse amounts of text.  When it is not,
+// the B_ALPHA_PIXMAP backend avoids masks entirely by storing glyph
+// coverage in the alpha channel of a premultiplied ARGB32 pixmap, so
+// transparent drawing becomes an ordinary source-over blit.
 //
 // Opaque backgrounds are faster to draw (e.g., fast enough for a text
 // editor with lots of text to display), but require a single masked
 // blit (5x slower again) in advance to create the source pixmap, so
 // that speed is only realized when the foreground and background
-// colors remain the same for many drawing operations.  It is up to
-// the client to ensure that fg/bg is changed infrequently enough.
-// For example, the client could make several QtBDFFont objects, one
-// for each common fg/bg pair, and then one more for arbitrary fg/bg.
+// colors remain the same for many drawing operations.  To help with
+// that, each QtBDFFont keeps a bounded LRU cache of source pixmaps
+// keyed by fg/bg/transparent, so switching among a working set of
+// color combinations costs only a cache lookup.  The cache budget can
+// be adjusted with 'setColorPixmapCacheBudget'.  Alternatively, the
+// B_INDEXED_IMAGE backend makes color changes nearly free at the cost
+// of somewhat slower individual draws.  For text that is redrawn
+// unchanged, 'setLineCacheBudget' enables a cache of whole rendered
+// strings.
 //
 // Also note, as stated below, that the opaque background covers only
 // the character's glyph bounding box, which is often much smaller
 // than the "character cell" (if such a concept even makes sense).  So
 // another burden transferred to the client is to manually erase the
-// complete background rectangle before drawing the text.
+// complete background rectangle before drawing the text.  For fonts
+// where cells do make sense, 'Options::padToNominalCell' pads every
+// glyph to its cell so the opaque background covers it.
 
 #ifndef QTBDFFONT_H
 #define QTBDFFONT_H
 
-#include "array.h"                     // GrowArray
+// smqtutil
+#include "code-point-table.h"          // CodePointTable
+#include "lru-cache.h"                 // LRUCache
+#include "qtbdffont-data.h"            // QtBDFFontData
+
+// smbase
+#include "array.h"                     // ObjArrayStack
 #include "str.h"                       // rostring
 
+// Qt
 #include <qbitmap.h>                   // QBitmap, QPixmap
+#include <qbytearray.h>                // QByteArray
 #include <qcolor.h>                    // QColor
+#include <qimage.h>                    // QImage
 #include <qpoint.h>                    // QPoint
 #include <qrect.h>                     // QRect
+#include <qvector.h>                   // QVector
 
 #include <Qt>                          // Qt::Alignment
 
+// libc++
+#include <iosfwd>                      // std::ostream
+#include <memory>                      // std::unique_ptr
+
 class BDFFont;                         // smbase/bdffont.h
 class QPainter;                        // qpainter.h
 
@@ -86,18 +110,24 @@ private:     // types
   // to 0.
   class Metrics {
   public:    // data
-    // Glyph bounding box in 'glyphMask' bitmap.
+    // Glyph bounding box in the page's 'glyphMask' bitmap.
     QRect bbox;
 
-    // Location of the glyph origin point in 'glyphMask'.  Not
-    // necessarily inside 'bbox', nor even inside the dimensions of
-    // 'glyphMask'.
+    // Location of the glyph origin point in the page's 'glyphMask'.
+    // Not necessarily inside 'bbox', nor even inside the dimensions
+    // of 'glyphMask'.
     QPoint origin;
 
     // Relative amount by which to move the drawing point after
     // drawing this glyph.
     QPoint offset;
 
+    // Index in 'pages' of the atlas page that holds this glyph.
+    // 'bbox' and 'origin' are in that page's coordinates.  With
+    // 'Options::lazyAtlas', it is -1 for a glyph that has not been
+    // drawn yet; 'bbox' is then at (0,0) and 'origin' relative to it.
+    int page;
+
   public:
     Metrics();
 
@@ -105,54 +135,354 @@ private:     // types
     bool isPresent() const;
   };
 
+  // One page of the glyph atlas.  Large fonts need several pages
+  // because window systems have trouble with pixmaps whose dimensions
+  // exceed a few thousand pixels.
+  class AtlasPage {
+    NO_OBJECT_COPIES(AtlasPage);
+
+  public:    // data
+    // Bitmap containing some of the font glyphs, packed together such
+    // that no two overlap.  Other packing characteristics are
+    // implementation details.
+    QBitmap glyphMask;
+
+    // The same glyphs as 'glyphMask', as a QImage in MonoLSB format
+    // where 1 means foreground.  This is the source for the other
+    // image formats.
+    QImage maskImage;
+
+    // For B_INDEXED_IMAGE, the same glyphs in Indexed8 format, with
+    // pixel values 0 for background and 1 for foreground.  It is null
+    // until that backend is first used to draw from this page.
+    QImage indexedImage;
+
+    // True if glyphs have been added to 'maskImage' since the other
+    // images were made from it.  Only lazy atlases change.
+    bool stale;
+
+  public:
+    AtlasPage();
+    ~AtlasPage();
+  };
+
+  // Key for 'colorPixmapCache'.  When 'transparent' is true, the
+  // background color does not matter, so 'bg' is always 0 then.
+  class ColorKey {
+  public:    // data
+    QRgb fg;
+    QRgb bg;
+    bool transparent;
+
+    // Backend whose pixmap format this key denotes.
+    int backend;
+
+  public:
+    ColorKey(QColor const &fgColor, QColor const &bgColor,
+             bool transparent, int backend);
+
+    bool operator< (ColorKey const &obj) const;
+  };
+
+  // Source pixmaps for drawPixmap, one per atlas page, for one
+  // ColorKey.  Each has the same size as the page's 'glyphMask'.  If
+  // the key is transparent, the foreground pixels are 'fg' and the
+  // rest are masked out (B_MASKED_PIXMAP) or have zero alpha
+  // (B_ALPHA_PIXMAP).  Otherwise, it has 'fg' foreground pixels and
+  // 'bg' background pixels.  A page's pixmap is null until it is first
+  // needed.
+  typedef QVector<QPixmap> ColorPixmaps;
+
+  // Key for 'lineCache': the drawing attributes and the characters.
+  // Lookups use a 'text' made with QByteArray::fromRawData, so only
+  // inserted keys copy the characters.
+  class LineKey {
+  public:    // data
+    ColorKey colors;
+    QByteArray text;
+
+  public:
+    LineKey(ColorKey const &colors, QByteArray const &text);
+
+    bool operator< (LineKey const &obj) const;
+  };
+
+  // Key for 'hexQuadCache': the minihex font, its drawing attributes,
+  // and the code point.
+  class HexQuadKey {
+  public:    // data
+    // 'serialNumber' of the minihex font.  A pointer would not do,
+    // since a font could be destroyed and another created at the same
+    // address.
+    unsigned long minihexSerialNumber;
+    ColorKey colors;
+    int codePoint;
+
+  public:
+    HexQuadKey(QtBDFFont const &minihexFont, int codePoint);
+
+    bool operator< (HexQuadKey const &obj) const;
+  };
+
+  // Measurements of character indices 0 to 255, the ones a string of
+  // bytes can name, in flat arrays so strings can be measured without
+  // going through 'metrics' and QRect for each character.
+  class ByteMetrics {
+  public:    // types
+    enum {
+      NUM_BYTES = 256,
+    };
+
+    enum Flags {
+      BF_PRESENT = 0x01,               // 'hasChar' is true
+      BF_INK     = 0x02,               // 'getCharBBox' is not null
+    };
+
+  public:    // data
+    // 'getCharOffset' components.
+    int advanceX[NUM_BYTES];
+    int advanceY[NUM_BYTES];
+
+    // 'getCharBBox' edges, inclusive as with QRect::left(), etc.
+    int left[NUM_BYTES];
+    int top[NUM_BYTES];
+    int right[NUM_BYTES];
+    int bottom[NUM_BYTES];
+
+    // Bitwise OR of Flags.
+    unsigned char flags[NUM_BYTES];
+
+    // True if every 'advanceY' is 0.
+    bool horizontal;
+
+    // If every present character has offset (n,0) for the same n,
+    // that n.  Otherwise 0.
+    int monospaceAdvance;
+
+    // True if characters 1 to 255 are all present.  Together with
+    // 'monospaceAdvance', this means a string's advance is just its
+    // length times 'monospaceAdvance'.  Character 0 is excluded
+    // because fonts rarely have it and strings rarely contain it.
+    bool allPresent;
+
+  public:
+    ByteMetrics();
+  };
+
+  // Key for 'elideCache'.
+  class ElideKey {
+  public:    // data
+    QByteArray text;
+    int width;
+    int mode;                          // Qt::TextElideMode
+
+  public:
+    ElideKey(QByteArray const &text, int width, int mode);
+
+    bool operator< (ElideKey const &obj) const;
+  };
+
+  // Where to cut a string to elide it: keep [0,prefixLength) and
+  // [suffixStart,len), with an ellipsis between if 'elided'.
+  class ElideCut {
+  public:    // data
+    int prefixLength;
+    int suffixStart;
+    bool elided;
+
+  public:
+    ElideCut();
+  };
+
+  // Something rendered once and kept in 'lineCache' or 'hexQuadCache'.
+  // For a hex quad, the "first character" is the missing glyph.
+  class CachedLine {
+  public:    // data
+    // The drawn pixels.  Pixels that the string does not cover are
+    // fully transparent, so drawing this has the same effect as
+    // drawing the glyphs.  Null if the string has no visible glyphs.
+    QPixmap pixmap;
+
+    // Location of the upper-left corner of 'pixmap' relative to the
+    // origin of the first character.
+    QPoint offset;
+
+    // Vector from the first character's origin to the point where the
+    // next character would go.
+    QPoint advance;
+
+  public:
+    CachedLine();
+  };
+
+  // Glyphs waiting to be put into the atlas; see 'Options::lazyAtlas'.
+  // Defined in qtbdffont.cc.
+  class LazyAtlas;
+
+public:      // types
+  // Ways of producing glyph pixels when drawing.  All backends draw
+  // the same pixels; they differ in what is fast.
+  enum Backend {
+    // Color pixmaps derived from the glyph mask, as described at the
+    // top of this file.  Drawing is fastest when the colors rarely
+    // change, but the first opaque draw after switching to a color
+    // combination that is not in the cache does a masked blit of the
+    // whole atlas page.
+    B_MASKED_PIXMAP,
+
+    // Palette-indexed QImage atlas.  Changing colors only rewrites a
+    // two-entry color table, so it is cheap to change them for every
+    // span of text.  The price is that each draw converts the glyph's
+    // pixels from the indexed format.
+    B_INDEXED_IMAGE,
+
+    // Premultiplied ARGB32 pixmaps with glyph coverage in the alpha
+    // channel.  Drawing is a plain source-over blit with no mask, so
+    // this is the fastest way to draw transparently.  Color pixmaps
+    // are cached the same way as for B_MASKED_PIXMAP.
+    B_ALPHA_PIXMAP,
+
+    NUM_BACKENDS
+  };
+
+  // Options that affect how the font is prepared for drawing.
+  class Options {
+  public:    // data
+    // Maximum width or height, in pixels, of one atlas page.  Glyphs
+    // that do not fit on a page spill onto additional pages.  A single
+    // glyph larger than this gets a page of its own, exactly its size,
+    // so it does not make the other pages any bigger.
+    int maxPageDimension;
+
+    // If true, each glyph's atlas entry is padded to its whole
+    // character cell: the height of the nominal cell, and the width
+    // from its origin to the next origin.  Opaque drawing then paints
+    // the background of the entire cell, even for glyphs with tiny or
+    // empty bboxes such as '.' and ' ', so clients need not erase
+    // cells before drawing into them.  The padding is part of the
+    // glyph bboxes reported by 'getCharBBox'.  Default is false.
+    bool padToNominalCell;
+
+    // If true, the constructor only computes metrics and keeps a
+    // compact copy of each glyph's pixels.  A glyph is copied into the
+    // atlas the first time it is drawn, and the pages grow as needed.
+    // Metrics queries such as 'hasChar' and 'getCharBBox' work
+    // immediately.  This saves construction time and memory for large
+    // fonts of which a session draws only a few glyphs.  Default is
+    // false.
+    bool lazyAtlas;
+
+  public:
+    Options();
+  };
+
 private:     // data
-  // Bitmap containing all the font glyphs, packed together such that
-  // no two overlap.  Other packing characteristics are implementation
-  // details.
-  QBitmap glyphMask;
-
-  // A pixmap for use as the source in drawPixmap.  It has the same
-  // size as 'glyphMask', and uses 'glyphMask' as its mask when
-  // 'transparent' is true.
-  //
-  // It contains pixels of 'fgColor' and 'bgColor', with exact
-  // arrangement dependent on 'colorPixmapState'.
-  QPixmap colorPixmap;
+  // Atlas pages containing all of the glyph images.  There is always
+  // at least one page, although it may be empty.
+  ObjArrayStack<AtlasPage> pages;
 
-  // Current foreground text color.  'colorPixmap' is filled with it.  This is
-  // changed when an attempt is made to draw a different color.
+  // With 'Options::lazyAtlas', the glyphs not yet in 'pages' and the
+  // state for placing them.  Otherwise NULL.
+  std::unique_ptr<LazyAtlas> lazyAtlas;
+
+  // Current foreground text color.
   QColor fgColor;
 
   // Current background text color.
   QColor bgColor;
 
-  // Current state of 'colorPixmap' relative to 'fgColor' and
-  // 'bgColor'.
-  enum ColorPixmapState {
-    CPS_SOLID,               // entirely filled with 'fgColor'
-    CPS_MIX                  // 'fgColor' foreground, 'bgColor' background
-  };
-  ColorPixmapState colorPixmapState;
-
   // Relative to the origin, the minimal bounding box that encloses
   // every glyph in the font.
   QRect allCharsBBox;
 
-  // Map from character index to associated metrics.  It does not
-  // "grow"; I use GrowArray for its bounds checking.
-  GrowArray<Metrics> metrics;
+  // Map from character index to associated metrics.  This is sparse,
+  // so a Unicode font with a few glyphs at high code points does not
+  // pay for all the empty slots below them.
+  CodePointTable<Metrics> metrics;
 
   // Nominal font-wide metrics.  This is used, for example, to know
   // the proper size for a synthesized replacement glyph.
   Metrics nominalFontMetrics;
 
+  // Measurements of characters 0 to 255.  Set by the constructor.
+  ByteMetrics byteMetrics;
+
+  // True if every glyph's offset moves right or not at all, and never
+  // vertically.  Culling against a visible rectangle relies on this.
+  bool leftToRight;
+
   // True if drawing operations will use transparent backgrounds,
   // false for opaque backgrounds.
   bool transparent;
 
+  // How glyphs are drawn.
+  Backend backend;
+
+  // For B_INDEXED_IMAGE, the color table: entry 0 is the background,
+  // which is fully transparent when 'transparent' is true, and entry 1
+  // is the foreground.  This is kept up to date even when another
+  // backend is in use since doing so is cheap.
+  QVector<QRgb> indexedColorTable;
+
+  // For B_MASKED_PIXMAP, color pixmaps prepared for recently used
+  // color combinations.  Cost is measured in bytes.
+  LRUCache<ColorKey, ColorPixmaps> colorPixmapCache;
+
+  // The 'colorPixmapCache' entry for the current colors, or NULL if it
+  // has not been looked up since they last changed.
+  ColorPixmaps *currentColorPixmaps;
+
+  // Recently drawn strings, when enabled by a positive budget.  Cost is
+  // measured in bytes.
+  LRUCache<LineKey, CachedLine> lineCache;
+
+  // Hex quads drawn by 'drawHexQuadCell' in this font's nominal cell.
+  // Cost is measured in bytes.
+  LRUCache<HexQuadKey, CachedLine> hexQuadCache;
+
+  // Map from recently hit-tested strings to their prefix sums of
+  // horizontal advances: entry 'i' is the x coordinate of character
+  // 'i', for 'i' in [0,len].  Cost is measured in bytes.
+  LRUCache<QByteArray, QVector<int> > prefixAdvanceCache;
+
+  // Recently computed elision cut points.  Cost is measured in bytes.
+  LRUCache<ElideKey, ElideCut> elideCache;
+
+  // Number distinguishing this font from all others created in this
+  // process, for use in cache keys.
+  unsigned long serialNumber;
+
+  // Serial number for the next font.
+  static unsigned long nextSerialNumber;
+
 private:     // funcs
-  void createMixedColorPixmap();
-  void createSolidColorPixmap();
+  long colorPixmapsBytes() const;
+  QPixmap createColorPixmap(AtlasPage const *page) const;
+  QPixmap createAlphaColorPixmap(AtlasPage const *page) const;
+  QPixmap const &getColorPixmap(int pageIndex);
+  void colorsChanged();
+  void updateIndexedColorTable();
+  explicit QtBDFFont(int glyphIndexLimit);
+  void packGlyphs(BDFFont const &font, Options const &options,
+                  ObjArrayStack<QImage> &masks);
+  static QImage *newMaskImage(QSize size);
+  void installPages(ObjArrayStack<QImage> const &masks);
+  void computeByteMetrics();
+  void initLazyAtlas(BDFFont const &font, Options const &options,
+                     ArrayStack<int> const &toPack, int maxWidth);
+  void placeGlyph(int index);
+  void placeChars(char const *str, int len);
+  void placeAllGlyphs();
+  void syncPages();
+  QVector<int> const &getPrefixAdvances(char const *str, int len);
+  void drawCharIndexed(QPainter &dest, QPoint pt, Metrics const &met);
+  void drawCharDirect(QImage &dest, QPoint pt, Metrics const &met) const;
+  QPoint drawCharsUncached(QPainter &dest, QPoint pt,
+                           char const *str, int len);
+  void drawGlyphFragments(QPainter &dest, QPoint const *origins,
+                          int const *indices, int n);
+  QPoint drawCharsCached(QPainter &dest, QPoint pt,
+                         char const *str, int len);
 
 public:      // funcs
   // This makes a copy of all required data in 'font'; 'font' can be
@@ -160,9 +490,39 @@ public:      // funcs
   //
   // The initial drawing attributes black text on a white background,
   // but 'transparent' is true.
-  QtBDFFont(BDFFont const &font);
+  QtBDFFont(BDFFont const &font, Options const &options = Options());
+
+  // Make a font from data compiled at build time by
+  // 'writeCompiledFont' (see qtbdffont-data.h).  This copies the atlas
+  // bits and metrics into place, skipping the parsing and packing.
+  explicit QtBDFFont(QtBDFFontData const &data);
   ~QtBDFFont();
 
+  // Write C++ source that defines a QtBDFFontData called 'name' with
+  // the metrics and atlas that 'QtBDFFont(font, options)' would
+  // compute.  This does not need a QGuiApplication, so it can run as
+  // part of the build.  The source 'static_assert's the current
+  // QTBDFFONT_DATA_VERSION, so a stale generated file fails to compile.
+  static void writeCompiledFont(BDFFont const &font,
+                                Options const &options,
+                                char const *name, std::ostream &os);
+
+  // Describe this font's metrics and atlas in 'data', for saving it
+  // elsewhere; 'QtBDFFont(data)' then makes an equivalent font.  The
+  // arrays in 'data' point into 'glyphs' and 'pageData', and the page
+  // bits point into this font, so 'data' is only valid while all
+  // three are unchanged.  A lazy atlas is completed first.
+  void getData(QtBDFFontData &data,
+               ArrayStack<QtBDFFontGlyphData> &glyphs,
+               ArrayStack<QtBDFFontPageData> &pageData);
+
+  // Return the number of atlas pages used to hold the glyphs.
+  int numAtlasPages() const { return pages.length(); }
+
+  // Return the number of glyphs with pixels that have not yet been
+  // copied into the atlas.  Always 0 unless 'Options::lazyAtlas'.
+  int numUnplacedGlyphs() const;
+
   // Return the maximum valid character index, or -1 if there are no
   // valid indices.
   int maxValidChar() const;
@@ -194,6 +554,89 @@ public:      // funcs
   // next.
   QPoint getNominalCharOffset() const;
 
+  // True if every character from 0 to 255 that is present has the
+  // same horizontal offset, as with a fixed-width font.
+  bool isMonospace() const { return byteMetrics.monospaceAdvance != 0; }
+
+  // For a monospace font, the common horizontal offset.  Otherwise 0.
+  int getMonospaceAdvance() const { return byteMetrics.monospaceAdvance; }
+
+  // True if characters 1 to 255 are all present, so that only NUL
+  // bytes can be missing from a byte string.
+  bool hasAllByteChars() const { return byteMetrics.allPresent; }
+
+  // Array of 256 entries, 'getCharOffset(i).x()' for each character
+  // index 'i' a byte can name, for clients that measure byte strings
+  // in their own loops.  It is valid as long as this font is.
+  int const *getByteAdvances() const { return byteMetrics.advanceX; }
+
+  // Same, for 'getCharOffset(i).y()', which is almost always 0.
+  int const *getByteAdvancesY() const { return byteMetrics.advanceY; }
+
+  // Return the sum of 'getCharOffset' over the bytes of [str,str+len),
+  // treating each as a character index as 'drawChars' does.  This is
+  // the origin, relative to 'pt', that 'drawChars' would return.  For
+  // a monospace font that has characters 1 to 255, this is O(1).
+  QPoint getCharsAdvance(char const *str, int len) const;
+
+  // Return what the global 'getStringBBox' returns for [str,str+len).
+  QRect getCharsBBox(char const *str, int len) const;
+
+  // Return the x coordinate, relative to the string origin, of the
+  // origin of character 'index' of [str,str+len), treating bytes as
+  // character indices as 'drawChars' does.  'index' is clamped to
+  // [0,len]; 'len' gives the x coordinate of the end.
+  int xForCharIndex(char const *str, int len, int index);
+
+  // Return the index in [0,len] of the character boundary nearest to
+  // 'x', relative to the string origin, as for placing a caret where
+  // the user clicked.  When two boundaries are equally near, or
+  // coincide because of missing glyphs (which have no width), the
+  // lower index wins.
+  //
+  // Both of these keep the prefix sums of the string's advances in a
+  // cache keyed by the string's contents, so after the first query on
+  // a string, a query takes one cache lookup and a binary search.  The
+  // lookup compares the string against cached keys, so it still costs
+  // time proportional to 'len', but as a few 'memcmp' calls rather
+  // than a pass over the character metrics.  For a monospace font the
+  // results are computed directly.
+  int hitTestChars(char const *str, int len, int x);
+
+  // Get and set the maximum number of bytes kept for hit testing.
+  // The default is 1 MB.
+  long getHitTestCacheBudget() const;
+  void setHitTestCacheBudget(long bytes);
+
+  // Get hit/miss counts and memory use of the hit testing cache.
+  CacheStats getHitTestCacheStats() const;
+
+  // Compute how to shorten [str,str+len) so the width of its ink, as
+  // 'getCharsBBox' measures it, with "..." in place of the removed
+  // characters, is at most 'width'.  Keep [0,prefixLength) and
+  // [suffixStart,len); the ellipsis goes between them if the return
+  // value is true.  If the string already fits, or
+  // 'mode' is Qt::ElideNone, return false with 'prefixLength' and
+  // 'suffixStart' both 'len'.  If not even the ellipsis fits, keep
+  // nothing but the ellipsis.
+  //
+  // The cut is found by binary search over the possible cut points,
+  // measuring each in constant time from the string's cached prefix
+  // sums (see 'hitTestChars') and per-prefix and per-suffix ink
+  // extents.  It is itself cached by string, width and mode, since
+  // views tend to draw the same labels repeatedly.
+  bool getElideCut(char const *str, int len, int width,
+                   Qt::TextElideMode mode,
+                   int &prefixLength, int &suffixStart);
+
+  // Get and set the maximum number of bytes of elision cut points
+  // kept by 'getElideCut'.  The default is 256 KB.
+  long getElideCacheBudget() const;
+  void setElideCacheBudget(long bytes);
+
+  // Get hit/miss counts and memory use of the elision cache.
+  CacheStats getElideCacheStats() const;
+
   // Render a single character at 'pt'.
   //
   // If 'transparent' is true, only draw the foreground pixels using
@@ -205,6 +648,49 @@ public:      // funcs
   // If there is no glyph with the given index, this is a no-op.
   void drawChar(QPainter &dest, QPoint pt, int index);
 
+  // Same as above, but write the pixels directly into 'dest', without
+  // going through QPainter.  This is much faster when drawing lots of
+  // text into offscreen images.  It produces the same pixels as
+  // drawing with a QPainter on 'dest' would, and clips to the bounds
+  // of 'dest'.
+  //
+  // If 'canDrawDirectly(dest)' is false, this falls back on using a
+  // QPainter.
+  void drawChar(QImage &dest, QPoint pt, int index);
+
+  // True if 'drawChar(QImage&,...)' can write directly into 'dest'.
+  // That requires 'dest' to have format ARGB32,
+  // ARGB32_Premultiplied, RGB32 or RGB16, and the colors that will be
+  // drawn to be fully opaque.
+  bool canDrawDirectly(QImage const &dest) const;
+
+  // Draw the characters in [str,str+len) starting at 'pt', treating
+  // each byte as a character index, and return the point where the
+  // next character would go.  The result is the same as calling
+  // 'drawChar' for each character, but the pixmap backends submit
+  // runs of glyphs from the same atlas page in a single
+  // QPainter::drawPixmapFragments call, which saves a lot of per-call
+  // painter overhead.
+  //
+  // If the line cache is enabled (see 'setLineCacheBudget'), the
+  // string is instead rendered once per color combination into a
+  // pixmap, and drawn from there.
+  QPoint drawChars(QPainter &dest, QPoint pt, char const *str, int len);
+
+  // Same, but only draw the characters that could touch 'visible',
+  // which is in the logical coordinates of 'dest'.  The return value
+  // is the same as if all were drawn.
+  QPoint drawChars(QPainter &dest, QPoint pt, char const *str, int len,
+                   QRect const &visible);
+
+  // Draw character 'indices[i]' with its origin at 'origins[i]', for
+  // each 'i' in [0,n).  The result is the same as calling 'drawChar'
+  // for each in order, but batched as in 'drawChars'.  Unlike
+  // 'drawChars', this handles any character index, and the caller
+  // chooses the positions.
+  void drawCharsAt(QPainter &dest, QPoint const *origins,
+                   int const *indices, int n);
+
   // Get and set fg/bg colors.  Subsequent calls to 'drawChar'
   // will use these colors.
   QColor getFgColor() const { return fgColor; }
@@ -218,6 +704,56 @@ public:      // funcs
   // Get and set 'transparent'.
   bool getTransparent() const { return transparent; }
   void setTransparent(bool newTransparent);
+
+  // Set 'transparent' and the backend together.  For example,
+  // 'setTransparent(true, B_ALPHA_PIXMAP)' selects fast transparent
+  // drawing.
+  void setTransparent(bool newTransparent, Backend newBackend);
+
+  // Get and set the drawing backend.  The default is B_MASKED_PIXMAP.
+  Backend getBackend() const { return backend; }
+  void setBackend(Backend newBackend);
+
+  // Get and set the maximum number of bytes of color pixmaps kept,
+  // counting every cached color combination, the current one included.
+  // Each combination is charged 4 bytes per pixel of every atlas page
+  // from when it is first used, even though its pixmaps are made one
+  // page at a time as needed.  The most recently used combination is
+  // kept even if it alone exceeds the budget.  The default is 8 MB.
+  long getColorPixmapCacheBudget() const;
+  void setColorPixmapCacheBudget(long bytes);
+
+  // Get hit/miss counts and memory use of the color pixmap cache.
+  CacheStats getColorPixmapCacheStats() const;
+
+  // Get and set the maximum number of bytes of rendered strings kept
+  // by 'drawChars'.  Views that redraw the same lines repeatedly, such
+  // as status bars and labels, can turn this on so that each repeat is
+  // a single blit.  Since entries are keyed by the colors and
+  // transparency as well as the text, a change of colors never draws
+  // stale pixels.  The default is 0, which disables the cache.
+  long getLineCacheBudget() const;
+  void setLineCacheBudget(long bytes);
+
+  // Get hit/miss counts and memory use of the line cache.
+  CacheStats getLineCacheStats() const;
+
+  // Draw a hex quad for 'codePoint' with 'minihexFont', in the nominal
+  // cell of this font whose baseline point is 'pt', producing the same
+  // pixels as 'drawHexQuad(minihexFont, dest, getNominalCharCell(pt),
+  // codePoint)'.  The quad is rendered once per code point and
+  // 'minihexFont' attributes, and is then a single blit.  This is
+  // what 'drawCharOrHexQuad' uses for missing glyphs.
+  void drawHexQuadCell(QtBDFFont &minihexFont, QPainter &dest,
+                       QPoint pt, int codePoint);
+
+  // Get and set the maximum number of bytes of hex quads kept by
+  // 'drawHexQuadCell'.  The default is 2 MB.
+  long getHexQuadCacheBudget() const;
+  void setHexQuadCacheBudget(long bytes);
+
+  // Get hit/miss counts and memory use of the hex quad cache.
+  CacheStats getHexQuadCacheStats() const;
 };
 
 
@@ -225,8 +761,26 @@ public:      // funcs
 //
 // The individual characters in 'str' are interpreted as 'unsigned
 // char' for purposes of extracting a character index.  (See note at
-// top of file.)
+// top of file.)  All 'str.length()' bytes are drawn, including any
+// NUL bytes, which are character index 0; drawing does not stop at
+// the first NUL.
+//
+// If 'dest' has a clip region, or no transformation beyond a
+// translation, characters that cannot be visible are skipped.
+void drawString(QtBDFFont &font, QPainter &dest,
+                QPoint pt, rostring str);
+
+// Same, but skip characters that would not touch 'visible', in the
+// logical coordinates of 'dest'.  This is for clients that know more
+// about what is exposed than the painter does.
 void drawString(QtBDFFont &font, QPainter &dest,
+                QPoint pt, rostring str, QRect const &visible);
+
+
+// Draw a string at 'pt' by writing directly into 'dest'.  See
+// 'QtBDFFont::drawChar(QImage&,...)'.  As with the QPainter version,
+// all 'str.length()' bytes are drawn, including any NUL bytes.
+void drawString(QtBDFFont &font, QImage &dest,
                 QPoint pt, rostring str);
 
 
@@ -237,6 +791,29 @@ void drawString(QtBDFFont &font, QPainter &dest,
 QRect getStringBBox(QtBDFFont &font, rostring str);
 
 
+// Return the point where the next character would go after drawing
+// 'str' at (0,0), that is, the total of the characters' offsets.  This
+// is the usual "width" of a string for layout purposes.
+QPoint getStringAdvance(QtBDFFont const &font, rostring str);
+
+
+// Return the x coordinate of character 'index' of 'str' drawn at
+// (0,0).  See 'QtBDFFont::xForCharIndex'.
+int xForIndex(QtBDFFont &font, rostring str, int index);
+
+
+// Return the index of the character boundary in 'str' drawn at (0,0)
+// that is nearest to 'x'.  See 'QtBDFFont::hitTestChars'.
+int hitTestString(QtBDFFont &font, rostring str, int x);
+
+
+// Measure 'n' strings at once, storing the horizontal advance of
+// 'strs[i]' in 'advances[i]', and return the largest, or 0 if 'n' is
+// 0.  This is for things like sizing a column to fit its cells.
+int measureStringAdvances(QtBDFFont const &font, string const *strs,
+                          int n, int *advances);
+
+
 // Draw a string centered both horizontally and vertically about
 // the given point, according to the glyph bbox metrics.
 void drawCenteredString(QtBDFFont &font, QPainter &dest,
@@ -254,12 +831,48 @@ void drawAlignedString(QtBDFFont &font, QPainter &dest,
   QRect const &rect, Qt::Alignment alignment, string const &str);
 
 
+// Return 'str', shortened if necessary to fit in 'width' pixels by
+// replacing characters at the start, middle or end (per 'mode') with
+// "...".  Widths are measured on the ink, as for 'getStringBBox', which
+// is also what 'drawAlignedString' aligns by.
+string elideString(QtBDFFont &font, rostring str, int width,
+                   Qt::TextElideMode mode);
+
+
+// Like 'drawAlignedString', but first elide 'str' to fit the width of
+// 'rect' as with 'elideString'.  This is for labels in things like
+// table cells.  As with 'drawAlignedString', the output is not
+// clipped; it is the elision that keeps it within 'rect'.
+void drawElidedString(QtBDFFont &font, QPainter &dest,
+  QRect const &rect, Qt::Alignment alignment, rostring str,
+  Qt::TextElideMode mode = Qt::ElideRight);
+
+
 // Draw a string that contains multiple newline-separated lines.
 // The 'upLeft' is the upper-left corner to start at; it is *not*
-// the starting origin.
+// the starting origin.  Empty lines are skipped, so they take no
+// vertical space.
+//
+// As with 'drawString', lines and characters outside the painter's
+// clip are skipped, so drawing a small part of a long text is cheap.
 void drawMultilineString(QtBDFFont &font, QPainter &dest,
                          QPoint upLeft, rostring str);
 
+// Same, but skip anything that would not touch 'visible'.
+void drawMultilineString(QtBDFFont &font, QPainter &dest,
+                         QPoint upLeft, rostring str,
+                         QRect const &visible);
+
+
+// Shift the pixels of 'area' within 'pixmap' up by 'lines' lines of
+// 'font' text, or down if 'lines' is negative, using the line height
+// of 'drawMultilineString'.  Return the part of 'area' that was
+// exposed, which the caller must redraw, for example by filling it
+// and drawing the text again with the painter clipped to it.  This is
+// the cheap way to scroll a backbuffer full of text.
+QRect scrollTextLines(QtBDFFont const &font, QPixmap &pixmap,
+                      QRect const &area, int lines);
+
 
 // Draw four uppercase hexadecimal characters in the given bounds
 // rectangle arranged in a pattern like this:
@@ -277,10 +890,34 @@ void drawHexQuad(QtBDFFont &font, QPainter &paint,
 
 // If 'codePoint' has a glyph in 'mainFont', draw it at 'pt'.
 // Otherwise, use 'minihexFont' to draw a hex quad showing the code
-// point value.  Either way, return the baseline point for the next
-// glyph.
+// point value, via 'mainFont.drawHexQuadCell'.  Either way, return the
+// baseline point for the next glyph.
 QPoint drawCharOrHexQuad(QtBDFFont &mainFont, QtBDFFont &minihexFont,
                          QPainter &dest, QPoint pt, int codePoint);
 
 
+// UTF-8 variants of the string functions.  Rather than treating each
+// byte as a character index, these decode 'utf8' and use the
+// resulting code points.  Malformed sequences are treated as U+FFFD,
+// one byte at a time.  Code points missing from 'font' take up a
+// nominal character cell, in which a hex quad is drawn if
+// 'minihexFont' is not NULL (as with 'drawCharOrHexQuad').
+//
+// Runs of ASCII are found several bytes at a time and drawn as with
+// 'drawString', so ASCII text is about as fast as with the byte
+// routines.
+
+// Like 'drawString'.  Return the origin for the next character.
+QPoint drawUTF8String(QtBDFFont &font, QPainter &dest, QPoint pt,
+                      rostring utf8, QtBDFFont *minihexFont = NULL);
+
+// Like 'getStringBBox'.
+QRect getUTF8StringBBox(QtBDFFont &font, rostring utf8);
+
+// Like 'drawAlignedString'.
+void drawAlignedUTF8String(QtBDFFont &font, QPainter &dest,
+  QRect const &rect, Qt::Alignment alignment, rostring utf8,
+  QtBDFFont *minihexFont = NULL);
+
+
 #endif // QTBDFFONT_H
@@ -0,0 +1,36 @@
+// styled-fonts.cc
+// code for styled-fonts.h; tests are in test-qtbdffont.cc
+
+#include "styled-fonts.h"              // this module
+
+// smbase
+#include "xassert.h"                   // xassert
+
+
+StyledFonts::StyledFonts()
+{
+  for (int s=0; s < NUM_TEXT_STYLES; s++) {
+    m_fonts[s] = nullptr;
+  }
+}
+
+
+StyledFonts::StyledFonts(QtBDFFont *regular, QtBDFFont *bold,
+                         QtBDFFont *italic)
+{
+  xassert(regular);
+  m_fonts[TS_REGULAR] = regular;
+  m_fonts[TS_BOLD] = bold? bold : regular;
+  m_fonts[TS_ITALIC] = italic? italic : regular;
+}
+
+
+QtBDFFont &StyledFonts::forStyle(TextStyle style) const
+{
+  xassert((unsigned)style < (unsigned)NUM_TEXT_STYLES);
+  xassert(!isEmpty());
+  return *(m_fonts[style]);
+}
+
+
+// EOF
@@ -0,0 +1,45 @@
+// styled-fonts.h
+// TextStyle and StyledFonts, for text drawn in regular, bold and italic.
+
+#ifndef SMQTUTIL_STYLED_FONTS_H
+#define SMQTUTIL_STYLED_FONTS_H
+
+class QtBDFFont;                       // qtbdffont.h
+
+
+// Which member of a StyledFonts some text uses.
+enum TextStyle {
+  TS_REGULAR,
+  TS_BOLD,
+  TS_ITALIC,
+
+  NUM_TEXT_STYLES
+};
+
+
+// A regular font and optional bold and italic variants, such as the
+// 'editor14[rbi]' trio.  The fonts are not owned.
+class StyledFonts {
+private:     // data
+  // Font for each style.  Bold and italic are never NULL if regular
+  // is not, since they fall back to it.
+  QtBDFFont *m_fonts[NUM_TEXT_STYLES];
+
+public:      // funcs
+  // No fonts at all.
+  StyledFonts();
+
+  // 'regular' must not be NULL.  Missing variants fall back to it.
+  explicit StyledFonts(QtBDFFont *regular,
+                       QtBDFFont *bold = nullptr,
+                       QtBDFFont *italic = nullptr);
+
+  // True if made by the default constructor.
+  bool isEmpty() const { return m_fonts[TS_REGULAR] == nullptr; }
+
+  // Font for 'style'.  Must not be empty.
+  QtBDFFont &forStyle(TextStyle style) const;
+};
+
+
+#endif // SMQTUTIL_STYLED_FONTS_H
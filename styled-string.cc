@@ -0,0 +1,127 @@
+// styled-string.cc
+// code for styled-string.h; tests are in test-qtbdffont.cc
+
+#include "styled-string.h"             // this module
+
+// this directory
+#include "qtbdffont.h"                 // QtBDFFont
+
+// smbase
+#include "xassert.h"                   // xassert
+
+
+// ------------------------- TextSpan ----------------------------
+TextSpan::TextSpan(int start, int length, QColor const &fg,
+                   TextStyle style)
+  : m_start(start),
+    m_length(length),
+    m_fg(fg.rgba()),
+    m_bg(0),
+    m_transparent(true),
+    m_style(style)
+{}
+
+
+TextSpan::TextSpan(int start, int length, QColor const &fg,
+                   QColor const &bg, TextStyle style)
+  : m_start(start),
+    m_length(length),
+    m_fg(fg.rgba()),
+    m_bg(bg.rgba()),
+    m_transparent(false),
+    m_style(style)
+{}
+
+
+TextSpan::TextSpan()
+  : m_start(0),
+    m_length(0),
+    m_fg(0),
+    m_bg(0),
+    m_transparent(true),
+    m_style(TS_REGULAR)
+{}
+
+
+// --------------------- drawStyledString ------------------------
+QPoint drawStyledString(StyledFonts const &fonts, QPainter &dest,
+                        QPoint pt, rostring str,
+                        ArrayStack<TextSpan> const &spans)
+{
+  char const *text = str.c_str();
+  int len = str.length();
+
+  // Original attributes of each font, to restore at the end.  Those
+  // of the regular font also apply to bytes outside the spans.
+  QColor origFg[NUM_TEXT_STYLES];
+  QColor origBg[NUM_TEXT_STYLES];
+  bool origTransparent[NUM_TEXT_STYLES];
+  for (int s=0; s < NUM_TEXT_STYLES; s++) {
+    QtBDFFont &font = fonts.forStyle((TextStyle)s);
+    origFg[s] = font.getFgColor();
+    origBg[s] = font.getBgColor();
+    origTransparent[s] = font.getTransparent();
+  }
+  QtBDFFont &regular = fonts.forStyle(TS_REGULAR);
+  QColor const &regularFg = origFg[TS_REGULAR];
+  QColor const &regularBg = origBg[TS_REGULAR];
+  bool regularTransparent = origTransparent[TS_REGULAR];
+
+  // Next byte to draw.
+  int cur = 0;
+
+  for (int i=0; i < spans.length(); i++) {
+    TextSpan const &span = spans[i];
+    xassert(span.m_start >= cur && span.m_length >= 0 &&
+            span.m_start + span.m_length <= len);
+
+    // Gap before the span.
+    if (span.m_start > cur) {
+      regular.setFgColor(regularFg);
+      regular.setBgColor(regularBg);
+      regular.setTransparent(regularTransparent);
+      pt = regular.drawChars(dest, pt, text + cur, span.m_start - cur);
+    }
+
+    // The span itself.
+    QtBDFFont &font = fonts.forStyle(span.m_style);
+    font.setFgColor(QColor::fromRgba(span.m_fg));
+    if (!span.m_transparent) {
+      font.setBgColor(QColor::fromRgba(span.m_bg));
+    }
+    font.setTransparent(span.m_transparent);
+    pt = font.drawChars(dest, pt, text + span.m_start, span.m_length);
+
+    cur = span.m_start + span.m_length;
+  }
+
+  // Trailing gap.
+  if (cur < len) {
+    regular.setFgColor(regularFg);
+    regular.setBgColor(regularBg);
+    regular.setTransparent(regularTransparent);
+    pt = regular.drawChars(dest, pt, text + cur, len - cur);
+  }
+
+  // Restore the fonts.  A variant that falls back to the regular font
+  // saved the same attributes, so the order does not matter.
+  for (int s=0; s < NUM_TEXT_STYLES; s++) {
+    QtBDFFont &font = fonts.forStyle((TextStyle)s);
+    font.setFgColor(origFg[s]);
+    font.setBgColor(origBg[s]);
+    font.setTransparent(origTransparent[s]);
+  }
+
+  return pt;
+}
+
+
+QPoint drawStyledString(QtBDFFont &font, QPainter &dest,
+                        QPoint pt, rostring str,
+                        ArrayStack<TextSpan> const &spans)
+{
+  return drawStyledString(StyledFonts(&font), dest, pt, str, spans);
+}
+
+
+// EOF
@@ -0,0 +1,76 @@
+// styled-string.h
+// Drawing strings whose parts have different colors and styles.
+
+#ifndef SMQTUTIL_STYLED_STRING_H
+#define SMQTUTIL_STYLED_STRING_H
+
+// this directory
+#include "styled-fonts.h"              // StyledFonts, TextStyle
+
+// smbase
+#include "array.h"                     // ArrayStack
+#include "str.h"                       // rostring
+
+// Qt
+#include <QColor>
+#include <QPoint>
+
+class QPainter;                        // qpainter.h
+class QtBDFFont;                       // qtbdffont.h
+
+
+// Attributes for a range of bytes in a string passed to
+// 'drawStyledString'.
+class TextSpan {
+public:      // data
+  // Byte range [m_start, m_start+m_length) of the string.
+  int m_start;
+  int m_length;
+
+  // Foreground color.
+  QRgb m_fg;
+
+  // Background color, used only if 'm_transparent' is false.
+  QRgb m_bg;
+
+  // True to draw only the foreground pixels.
+  bool m_transparent;
+
+  // Font to use.
+  TextStyle m_style;
+
+public:      // funcs
+  // Span with a transparent background.
+  TextSpan(int start, int length, QColor const &fg,
+           TextStyle style = TS_REGULAR);
+
+  // Span with an opaque background.
+  TextSpan(int start, int length, QColor const &fg, QColor const &bg,
+           TextStyle style = TS_REGULAR);
+
+  // Required by ArrayStack.
+  TextSpan();
+};
+
+
+// Draw 'str' at 'pt', treating each byte as a character index as
+// 'drawString' does, with the colors and style of each byte given by
+// 'spans'.  The spans must be in increasing order and must not
+// overlap.  Bytes not covered by a span are drawn in the regular font
+// with its current attributes.  Return the origin for the next
+// character.
+//
+// Each span is drawn directly with 'QtBDFFont::drawChars', whose
+// color pixmap cache makes switching among a few colors cheap.
+// Afterward, the fonts have the attributes they had before.
+QPoint drawStyledString(StyledFonts const &fonts, QPainter &dest,
+                        QPoint pt, rostring str,
+                        ArrayStack<TextSpan> const &spans);
+
+// Same, with every style using 'font'.
+QPoint drawStyledString(QtBDFFont &font, QPainter &dest,
+                        QPoint pt, rostring str,
+                        ArrayStack<TextSpan> const &spans);
+
+
+#endif // SMQTUTIL_STYLED_STRING_H
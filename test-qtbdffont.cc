@@ -4,11 +4,22 @@
 #include "qtbdffont.h"                 // module to test
 
 // this directory
+#include "code-point-table.h"          // CodePointTable
+#include "lru-cache.h"                 // CacheStats
 #include "courR24_ISO8859_1.bdf.gen.h" // bdfFontData_courR24_ISO8859_1
+#include "editor14b.bdf.gen.h"         // bdfFontData_editor14b
+#include "editor14i.bdf.gen.h"         // bdfFontData_editor14i
 #include "editor14r.bdf.gen.h"         // bdfFontData_editor14r
+#include "editor14r.bdf.qtfont.h"      // qtbdfFontData_editor14r
 #include "lurs12.bdf.gen.h"            // bdfFontData_lurs12
 #include "minihex6.bdf.gen.h"          // bdfFontData_minihex6
+#include "qtbdffont-cache.h"           // loadBDFFontCached
+#include "qtbdffont-chain.h"           // QtBDFFontChain
 #include "qtutil.h"                    // toString(QRect)
+#include "styled-string.h"             // drawStyledString
+#include "text-display-list.h"         // TextDisplayList
+#include "text-grid-widget.h"          // TextGridWidget
+#include "text-wrap-layout.h"          // TextWrapLayout
 
 // smbase
 #include "bdffont.h"                   // BDFFont
@@ -20,17 +31,31 @@
 
 // Qt
 #include <qapplication.h>              // QApplication
+#include <qdir.h>                      // QDir
+#include <qfile.h>                     // QFile
+#include <qfileinfo.h>                 // QFileInfo
 #include <qimage.h>                    // QImage
 #include <qlabel.h>                    // QLabel
 #include <qpainter.h>                  // QPainter
+#include <qpicture.h>                  // QPicture
+
+// libc++
+#include <sstream>                     // std::ostringstream
 
 // libc
-#include <stdlib.h>                    // getenv
+#include <stdio.h>                     // snprintf
+#include <stdlib.h>                    // getenv, abs
+#include <string.h>                    // memcmp, strstr
 
 
 ARGS_MAIN
 
 
+// True if the "timing" argument was given, to run the timing
+// comparisons.  They check nothing, so they are off by default.
+static bool runTimings = false;
+
+
 // Test whether 'qfont' has the same information as 'font'.  Throw
 // an exception if not.
 static void compare(BDFFont const &font, QtBDFFont &qfont)
@@ -185,93 +210,2325 @@ static void compare(BDFFont const &font, QtBDFFont &qfont)
 }
 
 
-void entry(int argc, char **argv)
+// Draw glyph 'charIndex' with the current settings of 'qfont' onto an
+// image filled with 'canvas', and check that every pixel has the color
+// implied by 'font', the fg/bg colors, and 'transparent'.
+static void checkGlyphColors(BDFFont const &font, QtBDFFont &qfont,
+                             int charIndex, QColor canvas)
 {
-  BDFFont font;
-  parseBDFString(font, bdfFontData_editor14r);
+  BDFFont::Glyph const *fontGlyph = font.getGlyph(charIndex);
+  xassert(fontGlyph && fontGlyph->bitmap);
+
+  QRect bbox = qfont.getCharBBox(charIndex);
+  enum { MARGIN = 4 };
+  QImage image(bbox.width() + MARGIN*2, bbox.height() + MARGIN*2,
+               QImage::Format_RGB32);
+  image.fill(canvas);
+  {
+    QPainter painter(&image);
+    qfont.drawChar(painter, QPoint(MARGIN,MARGIN) - bbox.topLeft(),
+                   charIndex);
+  }
 
-  // This is a really ugly way to detect a dependence on X11, and is
-  // wrong on Mac OS/X.  But I sunk at least half an hour trying to
-  // figure out the proper placement for Q_WS_X11 in Qt5 and could not!
-  if (!SMFileUtil().windowsPathSemantics() &&
-      !getenv("DISPLAY")) {
-    cout << "Running on non-Windows platform, DISPLAY not set.\n";
-    cout << "Set DISPLAY in order to run the rest of this test.\n";
-    return;
+  for (int y=0; y < image.height(); y++) {
+    for (int x=0; x < image.width(); x++) {
+      point corresp(x - MARGIN, y - MARGIN);
+      QColor expect = canvas;
+      if (fontGlyph->bitmap->okpt(corresp)) {
+        if (fontGlyph->bitmap->get(corresp)) {
+          expect = qfont.getFgColor();
+        }
+        else if (!qfont.getTransparent()) {
+          expect = qfont.getBgColor();
+        }
+      }
+
+      QRgb actual = image.pixel(x,y);
+      if (qRgb(qRed(actual), qGreen(actual), qBlue(actual)) !=
+          expect.rgb()) {
+        xfailure(stringb("index " << charIndex <<
+                         " pixel (" << x << ", " << y << "): expected " <<
+                         qrgbToString(expect.rgb()) << " but got " <<
+                         qrgbToString(actual)));
+      }
+    }
   }
+}
 
-  QApplication app(argc, argv);
 
-  // first compare with transparent drawing
-  QtBDFFont qfont(font);
-  compare(font, qfont);
+// Check drawing with several color combinations, in both transparent
+// and opaque modes, switching colors between every draw.
+static void testColorChanges(BDFFont const &font, QtBDFFont &qfont)
+{
+  QColor const colors[] = {
+    QColor(255,0,0),
+    QColor(0,0,255),
+    QColor(0,128,0),
+    QColor(255,255,0),
+  };
+  QColor const canvas(128,128,128);
+
+  QColor origFg = qfont.getFgColor();
+  QColor origBg = qfont.getBgColor();
+  bool origTransparent = qfont.getTransparent();
+
+  for (int t=0; t < 2; t++) {
+    qfont.setTransparent(t==0);
+    for (int f=0; f < TABLESIZE(colors); f++) {
+      for (int b=0; b < TABLESIZE(colors); b++) {
+        if (f == b) {
+          continue;
+        }
+        qfont.setFgColor(colors[f]);
+        qfont.setBgColor(colors[b]);
+        checkGlyphColors(font, qfont, 'A', canvas);
+        checkGlyphColors(font, qfont, 'g', canvas);
+      }
+    }
+  }
 
-  // then with opaque drawing
-  qfont.setTransparent(false);
-  compare(font, qfont);
+  qfont.setFgColor(origFg);
+  qfont.setBgColor(origBg);
+  qfont.setTransparent(origTransparent);
 
-  // Test another cycle of switching modes.
-  qfont.setTransparent(true);
-  compare(font, qfont);
-  qfont.setTransparent(false);
-  compare(font, qfont);
+  cout << "color changes ok with backend " << (int)qfont.getBackend()
+       << "\n";
+}
 
-  cout << "test-qtbdffont console tests passed\n";
-  if (argc >= 2 && 0==strcmp(argv[1], "gui")) {
-    cout << "Running gui tests..." << endl;
+
+// Check that drawing directly into a QImage produces the same pixels
+// as drawing into it with a QPainter, for each supported format, and
+// report the relative speed.
+static void testDirectImageDrawing(QtBDFFont &qfont)
+{
+  // Every printable ASCII character, with a NUL in the middle, which
+  // both paths must draw past.
+  char chars[100];
+  int numChars = 0;
+  for (int c=32; c < 127; c++) {
+    if (c == 'a') {
+      chars[numChars++] = '\0';
+    }
+    chars[numChars++] = (char)c;
   }
-  else {
-    cout << "Run with \"gui\" argument to test rendering to a window.\n";
-    return;
+  string text(chars, numChars);
+
+  QImage::Format const formats[] = {
+    QImage::Format_ARGB32,
+    QImage::Format_ARGB32_Premultiplied,
+    QImage::Format_RGB32,
+    QImage::Format_RGB16,
+  };
+
+  QColor origFg = qfont.getFgColor();
+  QColor origBg = qfont.getBgColor();
+  bool origTransparent = qfont.getTransparent();
+  qfont.setFgColor(QColor(200,0,50));
+  qfont.setBgColor(QColor(0,100,200));
+
+  for (int f=0; f < TABLESIZE(formats); f++) {
+    for (int t=0; t < 2; t++) {
+      qfont.setTransparent(t==0);
+
+      QImage viaPainter(400, 60, formats[f]);
+      viaPainter.fill(QColor(128,128,128));
+      QImage direct(viaPainter);
+      xassert(qfont.canDrawDirectly(direct));
+
+      // Draw at several places, including partly off every edge, to
+      // exercise clipping.
+      QPoint const points[] = {
+        QPoint(-7, 30),
+        QPoint(5, 5),
+        QPoint(5, 65),
+        QPoint(3, 30),
+        QPoint(-200, 45),
+      };
+      {
+        QPainter painter(&viaPainter);
+        for (int i=0; i < TABLESIZE(points); i++) {
+          drawString(qfont, painter, points[i], text);
+        }
+      }
+      for (int i=0; i < TABLESIZE(points); i++) {
+        drawString(qfont, direct, points[i], text);
+      }
+
+      if (viaPainter != direct) {
+        xfailure(stringb("direct drawing differs from QPainter for "
+                         "format " << (int)formats[f] <<
+                         ", transparent=" << (t==0)));
+      }
+
+      // Timing comparison for a screenful of text.
+      if (runTimings) {
+        int const lines = 50;
+        long start = getMilliseconds();
+        {
+          QPainter painter(&viaPainter);
+          for (int i=0; i < lines; i++) {
+            drawString(qfont, painter, QPoint(0, i), text);
+          }
+        }
+        long painterMS = getMilliseconds() - start;
+
+        start = getMilliseconds();
+        for (int i=0; i < lines; i++) {
+          drawString(qfont, direct, QPoint(0, i), text);
+        }
+        long directMS = getMilliseconds() - start;
+
+        cout << "format " << (int)formats[f]
+             << (t==0? " transparent" : " opaque")
+             << ": QPainter " << painterMS << " ms, direct "
+             << directMS << " ms\n";
+      }
+    }
   }
 
-  // use different colors for onscreen drawing
-  QColor fg = Qt::black;
-  QColor bg(224, 224, 224);
-  qfont.setFgColor(fg);
-  qfont.setBgColor(bg);
+  qfont.setFgColor(origFg);
+  qfont.setBgColor(origBg);
+  qfont.setTransparent(origTransparent);
+}
 
-  int const windowWidth = 600;
-  int const windowHeight = 600;
 
-  QLabel widget(NULL /*parent*/);
-  widget.resize(windowWidth, windowHeight);
+// Check that 'drawString', which batches glyphs, draws the same pixels
+// as individual 'drawChar' calls, for every backend and both modes.
+static void testBatchedDrawing(QtBDFFont &qfont)
+{
+  string text("The quick brown fox jumps over the lazy dog. 0123456789"
+              " !@#$%^&*()_+-={}[]|\\:;\"'<>,.?/~`");
 
-  QPixmap pixmap(windowWidth, windowHeight);
-  pixmap.fill(bg);
+  QtBDFFont::Backend origBackend = qfont.getBackend();
+  bool origTransparent = qfont.getTransparent();
 
-  QPainter painter(&pixmap);
-  painter.setPen(fg);
-  painter.drawText(50,20, "QPainter::drawText");
+  for (int b=0; b < QtBDFFont::NUM_BACKENDS; b++) {
+    for (int t=0; t < 2; t++) {
+      qfont.setTransparent(t==0, (QtBDFFont::Backend)b);
 
-  drawString(qfont, painter, QPoint(50,50),
-             "drawString(QtBDFFont &)");
+      QImage individual(500, 40, QImage::Format_RGB32);
+      individual.fill(QColor(128,128,128));
+      QImage batched(individual);
 
-  qfont.setTransparent(true);
-  drawString(qfont, painter, QPoint(50, 70),
-             "setTransparent(true)");
+      {
+        QPainter painter(&individual);
+        QPoint pt(3, 25);
+        for (char const *p = text.c_str(); *p; p++) {
+          int charIndex = (unsigned char)*p;
+          qfont.drawChar(painter, pt, charIndex);
+          pt += qfont.getCharOffset(charIndex);
+        }
+      }
+      {
+        QPainter painter(&batched);
+        drawString(qfont, painter, QPoint(3, 25), text);
+      }
 
-  qfont.setTransparent(false);
-  drawString(qfont, painter, QPoint(50, 90),
-             "setTransparent(false)");
+      if (individual != batched) {
+        xfailure(stringb("batched drawing differs for backend " << b <<
+                         ", transparent=" << (t==0)));
+      }
+    }
+  }
 
-  // test rendering performance
-  if (1) {
-    // first transparent, then opaque
-    for (int drawMode=0; drawMode < 2; drawMode++) {
-      qfont.setTransparent(drawMode==0? true : false);
+  qfont.setTransparent(origTransparent, origBackend);
+  cout << "batched drawing matches individual drawing\n";
+}
 
-      long start = getMilliseconds();
-      int iters = 10000;
-      for (int i=0; i < iters; i++) {
-        drawString(qfont, painter, QPoint(50,50),
-                   "drawString(QtBDFFont &)");
+
+// Fill 'grid' with a pattern that depends on 'seed', using all three
+// styles, several colors, and some characters missing from the font.
+static void fillGridPattern(TextGridWidget &grid, int seed)
+{
+  QRgb const colors[] = {
+    qRgb(0,0,0),
+    qRgb(255,255,255),
+    qRgb(200,0,50),
+    qRgb(0,100,200),
+  };
+
+  for (int r=0; r < grid.rows(); r++) {
+    for (int c=0; c < grid.cols(); c++) {
+      int n = r*7 + c*3 + seed;
+      int codePoint = (n % 13 == 0)? 0x1234 : 32 + n % 95;
+      grid.setCell(r, c, TextGridCell(codePoint,
+        colors[n % TABLESIZE(colors)],
+        colors[(n/5 + 1) % TABLESIZE(colors)],
+        (TextStyle)((n/3) % NUM_TEXT_STYLES)));
+    }
+  }
+}
+
+
+// Check that 'grid' looks the same as a new widget with the same fonts
+// and cells that draws everything from scratch.
+static void checkGridMatchesFullRedraw(TextGridWidget &grid,
+  QtBDFFont *regular, QtBDFFont *bold, QtBDFFont *italic,
+  QtBDFFont *minihex)
+{
+  TextGridWidget fresh;
+  fresh.setFonts(regular, bold, italic);
+  fresh.setMinihexFont(minihex);
+  fresh.setGridSize(grid.rows(), grid.cols());
+  fresh.resize(grid.size());
+  for (int r=0; r < grid.rows(); r++) {
+    for (int c=0; c < grid.cols(); c++) {
+      fresh.setCell(r, c, grid.getCell(r, c));
+    }
+  }
+
+  grid.updateBackbuffer();
+  fresh.updateBackbuffer();
+  if (fresh.backbuffer().toImage() != grid.backbuffer().toImage()) {
+    xfailure("incremental text grid drawing differs from full redraw");
+  }
+}
+
+
+// Check that TextGridWidget redraws only changed cells, and that the
+// result matches drawing everything from scratch.
+static void testTextGridWidget()
+{
+  BDFFont regularFont, boldFont, italicFont, minihexFont;
+  parseBDFString(regularFont, bdfFontData_editor14r);
+  parseBDFString(boldFont, bdfFontData_editor14b);
+  parseBDFString(italicFont, bdfFontData_editor14i);
+  parseBDFString(minihexFont, bdfFontData_minihex6);
+  QtBDFFont regular(regularFont), bold(boldFont),
+            italic(italicFont), minihex(minihexFont);
+
+  TextGridWidget grid;
+  grid.setFonts(&regular, &bold, &italic);
+  grid.setMinihexFont(&minihex);
+  grid.setGridSize(10, 40);
+  grid.resize(grid.sizeHint() + QSize(5, 5));
+
+  fillGridPattern(grid, 0);
+  grid.updateBackbuffer();
+  xassert(grid.lastRedrawnCells() == 400);
+
+  // Nothing changed, so nothing is redrawn.
+  grid.updateBackbuffer();
+  xassert(grid.lastRedrawnCells() == 0);
+
+  // Writing the same contents again is also free.
+  fillGridPattern(grid, 0);
+  grid.updateBackbuffer();
+  xassert(grid.lastRedrawnCells() == 0);
+
+  // Change a few cells.
+  grid.setText(3, 10, "hello", qRgb(0,0,0), qRgb(255,255,0));
+  grid.setCell(9, 39, TextGridCell(0x4321, qRgb(0,0,0),
+                                   qRgb(255,255,255), TS_BOLD));
+  grid.setCell(0, 0, TextGridCell('x', qRgb(0,0,0),
+                                  qRgb(255,255,255), TS_ITALIC));
+  grid.updateBackbuffer();
+  cout << "text grid redrew " << grid.lastRedrawnCells()
+       << " cells after a small change\n";
+  xassert(grid.lastRedrawnCells() <= 7);
+  checkGridMatchesFullRedraw(grid, &regular, &bold, &italic, &minihex);
+
+  // Scrolling only redraws the exposed rows.
+  grid.scrollRows(3);
+  grid.updateBackbuffer();
+  xassert(grid.lastRedrawnCells() == 3 * 40);
+  xassert(grid.getCell(0, 10) == TextGridCell('h', qRgb(0,0,0),
+                                              qRgb(255,255,0)));
+  checkGridMatchesFullRedraw(grid, &regular, &bold, &italic, &minihex);
+
+  // Scroll back down with a pending change in a row that moves.
+  grid.setText(5, 0, "pending", qRgb(200,0,50), qRgb(255,255,255));
+  grid.scrollRows(-2, TextGridCell('~', qRgb(0,0,0),
+                                   qRgb(255,255,255)));
+  grid.updateBackbuffer();
+  xassert(grid.lastRedrawnCells() <= 2 * 40 + 7);
+  xassert(grid.getCell(7, 0).m_codePoint == 'p');
+  checkGridMatchesFullRedraw(grid, &regular, &bold, &italic, &minihex);
+
+  // Scrolling by more than the grid height replaces everything.
+  grid.scrollRows(-20);
+  xassert(grid.getCell(0, 0) == TextGridCell());
+  checkGridMatchesFullRedraw(grid, &regular, &bold, &italic, &minihex);
+
+  // Timing: a full frame versus a frame where one row changed.
+  if (runTimings) {
+    TextGridWidget big;
+    big.setFonts(&regular, &bold, &italic);
+    big.setGridSize(100, 300);
+    big.resize(big.sizeHint());
+
+    long start = getMilliseconds();
+    fillGridPattern(big, 1);
+    big.updateBackbuffer();
+    long fullMS = getMilliseconds() - start;
+
+    start = getMilliseconds();
+    fillGridPattern(big, 1);
+    big.setText(50, 0, "a single changed row", qRgb(0,0,0),
+                qRgb(255,255,255));
+    big.updateBackbuffer();
+    long incrementalMS = getMilliseconds() - start;
+
+    start = getMilliseconds();
+    for (int i=0; i < 10; i++) {
+      big.scrollRows(1);
+      big.setText(99, 0, "new bottom row", qRgb(0,0,0),
+                  qRgb(255,255,255));
+      big.updateBackbuffer();
+    }
+    long scrollMS = getMilliseconds() - start;
+
+    cout << "text grid 100x300: full frame " << fullMS
+         << " ms, one changed row " << incrementalMS
+         << " ms, 10 one-row scrolls " << scrollMS << " ms\n";
+  }
+}
+
+
+// Check that drawing through the line cache gives the same pixels as
+// drawing without it, and that repeated strings hit the cache.
+static void testLineCache(QtBDFFont &qfont)
+{
+  string text("status: 42 items, 3 selected");
+
+  QtBDFFont::Backend origBackend = qfont.getBackend();
+  bool origTransparent = qfont.getTransparent();
+  QColor origFg = qfont.getFgColor();
+  CacheStats start = qfont.getLineCacheStats();
+
+  for (int b=0; b < QtBDFFont::NUM_BACKENDS; b++) {
+    for (int t=0; t < 2; t++) {
+      qfont.setTransparent(t==0, (QtBDFFont::Backend)b);
+
+      QImage uncached(300, 40, QImage::Format_RGB32);
+      uncached.fill(QColor(128,128,128));
+      QImage cached(uncached);
+
+      // Alternate between two colors, drawing the same string.
+      {
+        QPainter painter(&uncached);
+        for (int i=0; i < 10; i++) {
+          qfont.setFgColor(i%2? Qt::red : Qt::blue);
+          drawString(qfont, painter, QPoint(3, 15 + i), text);
+        }
       }
-      long elapsed = getMilliseconds() - start;
 
-      cout << (drawMode==0? "transparent: " : "opaque: ")
-           << iters << " iters in " << elapsed << " ms" << endl;
+      CacheStats before = qfont.getLineCacheStats();
+      qfont.setLineCacheBudget(1024 * 1024);
+      {
+        QPainter painter(&cached);
+        for (int i=0; i < 10; i++) {
+          qfont.setFgColor(i%2? Qt::red : Qt::blue);
+          drawString(qfont, painter, QPoint(3, 15 + i), text);
+        }
+      }
+      CacheStats stats = qfont.getLineCacheStats();
+      qfont.setLineCacheBudget(0);
+
+      if (uncached != cached) {
+        xfailure(stringb("line cache drawing differs for backend " << b <<
+                         ", transparent=" << (t==0)));
+      }
+      xassert(stats.misses - before.misses == 2);
+      xassert(stats.hits - before.hits == 8);
+      xassert(stats.entries == 2);
+      xassert(qfont.getLineCacheStats().entries == 0);
+    }
+  }
+
+  // Count only this test's lookups; 'qfont' may have used the line
+  // cache before.
+  CacheStats stats = qfont.getLineCacheStats();
+  stats.hits -= start.hits;
+  stats.misses -= start.misses;
+  cout << "line cache: hits=" << stats.hits
+       << " misses=" << stats.misses
+       << " hit rate=" << stats.hitRate() << "\n";
+  xassert(stats.hits == 8 * 2 * QtBDFFont::NUM_BACKENDS);
+
+  qfont.setFgColor(origFg);
+  qfont.setTransparent(origTransparent, origBackend);
+}
+
+
+// Draw some syntax-highlighted text, either into 'list' if it is not
+// NULL, or immediately onto 'painter'.
+static void drawHighlightedText(QtBDFFont &qfont, QtBDFFont &minihex,
+                                TextDisplayList *list, QPainter &painter)
+{
+  static char const * const tokens[] = {
+    "int", " ", "main", "(", "void", ")", " ", "{", " ", "return",
+    " ", "0", ";", " ", "}",
+  };
+  QColor const colors[] = {
+    Qt::black, Qt::blue, Qt::darkGreen, Qt::red,
+  };
+  int lineHeight = qfont.getAllCharsBBox().height();
+
+  for (int line=0; line < 20; line++) {
+    QPoint pt(5, 20 + line * lineHeight);
+    for (int t=0; t < TABLESIZE(tokens); t++) {
+      qfont.setFgColor(colors[(t + line) % TABLESIZE(colors)]);
+      if (list) {
+        pt = list->drawString(qfont, pt, tokens[t]);
+      }
+      else {
+        pt = qfont.drawChars(painter, pt, tokens[t], strlen(tokens[t]));
+      }
+    }
+
+    // A character missing from the font, drawn as a hex quad.
+    minihex.setFgColor(Qt::magenta);
+    if (list) {
+      list->drawCharOrHexQuad(qfont, minihex, pt, 0x2603);
+    }
+    else {
+      drawCharOrHexQuad(qfont, minihex, painter, pt, 0x2603);
+    }
+  }
+
+  // Overlapping draws in different colors must keep their order.
+  for (int i=0; i < 3; i++) {
+    qfont.setFgColor(colors[i]);
+    QPoint pt(30 + i*3, 20);
+    if (list) {
+      list->drawString(qfont, pt, "overlap");
+    }
+    else {
+      drawString(qfont, painter, pt, "overlap");
+    }
+  }
+}
+
+
+// Check that replaying a TextDisplayList draws the same pixels as
+// drawing immediately, with fewer state changes.
+static void testTextDisplayList(QtBDFFont &qfont)
+{
+  BDFFont minihexFont;
+  parseBDFString(minihexFont, bdfFontData_minihex6);
+  QtBDFFont minihex(minihexFont);
+
+  QColor origFg = qfont.getFgColor();
+  bool origTransparent = qfont.getTransparent();
+
+  for (int t=0; t < 2; t++) {
+    qfont.setTransparent(t==0);
+    minihex.setTransparent(t==0);
+
+    QImage immediate(400, 400, QImage::Format_RGB32);
+    immediate.fill(QColor(200,200,200));
+    QImage replayed(immediate);
+
+    qfont.setFgColor(origFg);
+    {
+      QPainter painter(&immediate);
+      drawHighlightedText(qfont, minihex, NULL, painter);
+    }
+
+    TextDisplayList list;
+    qfont.setFgColor(origFg);
+    {
+      QPainter painter(&replayed);
+      drawHighlightedText(qfont, minihex, &list, painter);
+      list.replay(painter);
+    }
+    if (immediate != replayed) {
+      xfailure(stringb("display list replay differs, transparent=" <<
+                       (t==0)));
+    }
+
+    cout << "display list: " << list.numOps() << " ops, "
+         << list.recordedStateChanges() << " state changes recorded, "
+         << list.lastStateChanges() << " replayed\n";
+    xassert(list.lastStateChanges() < list.recordedStateChanges());
+
+    // Replaying again, reusing the plan, gives the same result.
+    {
+      QPainter painter(&replayed);
+      list.replay(painter);
+    }
+    if (immediate != replayed) {
+      xfailure("second display list replay differs");
+    }
+  }
+
+  qfont.setFgColor(origFg);
+  qfont.setTransparent(origTransparent);
+}
+
+
+// Check that 'drawStyledString' draws the same as drawing each span
+// separately with the appropriate font and colors.
+static void testStyledString()
+{
+  BDFFont regularFont, boldFont, italicFont;
+  parseBDFString(regularFont, bdfFontData_editor14r);
+  parseBDFString(boldFont, bdfFontData_editor14b);
+  parseBDFString(italicFont, bdfFontData_editor14i);
+  QtBDFFont regular(regularFont), bold(boldFont), italic(italicFont);
+  StyledFonts fonts(&regular, &bold, &italic);
+
+  string text("int main(void) { return 0; } // done");
+
+  ArrayStack<TextSpan> spans;
+  spans.push(TextSpan(0, 3, Qt::blue, TS_BOLD));            // int
+  spans.push(TextSpan(4, 4, Qt::black));                     // main
+  spans.push(TextSpan(9, 4, Qt::blue, Qt::yellow, TS_BOLD)); // void
+  spans.push(TextSpan(17, 6, Qt::blue, TS_BOLD));           // return
+  spans.push(TextSpan(24, 1, Qt::red, Qt::white));           // 0
+  spans.push(TextSpan(29, 7, Qt::darkGreen, TS_ITALIC));    // comment
+
+  regular.setFgColor(Qt::darkGray);
+  regular.setTransparent(true);
+
+  QImage styled(400, 30, QImage::Format_RGB32);
+  styled.fill(QColor(220,220,220));
+  QImage manual(styled);
+
+  QPoint styledEnd;
+  {
+    QPainter painter(&styled);
+    styledEnd = drawStyledString(fonts, painter, QPoint(3, 20),
+                                 text, spans);
+  }
+
+  // The fonts are left as they were.
+  xassert(regular.getFgColor() == QColor(Qt::darkGray));
+  xassert(regular.getTransparent());
+  xassert(bold.getFgColor() == QColor(Qt::black));
+
+  QPoint manualEnd(3, 20);
+  {
+    QPainter painter(&manual);
+    char const *p = text.c_str();
+    int cur = 0;
+    for (int i=0; i <= spans.length(); i++) {
+      int start = i < spans.length()? spans[i].m_start : text.length();
+      if (start > cur) {
+        manualEnd = regular.drawChars(painter, manualEnd, p + cur,
+                                      start - cur);
+      }
+      if (i == spans.length()) {
+        break;
+      }
+
+      TextSpan const &span = spans[i];
+      QtBDFFont &font = fonts.forStyle(span.m_style);
+      QColor origFg = font.getFgColor();
+      QColor origBg = font.getBgColor();
+      bool origTransparent = font.getTransparent();
+      font.setFgColor(QColor::fromRgba(span.m_fg));
+      font.setBgColor(QColor::fromRgba(span.m_bg));
+      font.setTransparent(span.m_transparent);
+      manualEnd = font.drawChars(painter, manualEnd, p + span.m_start,
+                                 span.m_length);
+      font.setFgColor(origFg);
+      font.setBgColor(origBg);
+      font.setTransparent(origTransparent);
+      cur = span.m_start + span.m_length;
+    }
+  }
+
+  xassert(styledEnd == manualEnd);
+  if (styled != manual) {
+    xfailure("drawStyledString differs from drawing spans separately");
+  }
+}
+
+
+// Check that with 'padToNominalCell', opaque drawing covers every
+// cell completely, and matches erasing the cells and then drawing with
+// an unpadded font.
+static void testPaddedCells(BDFFont const &font)
+{
+  QtBDFFont::Options options;
+  options.padToNominalCell = true;
+  QtBDFFont padded(font, options);
+  QtBDFFont plain(font);
+
+  string text("a.b c,d -_");
+  QColor fg(Qt::black);
+  QColor bg(255,255,200);
+
+  for (int b=0; b < QtBDFFont::NUM_BACKENDS; b++) {
+    padded.setTransparent(false, (QtBDFFont::Backend)b);
+    padded.setFgColor(fg);
+    padded.setBgColor(bg);
+    plain.setTransparent(false);
+    plain.setFgColor(fg);
+    plain.setBgColor(bg);
+
+    QPoint pt(5, 20);
+    QRect cells(plain.getNominalCharCell(pt).topLeft(),
+                QSize(plain.getNominalCharOffset().x() * text.length(),
+                      plain.getNominalCharCell(pt).height()));
+
+    // Draw with the padded font, with no erase pass.
+    QImage withPadding(200, 40, QImage::Format_RGB32);
+    withPadding.fill(Qt::gray);
+    {
+      QPainter painter(&withPadding);
+      drawString(padded, painter, pt, text);
+    }
+
+    // Every pixel in the cells is fg or bg.
+    for (int y = cells.top(); y <= cells.bottom(); y++) {
+      for (int x = cells.left(); x <= cells.right(); x++) {
+        QRgb pixel = withPadding.pixel(x, y);
+        if (pixel != fg.rgb() && pixel != bg.rgb()) {
+          xfailure(stringb("padded cell pixel (" << x << "," << y <<
+                           ") not painted, backend " << b));
+        }
+      }
     }
+
+    // Same as the erase-then-draw approach.
+    QImage erased(withPadding.size(), QImage::Format_RGB32);
+    erased.fill(Qt::gray);
+    {
+      QPainter painter(&erased);
+      painter.fillRect(cells, bg);
+      drawString(plain, painter, pt, text);
+    }
+    if (erased != withPadding) {
+      xfailure(stringb("padded drawing differs from erase and draw, "
+                       "backend " << b));
+    }
+  }
+
+  cout << "padded cells cover the background\n";
+}
+
+
+// Check that culling against the clip in 'drawString' and
+// 'drawMultilineString' does not change what is drawn, and report how
+// long it takes to draw a small part of a long text.
+static void testClipCulling(QtBDFFont &qfont)
+{
+  stringBuilder sb;
+  for (int c=0; c < 5; c++) {
+    for (int i=32; i < 127; i++) {
+      sb << (char)i;
+    }
+  }
+  string longLine(sb);
+
+  // Lines separated by various terminators, including blank lines,
+  // which take no space.
+  string multi(stringb("first line\n\nsecond line\r\nthird\n\r\n\n"
+                       "fourth line is longer\n" << longLine <<
+                       "\nlast\n"));
+
+  QRect const clips[] = {
+    QRect(0, 0, 400, 300),
+    QRect(50, 10, 100, 30),
+    QRect(-20, -20, 60, 60),
+    QRect(380, 0, 20, 300),
+    QRect(200, 35, 3, 3),
+  };
+
+  bool origTransparent = qfont.getTransparent();
+  for (int t=0; t < 2; t++) {
+    qfont.setTransparent(t==0);
+
+    for (int c=0; c < TABLESIZE(clips); c++) {
+      // Culled drawing versus drawing everything.
+      QImage culled(400, 300, QImage::Format_RGB32);
+      culled.fill(QColor(128,128,128));
+      QImage unculled(culled);
+      {
+        QPainter painter(&culled);
+        painter.setClipRect(clips[c]);
+        drawString(qfont, painter, QPoint(-30, 20), longLine);
+        drawMultilineString(qfont, painter, QPoint(5, 40), multi);
+      }
+      {
+        QPainter painter(&unculled);
+        painter.setClipRect(clips[c]);
+        qfont.drawChars(painter, QPoint(-30, 20), longLine.c_str(),
+                        longLine.length());
+
+        // What 'drawMultilineString' did before culling.
+        QPoint upLeft(QPoint(5, 40) - qfont.getAllCharsBBox().topLeft());
+        StrtokParse tok(multi, "\r\n");
+        for (int i=0; i < tok.tokc(); i++) {
+          qfont.drawChars(painter, upLeft, tok[i], strlen(tok[i]));
+          upLeft.ry() += qfont.getAllCharsBBox().height();
+        }
+      }
+
+      if (culled != unculled) {
+        xfailure(stringb("culled drawing differs for clip " << c <<
+                         ", transparent=" << (t==0)));
+      }
+    }
+  }
+
+  // Devices whose size is not a bound on drawing.  A QPicture starts
+  // with an empty recorded extent, so culling against its size would
+  // drop everything.
+  {
+    QPicture picture;
+    {
+      QPainter painter(&picture);
+      drawString(qfont, painter, QPoint(5, 20), "recorded string");
+      drawMultilineString(qfont, painter, QPoint(5, 40), multi);
+    }
+
+    QImage replayed(400, 300, QImage::Format_RGB32);
+    replayed.fill(QColor(128,128,128));
+    QImage direct(replayed);
+    {
+      QPainter painter(&replayed);
+      painter.drawPicture(0, 0, picture);
+    }
+    {
+      QPainter painter(&direct);
+      drawString(qfont, painter, QPoint(5, 20), "recorded string");
+      drawMultilineString(qfont, painter, QPoint(5, 40), multi);
+    }
+    xassert(replayed == direct);
+  }
+
+  // A fractional translation must not cull a partly exposed glyph.
+  {
+    QImage culled(400, 300, QImage::Format_RGB32);
+    culled.fill(QColor(128,128,128));
+    QImage unculled(culled);
+    {
+      QPainter painter(&culled);
+      painter.translate(-0.5, 0.5);
+      drawString(qfont, painter, QPoint(-30, 20), longLine);
+    }
+    {
+      QPainter painter(&unculled);
+      painter.translate(-0.5, 0.5);
+      qfont.drawChars(painter, QPoint(-30, 20), longLine.c_str(),
+                      longLine.length());
+    }
+    xassert(culled == unculled);
+  }
+  qfont.setTransparent(origTransparent);
+
+  // Timing: a tall text of which only a few lines are exposed.
+  if (runTimings) {
+    stringBuilder big;
+    for (int i=0; i < 100000; i++) {
+      big << "log line " << i << ": something happened\n";
+    }
+    string bigText(big);
+
+    QPixmap pixmap(400, 300);
+    QPainter painter(&pixmap);
+    painter.setClipRect(QRect(0, 100, 400, 50));
+
+    long start = getMilliseconds();
+    drawMultilineString(qfont, painter, QPoint(0, 0), bigText);
+    long elapsed = getMilliseconds() - start;
+    cout << "drawMultilineString of 100000 lines with a small clip: "
+         << elapsed << " ms\n";
+  }
+}
+
+
+// Check the UTF-8 string functions against drawing the decoded code
+// points one at a time, and compare ASCII speed with 'drawString'.
+static void testUTF8Strings(QtBDFFont &qfont)
+{
+  BDFFont minihexFont;
+  parseBDFString(minihexFont, bdfFontData_minihex6);
+  QtBDFFont minihex(minihexFont);
+
+  // "cafe" with an accent, a snowman (missing from the font), and a
+  // malformed byte.
+  string text("caf\xC3\xA9 \xE2\x98\x83 \xFF!");
+  int const codePoints[] = {
+    'c', 'a', 'f', 0xE9, ' ', 0x2603, ' ', 0xFFFD, '!'
+  };
+
+  QImage utf8Image(300, 40, QImage::Format_RGB32);
+  utf8Image.fill(QColor(200,200,200));
+  QImage manualImage(utf8Image);
+
+  QPoint utf8End, manualEnd(5, 25);
+  {
+    QPainter painter(&utf8Image);
+    utf8End = drawUTF8String(qfont, painter, QPoint(5, 25), text, &minihex);
+  }
+  {
+    QPainter painter(&manualImage);
+    for (int i=0; i < TABLESIZE(codePoints); i++) {
+      manualEnd = drawCharOrHexQuad(qfont, minihex, painter, manualEnd,
+                                    codePoints[i]);
+    }
+  }
+  xassert(utf8End == manualEnd);
+  if (utf8Image != manualImage) {
+    xfailure("drawUTF8String differs from drawing code points");
+  }
+
+  // Pure ASCII is the same as 'drawString'.
+  string ascii("The quick brown fox jumps over the lazy dog.");
+  xassert(getUTF8StringBBox(qfont, ascii) == getStringBBox(qfont, ascii));
+  {
+    QImage a(utf8Image), b(utf8Image);
+    {
+      QPainter painter(&a);
+      drawString(qfont, painter, QPoint(5, 25), ascii);
+    }
+    {
+      QPainter painter(&b);
+      drawUTF8String(qfont, painter, QPoint(5, 25), ascii);
+    }
+    xassert(a == b);
+
+    if (runTimings) {
+      long start = getMilliseconds();
+      {
+        QPainter painter(&a);
+        for (int i=0; i < 10000; i++) {
+          drawString(qfont, painter, QPoint(5, 25), ascii);
+        }
+      }
+      long byteMS = getMilliseconds() - start;
+
+      start = getMilliseconds();
+      {
+        QPainter painter(&b);
+        for (int i=0; i < 10000; i++) {
+          drawUTF8String(qfont, painter, QPoint(5, 25), ascii);
+        }
+      }
+      long utf8MS = getMilliseconds() - start;
+
+      cout << "ASCII drawString: " << byteMS << " ms, drawUTF8String: "
+           << utf8MS << " ms\n";
+    }
+  }
+}
+
+
+// Check that cached hex quads match drawing them directly, for both
+// transparent and opaque minihex fonts in several colors.
+static void testHexQuadCache(QtBDFFont &qfont)
+{
+  BDFFont minihexFont;
+  parseBDFString(minihexFont, bdfFontData_minihex6);
+  QtBDFFont minihex(minihexFont);
+
+  int const codePoints[] = { 0x2603, 0x1F600, 0xE000, 0x2603 };
+  QColor const colors[] = { Qt::black, Qt::red, Qt::black };
+
+  CacheStats before = qfont.getHexQuadCacheStats();
+  for (int t=0; t < 2; t++) {
+    minihex.setTransparent(t==0);
+    for (int c=0; c < TABLESIZE(colors); c++) {
+      minihex.setFgColor(colors[c]);
+      minihex.setBgColor(QColor(255,255,192));
+
+      QImage direct(200, 30, QImage::Format_RGB32);
+      direct.fill(QColor(128,128,128));
+      QImage cached(direct);
+
+      QPoint pt(5, 20);
+      {
+        QPainter painter(&direct);
+        for (int i=0; i < TABLESIZE(codePoints); i++) {
+          drawHexQuad(minihex, painter, qfont.getNominalCharCell(pt),
+                      codePoints[i]);
+          pt += qfont.getNominalCharOffset();
+        }
+      }
+      pt = QPoint(5, 20);
+      {
+        QPainter painter(&cached);
+        for (int i=0; i < TABLESIZE(codePoints); i++) {
+          pt = drawCharOrHexQuad(qfont, minihex, painter, pt,
+                                 codePoints[i]);
+        }
+      }
+
+      if (direct != cached) {
+        xfailure(stringb("cached hex quad differs: transparent=" <<
+                         (t==0) << ", color " << c));
+      }
+    }
+  }
+
+  // Each attribute combination misses once per distinct code point.
+  // The third color repeats the first.
+  CacheStats stats = qfont.getHexQuadCacheStats();
+  xassert(stats.misses - before.misses == 2 * 2 * 3);
+  xassert(stats.hits - before.hits == 2 * (1 + 1 + 4));
+
+  // Time a screenful of missing glyphs, cached and not.
+  if (runTimings) {
+    QPixmap pixmap(800, 600);
+    QPainter painter(&pixmap);
+    long start = getMilliseconds();
+    for (int i=0; i < 5000; i++) {
+      drawHexQuad(minihex, painter,
+                  qfont.getNominalCharCell(QPoint(i%80 * 10, i/80 * 9)),
+                  0x4E00 + i%50);
+    }
+    long directMS = getMilliseconds() - start;
+
+    start = getMilliseconds();
+    for (int i=0; i < 5000; i++) {
+      drawCharOrHexQuad(qfont, minihex, painter,
+                        QPoint(i%80 * 10, i/80 * 9), 0x4E00 + i%50);
+    }
+    long cachedMS = getMilliseconds() - start;
+
+    cout << "5000 hex quads: direct " << directMS << " ms, cached "
+         << cachedMS << " ms\n";
+  }
+}
+
+
+// Check QtBDFFontChain resolution against searching the fonts, and
+// its batched drawing against drawing each code point individually.
+static void testFontChain(QtBDFFont &qfont)
+{
+  BDFFont lursFont;
+  parseBDFString(lursFont, bdfFontData_lurs12);
+  QtBDFFont lurs(lursFont);
+
+  BDFFont minihexFont;
+  parseBDFString(minihexFont, bdfFontData_minihex6);
+  QtBDFFont minihex(minihexFont);
+
+  QColor origFg = qfont.getFgColor();
+  QColor origBg = qfont.getBgColor();
+  bool origTransparent = qfont.getTransparent();
+
+  QtBDFFontChain chain;
+  chain.addFont(&qfont);
+  chain.addFont(&lurs);
+  chain.setMinihexFont(&minihex);
+  xassert(chain.numFonts() == 2);
+
+  // Resolution picks the first font with the glyph.
+  ArrayStack<int> codePoints;
+  for (int cp=0; cp < 0x3000; cp++) {
+    int expect = qfont.hasChar(cp)? 0 : lurs.hasChar(cp)? 1 : -1;
+    xassert(chain.fontIndexFor(cp) == expect);
+
+    // Build a test string with some of each.
+    if ((expect == 0 && cp >= 'a' && cp <= 'z') ||
+        (expect == 1 && codePoints.length() < 40) ||
+        (expect == -1 && cp % 397 == 0)) {
+      codePoints.push(cp);
+    }
+  }
+  xassert(chain.fontIndexFor(-5) == -1);
+  xassert(chain.fontFor('A') == &qfont);
+  xassert(chain.numSearches() == 0x3000);
+  cout << "font chain resolution uses "
+       << chain.resolutionMemoryUsage() << " bytes\n";
+
+  // Repeated lookups do not search again.
+  for (int cp=0; cp < 0x3000; cp++) {
+    chain.fontIndexFor(cp);
+  }
+  xassert(chain.numSearches() == 0x3000);
+
+  for (int t=0; t < 2; t++) {
+    chain.setTransparent(t==0);
+
+    QImage individual(800, 40, QImage::Format_RGB32);
+    individual.fill(QColor(128,128,128));
+    QImage batched(individual);
+
+    QPoint individualEnd(3, 25);
+    {
+      QPainter painter(&individual);
+      for (int i=0; i < codePoints.length(); i++) {
+        int cp = codePoints[i];
+        QtBDFFont *font = qfont.hasChar(cp)? &qfont :
+                          lurs.hasChar(cp)? &lurs : NULL;
+        if (font) {
+          font->drawChar(painter, individualEnd, cp);
+          individualEnd += font->getCharOffset(cp);
+        }
+        else {
+          individualEnd = drawCharOrHexQuad(qfont, minihex, painter,
+                                            individualEnd, cp);
+        }
+      }
+    }
+
+    QPoint batchedEnd;
+    {
+      QPainter painter(&batched);
+      batchedEnd = chain.drawCodePoints(painter, QPoint(3, 25),
+        &codePoints[0], codePoints.length());
+    }
+
+    xassert(individualEnd == batchedEnd);
+    if (individual != batched) {
+      xfailure(stringb("font chain drawing differs, transparent=" <<
+                       (t==0)));
+    }
+  }
+
+  qfont.setFgColor(origFg);
+  qfont.setBgColor(origBg);
+  qfont.setTransparent(origTransparent);
+}
+
+
+// Compute the bbox of 'str' one character at a time with QRect
+// operations, the way 'getStringBBox' originally did.
+static QRect referenceStringBBox(QtBDFFont &font, rostring str)
+{
+  int len = str.length();
+  for (int i=0; i < len; i++) {
+    int charIndex = (unsigned char)str[i];
+    if (font.hasChar(charIndex)) {
+      QRect ret(font.getCharBBox(charIndex));
+      QPoint cursor = font.getCharOffset(charIndex);
+      for (i++; i < len; i++) {
+        charIndex = (unsigned char)str[i];
+        ret |= font.getCharBBox(charIndex).translated(cursor);
+        cursor += font.getCharOffset(charIndex);
+      }
+      return ret;
+    }
+  }
+  return QRect(0,0,0,0);
+}
+
+
+// Check the table-driven string measurements against measuring each
+// character.
+static void testStringMeasurement(BDFFont const &bdfFont)
+{
+  QtBDFFont font(bdfFont);
+
+  if (font.isMonospace()) {
+    for (int i=0; i < 256; i++) {
+      if (font.hasChar(i)) {
+        xassert(font.getCharOffset(i) ==
+                QPoint(font.getMonospaceAdvance(), 0));
+      }
+    }
+  }
+
+  // Strings of pseudorandom bytes, some of which are missing from
+  // each font, plus some special cases.
+  ArrayStack<string> strs;
+  strs.push("");
+  strs.push(" ");
+  strs.push("   ");
+  strs.push(" x ");
+  strs.push("\x01\x02 ab");
+  strs.push("The quick brown fox jumps over the lazy dog.");
+  unsigned seed = 12345;
+  for (int n=0; n < 200; n++) {
+    stringBuilder sb;
+    int len = n % 37;
+    for (int i=0; i < len; i++) {
+      seed = seed * 1103515245 + 12345;
+      sb << (char)(1 + (seed >> 16) % 255);
+    }
+    strs.push(string(sb));
+  }
+
+  ArrayStack<int> advances;
+  for (int i=0; i < strs.length(); i++) {
+    advances.push(0);
+  }
+  int maxAdvance = measureStringAdvances(font, &strs[0], strs.length(),
+                                         &advances[0]);
+
+  int expectMax = 0;
+  for (int i=0; i < strs.length(); i++) {
+    string const &str = strs[i];
+
+    QPoint advance(0,0);
+    for (int k=0; k < (int)str.length(); k++) {
+      advance += font.getCharOffset((unsigned char)str[k]);
+    }
+    xassert(getStringAdvance(font, str) == advance);
+    xassert(advances[i] == advance.x());
+    expectMax = max(expectMax, advance.x());
+
+    QRect expect = referenceStringBBox(font, str);
+    QRect actual = getStringBBox(font, str);
+    if (expect != actual) {
+      xfailure(stringb("getStringBBox of string " << i << " is " <<
+                       toString(actual) << ", expected " <<
+                       toString(expect)));
+    }
+  }
+  xassert(maxAdvance == expectMax);
+
+  // Time measuring many cells, as column sizing does.
+  if (runTimings) {
+    long start = getMilliseconds();
+    int total = 0;
+    for (int iter=0; iter < 200; iter++) {
+      for (int i=0; i < strs.length(); i++) {
+        total += referenceStringBBox(font, strs[i]).width();
+      }
+    }
+    long referenceMS = getMilliseconds() - start;
+
+    start = getMilliseconds();
+    for (int iter=0; iter < 200; iter++) {
+      for (int i=0; i < strs.length(); i++) {
+        total -= getStringBBox(font, strs[i]).width();
+      }
+    }
+    long tableMS = getMilliseconds() - start;
+    xassert(total == 0);
+
+    cout << "measuring strings: per character " << referenceMS
+         << " ms, table " << tableMS << " ms, monospace="
+         << font.isMonospace() << "\n";
+  }
+}
+
+
+// Check 'hitTestString' and 'xForIndex' against walking the
+// characters with 'getCharOffset'.
+static void testHitTesting(BDFFont const &bdfFont)
+{
+  QtBDFFont font(bdfFont);
+
+  char const * const strs[] = {
+    "",
+    "x",
+    "hello, world",
+    "missing \x01\x02\x03 glyphs",
+    "iiiiWWWW  llll",
+  };
+
+  for (int s=0; s < TABLESIZE(strs); s++) {
+    string str(strs[s]);
+    int len = str.length();
+
+    // Expected boundary positions.
+    ArrayStack<int> xs;
+    int x = 0;
+    for (int i=0; i < len; i++) {
+      xs.push(x);
+      x += font.getCharOffset((unsigned char)str[i]).x();
+    }
+    xs.push(x);
+
+    for (int i=-2; i <= len+2; i++) {
+      xassert(xForIndex(font, str, i) == xs[max(0, min(i, len))]);
+    }
+
+    for (int px = -5; px <= x + 5; px++) {
+      // Nearest boundary, lower index on ties.
+      int expect = 0;
+      for (int i=1; i <= len; i++) {
+        if (abs(xs[i] - px) < abs(xs[expect] - px)) {
+          expect = i;
+        }
+      }
+
+      int actual = hitTestString(font, str, px);
+      if (actual != expect) {
+        xfailure(stringb("hitTestString(\"" << str << "\", " << px <<
+                         ") is " << actual << ", expected " << expect));
+      }
+    }
+  }
+
+  // Simulate dragging across a long line.
+  stringBuilder sb;
+  for (int i=0; i < 200; i++) {
+    sb << "word" << i << " ";
+  }
+  string longLine(sb);
+  int width = xForIndex(font, longLine, longLine.length());
+
+  CacheStats before = font.getHitTestCacheStats();
+  long start = getMilliseconds();
+  int sum = 0;
+  for (int iter=0; iter < 100; iter++) {
+    for (int px=0; px < width; px += 3) {
+      sum += hitTestString(font, longLine, px);
+    }
+  }
+  long elapsed = getMilliseconds() - start;
+  CacheStats after = font.getHitTestCacheStats();
+
+  // Only the first query had to compute the sums, if any.
+  xassert(after.misses == before.misses);
+  if (runTimings) {
+    cout << "hit testing " << (100 * (width/3)) << " points on a "
+         << longLine.length() << "-byte line: " << elapsed
+         << " ms (checksum " << sum << ")\n";
+  }
+}
+
+
+// Check that every line of 'layout' fits its width, except where a
+// single character does not, and that the lines put back together
+// give the paragraphs.
+static void checkWrappedLines(QtBDFFont &qfont, TextWrapLayout &layout)
+{
+  int line = 0;
+  for (int p=0; p < layout.numParagraphs(); p++) {
+    xassert(layout.paragraphFirstLine(p) == line);
+
+    QByteArray joined;
+    for (int i=0; i < layout.paragraphNumLines(p); i++, line++) {
+      int length;
+      int para;
+      char const *text = layout.lineText(line, length, &para);
+      xassert(para == p);
+      joined.append(text, length);
+
+      // Trailing spaces hang past the width.
+      int visible = length;
+      while (visible > 0 && text[visible-1] == ' ') {
+        visible--;
+      }
+      int width = qfont.getCharsAdvance(text, visible).x();
+      xassert(width <= layout.width() || visible == 1);
+    }
+    xassert(joined == layout.paragraphText(p));
+  }
+  xassert(layout.numLines() == line);
+}
+
+
+static void testTextWrapLayout(QtBDFFont &qfont)
+{
+  // Paragraphs of words of varying length, including one longer than
+  // the width.
+  stringBuilder sb;
+  unsigned seed = 99;
+  for (int p=0; p < 30; p++) {
+    int words = p % 7 * 5;
+    for (int w=0; w < words; w++) {
+      seed = seed * 1103515245 + 12345;
+      int len = 1 + (seed >> 16) % 9;
+      if (p == 3 && w == 2) {
+        len = 60;
+      }
+      for (int i=0; i < len; i++) {
+        sb << (char)('a' + (i + w) % 26);
+      }
+      sb << ((seed >> 20) % 5 == 0? "  " : " ");
+    }
+    sb << "\n";
+  }
+  string text(sb);
+
+  int charWidth = qfont.getCharOffset('m').x();
+  TextWrapLayout layout(qfont, 20 * charWidth);
+  layout.setText(text);
+  xassert(layout.numParagraphs() == 31);
+  checkWrappedLines(qfont, layout);
+
+  // An edit re-wraps only the edited paragraph.
+  long wraps = layout.numWraps();
+  layout.setParagraph(10, "a new paragraph that is long enough to wrap "
+                          "onto more than one line");
+  checkWrappedLines(qfont, layout);
+  xassert(layout.numWraps() == wraps + 1);
+
+  // The result is the same as laying out the edited text from scratch.
+  {
+    TextWrapLayout fresh(qfont, layout.width());
+    fresh.setText(text);
+    fresh.setParagraph(10, string(layout.paragraphText(10).constData()));
+    xassert(fresh.numLines() == layout.numLines());
+    for (int line=0; line < fresh.numLines(); line++) {
+      int len1, len2;
+      char const *t1 = fresh.lineText(line, len1);
+      char const *t2 = layout.lineText(line, len2);
+      xassert(len1 == len2 && memcmp(t1, t2, len1) == 0);
+    }
+  }
+
+  layout.insertParagraph(0, "inserted");
+  layout.removeParagraph(5);
+  checkWrappedLines(qfont, layout);
+
+  // Narrow and widen.
+  for (int w=1; w <= 40; w += 13) {
+    layout.setWidth(w * charWidth);
+    checkWrappedLines(qfont, layout);
+  }
+
+  // 'drawLines' draws the same as 'drawMultilineString' on the
+  // wrapped lines, given no empty lines.
+  {
+    layout.setText("The quick brown fox jumps over the lazy dog, "
+                   "again and again, until the line wraps several "
+                   "times.");
+    layout.setWidth(15 * charWidth);
+
+    stringBuilder wrapped;
+    for (int line=0; line < layout.numLines(); line++) {
+      int length;
+      char const *lineText = layout.lineText(line, length);
+      wrapped << string(lineText, length) << "\n";
+    }
+
+    QImage image1(300, 200, QImage::Format_RGB32);
+    image1.fill(QColor(255,255,255));
+    QImage image2(image1);
+    {
+      QPainter painter(&image1);
+      layout.drawLines(painter, QPoint(2, 2), 0, 100);
+    }
+    {
+      QPainter painter(&image2);
+      drawMultilineString(qfont, painter, QPoint(2, 2), string(wrapped));
+    }
+    xassert(image1 == image2);
+  }
+
+  // A large document: after a resize, drawing the top is immediate,
+  // and the rest can be wrapped in steps.
+  {
+    stringBuilder big;
+    for (int i=0; i < 20000; i++) {
+      big << "paragraph " << i << " has a handful of words in it, "
+          << "enough to wrap a few times at a modest width\n";
+    }
+    layout.setText(string(big));
+    layout.numLines();
+
+    long start = getMilliseconds();
+    layout.setWidth(30 * charWidth);
+    long wrapsBefore = layout.numWraps();
+    QPixmap pixmap(400, 600);
+    {
+      QPainter painter(&pixmap);
+      layout.drawLines(painter, QPoint(0,0), 0,
+                       600 / layout.lineHeight() + 1);
+    }
+    long drawMS = getMilliseconds() - start;
+    xassert(layout.numWraps() - wrapsBefore < 100);
+
+    start = getMilliseconds();
+    int steps = 1;
+    while (!layout.wrapMore(64 * 1024)) {
+      steps++;
+    }
+    long wrapMS = getMilliseconds() - start;
+
+    if (runTimings) {
+      cout << "wrap layout of " << layout.numParagraphs()
+           << " paragraphs: first screen " << drawMS << " ms, rest "
+           << wrapMS << " ms in " << steps << " steps, "
+           << layout.numLines() << " lines\n";
+    }
+  }
+}
+
+
+// Check 'elideString' and 'drawElidedString'.
+static void testElidedStrings(QtBDFFont &qfont)
+{
+  string str("/home/user/projects/smqtutil/test-qtbdffont.cc");
+  int total = getStringBBox(qfont, str).width();
+  int ellipsis = getStringBBox(qfont, "...").width();
+
+  Qt::TextElideMode const modes[] = {
+    Qt::ElideLeft, Qt::ElideRight, Qt::ElideMiddle, Qt::ElideNone
+  };
+
+  for (int m=0; m < TABLESIZE(modes); m++) {
+    for (int width = 0; width <= total + 10; width++) {
+      string elided = elideString(qfont, str, width, modes[m]);
+
+      if (width >= total || modes[m] == Qt::ElideNone) {
+        xassert(elided == str);
+        continue;
+      }
+
+      // The result is a prefix, an ellipsis, and a suffix.
+      int prefixLength, suffixStart;
+      xassert(qfont.getElideCut(str.c_str(), str.length(), width,
+                                modes[m], prefixLength, suffixStart));
+      xassert(prefixLength <= suffixStart);
+      xassert(elided == stringb(string(str.c_str(), prefixLength) <<
+                                "..." << (str.c_str() + suffixStart)));
+
+      if (width < ellipsis) {
+        xassert(elided == "...");
+        continue;
+      }
+
+      // The ink fits, since that is what 'drawAlignedString' aligns.
+      xassert(getStringBBox(qfont, elided).width() <= width);
+
+      // Keeping one more character would not fit.
+      if (modes[m] == Qt::ElideRight) {
+        string more = stringb(string(str.c_str(), prefixLength+1) <<
+                              "...");
+        xassert(getStringBBox(qfont, more).width() > width);
+      }
+      if (modes[m] == Qt::ElideLeft) {
+        string more = stringb("..." << (str.c_str() + suffixStart-1));
+        xassert(getStringBBox(qfont, more).width() > width);
+      }
+    }
+  }
+
+  // Drawing is aligned like 'drawAlignedString', and repeated draws
+  // reuse the cut.
+  QRect cell(10, 5, total / 2, 20);
+  QImage image1(300, 40, QImage::Format_RGB32);
+  image1.fill(QColor(255,255,255));
+  QImage image2(image1);
+
+  CacheStats before = qfont.getElideCacheStats();
+  {
+    QPainter painter(&image1);
+    for (int i=0; i < 10; i++) {
+      drawElidedString(qfont, painter, cell,
+                       Qt::AlignLeft | Qt::AlignVCenter, str,
+                       Qt::ElideMiddle);
+    }
+  }
+  CacheStats after = qfont.getElideCacheStats();
+  xassert(after.misses - before.misses == 1);
+  xassert(after.hits - before.hits == 9);
+
+  // The budget is adjustable; the default holds many cuts.
+  xassert(qfont.getElideCacheBudget() == 256 * 1024);
+  qfont.setElideCacheBudget(1024);
+  xassert(qfont.getElideCacheBudget() == 1024);
+  CacheStats shrunk = qfont.getElideCacheStats();
+  xassert(shrunk.cost <= 1024 || shrunk.entries == 1);
+
+  {
+    QPainter painter(&image2);
+    drawAlignedString(qfont, painter, cell,
+                      Qt::AlignLeft | Qt::AlignVCenter,
+                      elideString(qfont, str, cell.width(),
+                                  Qt::ElideMiddle));
+  }
+  xassert(image1 == image2);
+}
+
+
+// Check that 'actual' has the same metrics and glyph pixels as
+// 'expect'.  This changes the transparency of both.
+static void expectSameFont(QtBDFFont &expect, QtBDFFont &actual)
+{
+  xassert(actual.maxValidChar() == expect.maxValidChar());
+  xassert(actual.getAllCharsBBox() == expect.getAllCharsBBox());
+  xassert(actual.getNominalCharCell(QPoint(0,0)) ==
+          expect.getNominalCharCell(QPoint(0,0)));
+  xassert(actual.numAtlasPages() == expect.numAtlasPages());
+  for (int i=0; i <= expect.maxValidChar(); i++) {
+    xassert(actual.hasChar(i) == expect.hasChar(i));
+    xassert(actual.getCharBBox(i) == expect.getCharBBox(i));
+    xassert(actual.getCharOffset(i) == expect.getCharOffset(i));
+  }
+
+  // Same pixels for every glyph.
+  for (int t=0; t < 2; t++) {
+    expect.setTransparent(t==0);
+    actual.setTransparent(t==0);
+
+    QImage image1(600, 200, QImage::Format_RGB32);
+    image1.fill(QColor(128,128,128));
+    QImage image2(image1);
+    {
+      QPainter painter1(&image1);
+      QPainter painter2(&image2);
+      for (int i=0; i <= expect.maxValidChar(); i++) {
+        QPoint pt(5 + (i % 32) * 18, 20 + (i / 32) * 20);
+        expect.drawChar(painter1, pt, i);
+        actual.drawChar(painter2, pt, i);
+      }
+    }
+    xassert(image1 == image2);
+  }
+}
+
+
+// Check that a font made from build-time compiled data is the same as
+// one made from the BDF source, and compare construction times.
+static void testCompiledFont(BDFFont const &font)
+{
+  QtBDFFont parsed(font);
+  QtBDFFont compiled(qtbdfFontData_editor14r);
+
+  expectSameFont(parsed, compiled);
+
+  // Generated sources refuse to compile against a changed data layout.
+  {
+    std::ostringstream os;
+    QtBDFFont::writeCompiledFont(font, QtBDFFont::Options(), "f", os);
+    string expect(stringb("static_assert(QTBDFFONT_DATA_VERSION == " <<
+                          (int)QTBDFFONT_DATA_VERSION << ","));
+    xassert(strstr(os.str().c_str(), expect.c_str()) != NULL);
+  }
+
+  if (runTimings) {
+    // Parsing the BDF text is part of the cost being avoided.
+    long start = getMilliseconds();
+    for (int i=0; i < 20; i++) {
+      BDFFont bdf;
+      parseBDFString(bdf, bdfFontData_editor14r);
+      QtBDFFont q(bdf);
+    }
+    long parsedMS = getMilliseconds() - start;
+
+    start = getMilliseconds();
+    for (int i=0; i < 20; i++) {
+      QtBDFFont q(qtbdfFontData_editor14r);
+    }
+    long compiledMS = getMilliseconds() - start;
+
+    cout << "20 constructions of editor14r: from BDF " << parsedMS
+         << " ms, from compiled data " << compiledMS << " ms\n";
+  }
+}
+
+
+// Invert 'len' bytes at 'offset' in 'fname', or truncate the file to
+// 'offset' if 'len' is 0.
+static void damageFile(QString const &fname, qint64 offset, int len)
+{
+  QFile file(fname);
+  bool ok = file.open(QIODevice::ReadWrite);
+  xassert(ok);
+  if (len > 0) {
+    file.seek(offset);
+    QByteArray bytes = file.read(len);
+    for (int i=0; i < bytes.size(); i++) {
+      bytes[i] = ~bytes[i];
+    }
+    file.seek(offset);
+    file.write(bytes);
+  }
+  else {
+    file.resize(offset);
+  }
+}
+
+
+// Check 'loadBDFFontCached', including recovery from bad cache files.
+static void testAtlasCache(BDFFont const &font)
+{
+  QString qCacheDir = QDir::tempPath() + "/test-qtbdffont-atlas-cache";
+  QDir(qCacheDir).removeRecursively();
+  string cacheDir = toString(qCacheDir);
+
+  char const *bdfFname = "fonts/editor14r.bdf";
+  QFile bdfFile(bdfFname);
+  bool opened = bdfFile.open(QIODevice::ReadOnly);
+  xassert(opened);
+  QString cacheFname =
+    toQString(atlasCacheFileName(bdfFile.readAll(), cacheDir));
+
+  QtBDFFont parsed(font);
+  AtlasCacheResult result;
+
+  // The first load builds the cache file.
+  long start = getMilliseconds();
+  std::unique_ptr<QtBDFFont> loaded =
+    loadBDFFontCached(bdfFname, cacheDir, QtBDFFont::Options(), &result);
+  long missMS = getMilliseconds() - start;
+  xassert(result == ACR_MISS);
+  xassert(QFile::exists(cacheFname));
+  expectSameFont(parsed, *loaded);
+
+  // The second uses it.
+  start = getMilliseconds();
+  loaded = loadBDFFontCached(bdfFname, cacheDir, QtBDFFont::Options(),
+                             &result);
+  long hitMS = getMilliseconds() - start;
+  xassert(result == ACR_HIT);
+  expectSameFont(parsed, *loaded);
+
+  if (runTimings) {
+    cout << "loading editor14r: without cache " << missMS
+         << " ms, with cache " << hitMS << " ms\n";
+  }
+
+  // Each kind of damage is detected, and the file is rebuilt.
+  static struct Damage {
+    char const *description;
+    qint64 offset;                     // negative: from the end
+    int len;                           // 0: truncate
+  } const damages[] = {
+    { "magic", 0, 1 },
+    { "format version", 12, 1 },
+    { "key", 16, 2 },
+    { "page bits", -1, 1 },
+    { "truncated", -10, 0 },
+    { "empty", 0, 0 },
+  };
+  for (Damage const &d : damages) {
+    qint64 size = QFileInfo(cacheFname).size();
+    qint64 offset = (d.offset < 0)? size + d.offset : d.offset;
+    damageFile(cacheFname, offset, d.len);
+
+    loaded = loadBDFFontCached(bdfFname, cacheDir, QtBDFFont::Options(),
+                               &result);
+    if (result != ACR_REBUILT) {
+      cout << "damage not detected: " << d.description << "\n";
+      xfailure("bad cache file was used");
+    }
+    expectSameFont(parsed, *loaded);
+
+    loaded = loadBDFFontCached(bdfFname, cacheDir, QtBDFFont::Options(),
+                               &result);
+    xassert(result == ACR_HIT);
+  }
+
+  // Different options use a different file.
+  QtBDFFont::Options padded;
+  padded.padToNominalCell = true;
+  xassert(atlasCacheFileName(QByteArray("x"), cacheDir) !=
+          atlasCacheFileName(QByteArray("x"), cacheDir, padded));
+  loaded = loadBDFFontCached(bdfFname, cacheDir, padded, &result);
+  xassert(result == ACR_MISS);
+  {
+    QtBDFFont paddedParsed(font, padded);
+    expectSameFont(paddedParsed, *loaded);
+  }
+  loaded = loadBDFFontCached(bdfFname, cacheDir, padded, &result);
+  xassert(result == ACR_HIT);
+
+  QDir(qCacheDir).removeRecursively();
+}
+
+
+// Return the text of a BDF font with 'numGlyphs' glyphs of assorted
+// sizes and pseudo-random pixels, as a stand-in for a large Unicode
+// font.  Widths up to 26 give rows of up to 4 bytes, placed at every
+// bit alignment in the atlas.
+static string syntheticBDF(int numGlyphs)
+{
+  stringBuilder sb;
+  sb << "STARTFONT 2.1\n"
+     << "FONT -Test-Synthetic-Medium-R-Normal--16-160-75-75-C-160-ISO10646-1\n"
+     << "SIZE 16 75 75\n"
+     << "FONTBOUNDINGBOX 26 20 0 -4\n"
+     << "STARTPROPERTIES 2\n"
+     << "FONT_ASCENT 16\n"
+     << "FONT_DESCENT 4\n"
+     << "ENDPROPERTIES\n"
+     << "CHARS " << numGlyphs << "\n";
+
+  unsigned seed = 12345;
+  for (int i=0; i < numGlyphs; i++) {
+    int w = 1 + i % 26;
+    int h = 4 + (i * 7) % 17;
+    int codePoint = 0x4E00 + i;
+    sb << "STARTCHAR u" << codePoint << "\n"
+       << "ENCODING " << codePoint << "\n"
+       << "SWIDTH 1000 0\n"
+       << "DWIDTH " << w << " 0\n"
+       << "BBX " << w << " " << h << " 0 -4\n"
+       << "BITMAP\n";
+    for (int y=0; y < h; y++) {
+      // BDF rows are hex, leftmost pixel in the high bit, padded to
+      // whole bytes with zeroes.
+      int numBytes = (w + 7) / 8;
+      for (int b=0; b < numBytes; b++) {
+        seed = seed * 1103515245 + 12345;
+        int byte = (seed >> 16) & 0xFF;
+        int valid = min(8, w - b*8);
+        byte &= (0xFF << (8 - valid)) & 0xFF;
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02X", byte);
+        sb << hex;
+      }
+      sb << "\n";
+    }
+    sb << "ENDCHAR\n";
+  }
+
+  sb << "ENDFONT\n";
+  return string(sb);
+}
+
+
+// Check the atlas copy in the constructor on glyphs of many widths,
+// whose rows land at every bit alignment.
+static void testAtlasCopy()
+{
+  BDFFont font;
+  parseBDFString(font, syntheticBDF(600).c_str());
+
+  QtBDFFont qfont(font);
+  compare(font, qfont);
+
+  // Small pages put glyphs at other offsets.
+  QtBDFFont::Options options;
+  options.maxPageDimension = 61;
+  QtBDFFont pagedQFont(font, options);
+  compare(font, pagedQFont);
+}
+
+
+// Copy the glyphs of 'font' into new page images at the places given
+// by 'glyphs' and 'pageData', one pixel at a time with 'Bit2d::get'
+// and 'QImage::setPixel', the way the constructor did before it copied
+// whole rows.  This is the baseline for 'timeConstruction'.  Check
+// that the result matches the pages in 'pageData'.
+static void perPixelAtlasCopy(BDFFont const &font,
+                              ArrayStack<QtBDFFontGlyphData> const &glyphs,
+                              ArrayStack<QtBDFFontPageData> const &pageData)
+{
+  ArrayStack<QImage> pages;
+  for (int p=0; p < pageData.length(); p++) {
+    QImage image(pageData[p].width, pageData[p].height,
+                 QImage::Format_MonoLSB);
+    image.setColor(0, QColor(Qt::color0).rgb());
+    image.setColor(1, QColor(Qt::color1).rgb());
+    image.fill(0);
+    pages.push(image);
+  }
+
+  for (int g=0; g < glyphs.length(); g++) {
+    QtBDFFontGlyphData const &gd = glyphs[g];
+    BDFFont::Glyph const *glyph = font.getGlyph(gd.index);
+    if (!glyph->bitmap) {
+      continue;
+    }
+
+    QImage &page = pages[gd.page];
+    for (int y=0; y < glyph->metrics.bbSize.y; y++) {
+      for (int x=0; x < glyph->metrics.bbSize.x; x++) {
+        if (glyph->bitmap->get(point(x,y))) {
+          page.setPixel(gd.bboxX + x, gd.bboxY + y, 1);
+        }
+      }
+    }
+  }
+
+  for (int p=0; p < pages.length(); p++) {
+    QtBDFFontPageData const &pd = pageData[p];
+    int rowBytes = (pd.width + 7) / 8;
+    for (int y=0; y < pd.height; y++) {
+      xassert(0==memcmp(pages[p].constScanLine(y),
+                        pd.bits + y * pd.bytesPerLine, rowBytes));
+    }
+  }
+}
+
+
+// Time construction, with and without 'Options::lazyAtlas', not
+// counting BDF parsing, against the old per-pixel glyph copy alone.
+// The synthetic font makes this slow, so it runs with the GUI
+// performance tests.
+static void timeConstruction()
+{
+  struct Case {
+    char const *name;
+    BDFFont font;
+    int iters;
+  } cases[2];
+  cases[0].name = "courR24_ISO8859_1";
+  parseBDFString(cases[0].font, bdfFontData_courR24_ISO8859_1);
+  cases[0].iters = 50;
+  cases[1].name = "synthetic 20000-glyph font";
+  parseBDFString(cases[1].font, syntheticBDF(20000).c_str());
+  cases[1].iters = 3;
+
+  QtBDFFont::Options lazyOptions;
+  lazyOptions.lazyAtlas = true;
+
+  for (Case const &c : cases) {
+    long start = getMilliseconds();
+    for (int i=0; i < c.iters; i++) {
+      QtBDFFont qfont(c.font);
+    }
+    long eagerMS = getMilliseconds() - start;
+
+    start = getMilliseconds();
+    for (int i=0; i < c.iters; i++) {
+      QtBDFFont qfont(c.font, lazyOptions);
+    }
+    long lazyMS = getMilliseconds() - start;
+
+    // The old copy, into the same places.  Construction includes
+    // packing and everything else besides the copy, so it beating this
+    // shows the row copy's gain with room to spare.
+    QtBDFFont qfont(c.font);
+    QtBDFFontData data;
+    ArrayStack<QtBDFFontGlyphData> glyphs;
+    ArrayStack<QtBDFFontPageData> pageData;
+    qfont.getData(data, glyphs, pageData);
+
+    start = getMilliseconds();
+    for (int i=0; i < c.iters; i++) {
+      perPixelAtlasCopy(c.font, glyphs, pageData);
+    }
+    long perPixelMS = getMilliseconds() - start;
+
+    cout << "constructing " << c.name << ": eager "
+         << (double)eagerMS / c.iters << " ms, lazy atlas "
+         << (double)lazyMS / c.iters << " ms; per-pixel glyph copy "
+         << "alone " << (double)perPixelMS / c.iters << " ms\n";
+  }
+}
+
+
+// Check that glyphs bigger than 'maxPageDimension' get pages of their
+// own, exactly their size, and leave the other pages within the limit.
+static void testOversizedGlyphs()
+{
+  // The synthetic glyphs are up to 26 wide and 20 tall, so with this
+  // limit, the widest ones are too wide for a page.
+  int const limit = 20;
+
+  BDFFont font;
+  parseBDFString(font, syntheticBDF(600).c_str());
+
+  for (int lazy=0; lazy < 2; lazy++) {
+    QtBDFFont::Options options;
+    options.maxPageDimension = limit;
+    options.lazyAtlas = lazy;
+    QtBDFFont qfont(font, options);
+    compare(font, qfont);
+
+    QtBDFFontData data;
+    ArrayStack<QtBDFFontGlyphData> glyphs;
+    ArrayStack<QtBDFFontPageData> pageData;
+    qfont.getData(data, glyphs, pageData);
+
+    ArrayStack<int> glyphsOnPage;
+    for (int p=0; p < pageData.length(); p++) {
+      glyphsOnPage.push(0);
+    }
+    for (int g=0; g < glyphs.length(); g++) {
+      glyphsOnPage[glyphs[g].page]++;
+    }
+
+    int numOversized = 0;
+    for (int g=0; g < glyphs.length(); g++) {
+      QtBDFFontGlyphData const &glyph = glyphs[g];
+      QtBDFFontPageData const &page = pageData[glyph.page];
+      if (glyph.bboxWidth > limit || glyph.bboxHeight > limit) {
+        numOversized++;
+        xassert(glyphsOnPage[glyph.page] == 1);
+        xassert(page.width == glyph.bboxWidth &&
+                page.height == glyph.bboxHeight);
+      }
+      else {
+        xassert(page.width <= limit && page.height <= limit);
+      }
+    }
+    xassert(numOversized > 0);
+  }
+}
+
+
+// Check 'Options::lazyAtlas'.
+static void testLazyAtlas(BDFFont const &font)
+{
+  QtBDFFont::Options lazyOptions;
+  lazyOptions.lazyAtlas = true;
+
+  QtBDFFont eager(font);
+  QtBDFFont lazy(font, lazyOptions);
+  int initialUnplaced = lazy.numUnplacedGlyphs();
+  xassert(initialUnplaced > 0);
+  xassert(eager.numUnplacedGlyphs() == 0);
+
+  // Metrics work before anything is drawn, and do not place glyphs.
+  xassert(lazy.maxValidChar() == eager.maxValidChar());
+  xassert(lazy.getAllCharsBBox() == eager.getAllCharsBBox());
+  for (int i=0; i <= eager.maxValidChar(); i++) {
+    xassert(lazy.hasChar(i) == eager.hasChar(i));
+    xassert(lazy.getCharBBox(i) == eager.getCharBBox(i));
+    xassert(lazy.getCharOffset(i) == eager.getCharOffset(i));
+  }
+  xassert(getStringBBox(lazy, "Hello") == getStringBBox(eager, "Hello"));
+  xassert(lazy.numUnplacedGlyphs() == initialUnplaced);
+
+  // Drawing a string places just its glyphs.
+  for (int t=0; t < 2; t++) {
+    lazy.setTransparent(t==0);
+    eager.setTransparent(t==0);
+
+    QImage image1(200, 40, QImage::Format_RGB32);
+    image1.fill(QColor(128,128,128));
+    QImage image2(image1);
+    {
+      QPainter painter1(&image1);
+      QPainter painter2(&image2);
+      drawString(eager, painter1, QPoint(5, 20), "Hello");
+      drawString(lazy, painter2, QPoint(5, 20), "Hello");
+    }
+    xassert(image1 == image2);
+  }
+  xassert(lazy.numUnplacedGlyphs() == initialUnplaced - 4);
+
+  // Direct drawing places glyphs too.
+  {
+    QImage image1(200, 40, QImage::Format_RGB32);
+    image1.fill(QColor(128,128,128));
+    QImage image2(image1);
+    drawString(eager, image1, QPoint(5, 20), "World");
+    drawString(lazy, image2, QPoint(5, 20), "World");
+    xassert(image1 == image2);
+  }
+  xassert(lazy.numUnplacedGlyphs() == initialUnplaced - 7);
+
+  // Placing the rest, one at a time.
+  lazy.setTransparent(true);
+  compare(font, lazy);
+  xassert(lazy.numUnplacedGlyphs() == 0);
+
+  // Small pages make the atlas grow and spill onto more pages.
+  {
+    BDFFont synth;
+    parseBDFString(synth, syntheticBDF(600).c_str());
+
+    QtBDFFont::Options options(lazyOptions);
+    options.maxPageDimension = 61;
+    QtBDFFont lazySynth(synth, options);
+    xassert(lazySynth.numAtlasPages() == 1);
+    compare(synth, lazySynth);
+    xassert(lazySynth.numUnplacedGlyphs() == 0);
+    xassert(lazySynth.numAtlasPages() > 1);
+    cout << "lazy atlas of 600 glyphs used "
+         << lazySynth.numAtlasPages() << " pages\n";
+  }
+
+  // Placing glyphs keeps the color pixmaps of other colors, and those
+  // of the updated pages are remade.
+  {
+    QtBDFFont lazy3(font, lazyOptions);
+    lazy3.setTransparent(false);
+    eager.setTransparent(false);
+    QImage image1(200, 40, QImage::Format_RGB32);
+    image1.fill(QColor(128,128,128));
+    QImage image2(image1);
+    {
+      QPainter painter1(&image1);
+      QPainter painter2(&image2);
+      QColor const colors[] = { Qt::red, Qt::blue, Qt::red };
+      char const * const strs[] = { "abc", "abc", "xyz" };
+      for (int i=0; i < TABLESIZE(strs); i++) {
+        lazy3.setFgColor(colors[i]);
+        eager.setFgColor(colors[i]);
+        drawString(eager, painter1, QPoint(5, 10 + i*10), strs[i]);
+        drawString(lazy3, painter2, QPoint(5, 10 + i*10), strs[i]);
+      }
+    }
+    xassert(image1 == image2);
+    xassert(lazy3.getColorPixmapCacheStats().entries == 2);
+  }
+
+  // Batched drawing, after part of the atlas is already in use.
+  {
+    QtBDFFont lazy2(font, lazyOptions);
+    QImage scratch(50, 50, QImage::Format_RGB32);
+    {
+      QPainter painter(&scratch);
+      drawString(lazy2, painter, QPoint(5, 20), "abc");
+    }
+    expectSameFont(eager, lazy2);
+  }
+}
+
+
+// Check that scrolling a pixmap of multiline text with
+// 'scrollTextLines' and redrawing the exposed part gives the same
+// pixels as drawing the scrolled text from scratch.
+static void testScrollTextLines(QtBDFFont &qfont)
+{
+  stringBuilder sb;
+  for (int i=0; i < 30; i++) {
+    sb << "line " << i << " of the scrolling test\n";
+  }
+  string text(sb);
+
+  int lineHeight = qfont.getAllCharsBBox().height();
+  QRect area(10, 10, 300, 10 * lineHeight);
+  bool origTransparent = qfont.getTransparent();
+  qfont.setTransparent(true);
+
+  for (int lines = -4; lines <= 4; lines++) {
+    // Pretend the view starts at line 10.
+    QPoint upLeft(area.topLeft() - QPoint(0, 10 * lineHeight));
+
+    QPixmap scrolled(area.width() + 20, area.height() + 20);
+    scrolled.fill(Qt::white);
+    {
+      QPainter painter(&scrolled);
+      painter.setClipRect(area);
+      drawMultilineString(qfont, painter, upLeft, text);
+    }
+
+    // Scroll, then redraw only what was exposed.
+    upLeft.ry() -= lines * lineHeight;
+    QRect exposed = scrollTextLines(qfont, scrolled, area, lines);
+    xassert(exposed.height() == (lines<0? -lines : lines) * lineHeight);
+    {
+      QPainter painter(&scrolled);
+      painter.fillRect(exposed, Qt::white);
+      painter.setClipRect(exposed);
+      drawMultilineString(qfont, painter, upLeft, text);
+    }
+
+    QPixmap fresh(scrolled.size());
+    fresh.fill(Qt::white);
+    {
+      QPainter painter(&fresh);
+      painter.setClipRect(area);
+      drawMultilineString(qfont, painter, upLeft, text);
+    }
+
+    if (fresh.toImage() != scrolled.toImage()) {
+      xfailure(stringb("scrollTextLines by " << lines <<
+                       " differs from redrawing"));
+    }
+  }
+
+  qfont.setTransparent(origTransparent);
+}
+
+
+// Exercise CodePointTable, which does not need a display.
+static void testCodePointTable()
+{
+  CodePointTable<int> table(0x110000);
+  xassert(table.numAllocatedPages() == 0);
+
+  // Unwritten and out-of-range entries read as zero.
+  xassert(table[0] == 0);
+  xassert(table[0x10FFFF] == 0);
+  xassert(table[-1] == 0);
+  xassert(table[0x110000] == 0);
+
+  table.getForWrite(0x1F600) = 7;
+  table.getForWrite(0x1F601) = 8;
+  table.getForWrite('A') = 9;
+  xassert(table.numAllocatedPages() == 2);
+  xassert(table[0x1F600] == 7);
+  xassert(table[0x1F601] == 8);
+  xassert(table[0x1F602] == 0);
+  xassert(table['A'] == 9);
+  xassert(table.hasPageFor(0x1F6FF));
+  xassert(!table.hasPageFor(0x1F700));
+
+  cout << "CodePointTable uses " << table.memoryUsage() << " bytes\n";
+}
+
+
+void entry(int argc, char **argv)
+{
+  // Arguments may be given in any order.
+  bool runGui = false;
+  for (int i=1; i < argc; i++) {
+    if (0==strcmp(argv[i], "timing")) {
+      runTimings = true;
+    }
+    else if (0==strcmp(argv[i], "gui")) {
+      runGui = true;
+    }
+  }
+
+  testCodePointTable();
+
+  BDFFont font;
+  parseBDFString(font, bdfFontData_editor14r);
+
+  // This is a really ugly way to detect a dependence on X11, and is
+  // wrong on Mac OS/X.  But I sunk at least half an hour trying to
+  // figure out the proper placement for Q_WS_X11 in Qt5 and could not!
+  if (!SMFileUtil().windowsPathSemantics() &&
+      !getenv("DISPLAY")) {
+    cout << "Running on non-Windows platform, DISPLAY not set.\n";
+    cout << "Set DISPLAY in order to run the rest of this test.\n";
+    return;
+  }
+
+  QApplication app(argc, argv);
+
+  // first compare with transparent drawing
+  QtBDFFont qfont(font);
+  compare(font, qfont);
+
+  // then with opaque drawing
+  qfont.setTransparent(false);
+  compare(font, qfont);
+
+  // Test another cycle of switching modes.
+  qfont.setTransparent(true);
+  compare(font, qfont);
+  qfont.setTransparent(false);
+  compare(font, qfont);
+
+  // Use tiny atlas pages to force the glyphs to spill across several.
+  {
+    QtBDFFont::Options options;
+    options.maxPageDimension = 64;
+    QtBDFFont pagedQFont(font, options);
+    cout << "paged font uses " << pagedQFont.numAtlasPages()
+         << " atlas pages\n";
+    xassert(pagedQFont.numAtlasPages() > 1);
+    compare(font, pagedQFont);
+    pagedQFont.setTransparent(false);
+    compare(font, pagedQFont);
+    testBatchedDrawing(pagedQFont);
+  }
+
+  // Check every backend, including the handling of color changes.
+  for (int b=0; b < QtBDFFont::NUM_BACKENDS; b++) {
+    QtBDFFont backendQFont(font);
+    backendQFont.setBackend((QtBDFFont::Backend)b);
+    compare(font, backendQFont);
+    backendQFont.setTransparent(false);
+    compare(font, backendQFont);
+    testColorChanges(font, backendQFont);
+  }
+
+  testDirectImageDrawing(qfont);
+  testBatchedDrawing(qfont);
+  testLineCache(qfont);
+  testTextDisplayList(qfont);
+  testStyledString();
+  testPaddedCells(font);
+  testClipCulling(qfont);
+  testUTF8Strings(qfont);
+  testScrollTextLines(qfont);
+  testHexQuadCache(qfont);
+  testFontChain(qfont);
+  testTextWrapLayout(qfont);
+  testElidedStrings(qfont);
+  {
+    // Italic glyphs overhang their advances.
+    BDFFont italicFont;
+    parseBDFString(italicFont, bdfFontData_editor14i);
+    QtBDFFont italic(italicFont);
+    testElidedStrings(italic);
+  }
+  testCompiledFont(font);
+  testAtlasCache(font);
+  testAtlasCopy();
+  testLazyAtlas(font);
+  testOversizedGlyphs();
+
+  {
+    testStringMeasurement(font);
+
+    BDFFont lursFont;
+    parseBDFString(lursFont, bdfFontData_lurs12);
+    testStringMeasurement(lursFont);
+
+    BDFFont minihexFont;
+    parseBDFString(minihexFont, bdfFontData_minihex6);
+    testStringMeasurement(minihexFont);
+
+    testHitTesting(font);
+    testHitTesting(lursFont);
+    testHitTesting(minihexFont);
+  }
+  testTextGridWidget();
+
+  // Alternating between two color pairs should hit the color pixmap
+  // cache after the first use of each.
+  {
+    QtBDFFont cacheQFont(font);
+    cacheQFont.setTransparent(false);
+
+    QPixmap pixmap(20, 20);
+    QPainter painter(&pixmap);
+    for (int i=0; i < 10; i++) {
+      cacheQFont.setFgColor(i%2? Qt::red : Qt::blue);
+      cacheQFont.drawChar(painter, QPoint(5,15), 'A');
+    }
+    painter.end();
+
+    CacheStats stats = cacheQFont.getColorPixmapCacheStats();
+    cout << "color pixmap cache: hits=" << stats.hits
+         << " misses=" << stats.misses
+         << " bytes=" << stats.cost << "\n";
+    xassert(stats.misses == 2);
+    xassert(stats.hits == 8);
+    xassert(stats.entries == 2);
+
+    // With no budget, only the current combination is retained.
+    cacheQFont.setColorPixmapCacheBudget(0);
+    xassert(cacheQFont.getColorPixmapCacheStats().entries == 1);
+    testColorChanges(font, cacheQFont);
+  }
+
+  cout << "test-qtbdffont console tests passed\n";
+  if (!runTimings) {
+    cout << "Run with \"timing\" argument to print timing comparisons.\n";
+  }
+  if (runGui) {
+    cout << "Running gui tests..." << endl;
+  }
+  else {
+    cout << "Run with \"gui\" argument to test rendering to a window.\n";
+    return;
+  }
+
+  // use different colors for onscreen drawing
+  QColor fg = Qt::black;
+  QColor bg(224, 224, 224);
+  qfont.setFgColor(fg);
+  qfont.setBgColor(bg);
+
+  int const windowWidth = 600;
+  int const windowHeight = 600;
+
+  QLabel widget(NULL /*parent*/);
+  widget.resize(windowWidth, windowHeight);
+
+  QPixmap pixmap(windowWidth, windowHeight);
+  pixmap.fill(bg);
+
+  QPainter painter(&pixmap);
+  painter.setPen(fg);
+  painter.drawText(50,20, "QPainter::drawText");
+
+  drawString(qfont, painter, QPoint(50,50),
+             "drawString(QtBDFFont &)");
+
+  qfont.setTransparent(true);
+  drawString(qfont, painter, QPoint(50, 70),
+             "setTransparent(true)");
+
+  qfont.setTransparent(false);
+  drawString(qfont, painter, QPoint(50, 90),
+             "setTransparent(false)");
+
+  // test rendering performance
+  if (1) {
+    // first transparent, then opaque, then transparent with alpha
+    static char const * const modeNames[] = {
+      "transparent: ",
+      "opaque: ",
+      "transparent alpha: ",
+    };
+    for (int drawMode=0; drawMode < 3; drawMode++) {
+      qfont.setTransparent(drawMode!=1,
+        drawMode==2? QtBDFFont::B_ALPHA_PIXMAP :
+                     QtBDFFont::B_MASKED_PIXMAP);
+
+      long start = getMilliseconds();
+      int iters = 10000;
+      for (int i=0; i < iters; i++) {
+        drawString(qfont, painter, QPoint(50,50),
+                   "drawString(QtBDFFont &)");
+      }
+      long elapsed = getMilliseconds() - start;
+
+      cout << modeNames[drawMode]
+           << iters << " iters in " << elapsed << " ms" << endl;
+    }
+    qfont.setBackend(QtBDFFont::B_MASKED_PIXMAP);
+
+    timeConstruction();
   }
 
   // Box with a sample of the 'lurs12' font.
@@ -0,0 +1,379 @@
+// text-display-list.cc
+// code for text-display-list.h; tests are in test-qtbdffont.cc
+
+#include "text-display-list.h"         // this module
+
+// this directory
+#include "qtbdffont.h"                 // QtBDFFont
+
+// Qt
+#include <QPainter>
+
+// libc++
+#include <algorithm>                   // std::sort
+#include <map>                         // std::map
+#include <vector>                      // std::vector
+
+
+// ------------------- TextDisplayList::State --------------------
+TextDisplayList::State::State()
+  : font(nullptr),
+    fg(0),
+    bg(0),
+    transparent(true)
+{}
+
+
+TextDisplayList::State::State(QtBDFFont *f)
+  : font(f),
+    fg(f->getFgColor().rgba()),
+    bg(f->getTransparent()? 0 : f->getBgColor().rgba()),
+    transparent(f->getTransparent())
+{}
+
+
+bool TextDisplayList::State::operator== (State const &obj) const
+{
+  return font == obj.font &&
+         fg == obj.fg &&
+         bg == obj.bg &&
+         transparent == obj.transparent;
+}
+
+
+// --------------------- TextDisplayList::Op ---------------------
+TextDisplayList::Op::Op()
+  : kind(OK_STRING),
+    stateIndex(0),
+    pt(0,0),
+    hexBounds(),
+    hexMainFont(nullptr),
+    codePoint(0),
+    textStart(0),
+    textLength(0),
+    endPt(0,0),
+    bbox()
+{}
+
+
+// ----------------------- TextDisplayList -----------------------
+TextDisplayList::TextDisplayList()
+  : m_ops(),
+    m_states(),
+    m_text(),
+    m_plan(),
+    m_planValid(false),
+    m_lastStateChanges(0)
+{}
+
+
+TextDisplayList::~TextDisplayList()
+{}
+
+
+void TextDisplayList::clear()
+{
+  m_ops.clear();
+  m_states.clear();
+  m_text.clear();
+  m_plan.clear();
+  m_planValid = false;
+}
+
+
+// Return the index in 'm_states' of the current state of 'font',
+// adding it if necessary.
+int TextDisplayList::stateIndexFor(QtBDFFont &font)
+{
+  State state(&font);
+
+  // Consecutive operations usually share a state, so check the most
+  // recent one first.
+  if (m_ops.isNotEmpty() &&
+      m_states[m_ops.top().stateIndex] == state) {
+    return m_ops.top().stateIndex;
+  }
+
+  for (int i=0; i < m_states.length(); i++) {
+    if (m_states[i] == state) {
+      return i;
+    }
+  }
+
+  m_states.push(state);
+  return m_states.length() - 1;
+}
+
+
+TextDisplayList::Op &TextDisplayList::addOp(OpKind kind, QtBDFFont &font)
+{
+  Op op;
+  op.kind = kind;
+  op.stateIndex = stateIndexFor(font);
+  m_ops.push(op);
+  m_planValid = false;
+  return m_ops.top();
+}
+
+
+QPoint TextDisplayList::drawString(QtBDFFont &font, QPoint pt,
+                                   rostring str)
+{
+  return drawChars(font, pt, str.c_str(), str.length());
+}
+
+
+QPoint TextDisplayList::drawChars(QtBDFFont &font, QPoint pt,
+                                  char const *str, int len)
+{
+  if (len <= 0) {
+    return pt;
+  }
+
+  // Measure the characters.
+  QRect bbox;
+  QPoint endPt(pt);
+  for (int i=0; i < len; i++) {
+    int charIndex = (unsigned char)str[i];
+    QRect glyphBBox = font.getCharBBox(charIndex);
+    if (!glyphBBox.isEmpty()) {
+      bbox |= glyphBBox.translated(endPt);
+    }
+    endPt += font.getCharOffset(charIndex);
+  }
+
+  // If this continues the previous string with the same state, merge.
+  // Its text is at the end of 'm_text' since it was the last thing
+  // recorded.
+  if (m_ops.isNotEmpty()) {
+    Op &prev = m_ops.top();
+    if (prev.kind == OK_STRING &&
+        prev.endPt == pt &&
+        m_states[prev.stateIndex] == State(&font)) {
+      m_text.append(str, len);
+      prev.textLength += len;
+      prev.endPt = endPt;
+      prev.bbox |= bbox;
+      m_planValid = false;
+      return endPt;
+    }
+  }
+
+  Op &op = addOp(OK_STRING, font);
+  op.pt = pt;
+  op.textStart = m_text.size();
+  op.textLength = len;
+  op.endPt = endPt;
+  op.bbox = bbox;
+  m_text.append(str, len);
+  return endPt;
+}
+
+
+QPoint TextDisplayList::drawChar(QtBDFFont &font, QPoint pt, int index)
+{
+  Op &op = addOp(OK_CHAR, font);
+  op.pt = pt;
+  op.codePoint = index;
+  op.endPt = pt + font.getCharOffset(index);
+  op.bbox = font.getCharBBox(index).translated(pt);
+  return op.endPt;
+}
+
+
+void TextDisplayList::drawHexQuad(QtBDFFont &font, QRect const &bounds,
+                                  int codePoint)
+{
+  // Like the global 'drawHexQuad', this assumes the font is small
+  // enough that the digits stay within 'bounds'.
+  Op &op = addOp(OK_HEX_QUAD, font);
+  op.hexBounds = bounds;
+  op.codePoint = codePoint;
+  op.bbox = bounds;
+}
+
+
+QPoint TextDisplayList::drawCharOrHexQuad(QtBDFFont &mainFont,
+                                          QtBDFFont &minihexFont,
+                                          QPoint pt, int codePoint)
+{
+  if (mainFont.hasChar(codePoint)) {
+    return drawChar(mainFont, pt, codePoint);
+  }
+  else {
+    // Same as 'drawHexQuad' on the nominal cell, but remember the
+    // main font so the quad can come from its cache.
+    drawHexQuad(minihexFont, mainFont.getNominalCharCell(pt), codePoint);
+    Op &op = m_ops.top();
+    op.hexMainFont = &mainFont;
+    op.pt = pt;
+    return pt + mainFont.getNominalCharOffset();
+  }
+}
+
+
+// Height of the horizontal bands used to find overlapping operations
+// in 'computePlan', as a power of two.
+enum { BAND_SHIFT = 5 };
+
+
+// Return the band containing 'y', rounding toward negative infinity.
+static int bandOf(int y)
+{
+  return y >= 0? (y >> BAND_SHIFT) :
+                 -((-y + (1 << BAND_SHIFT) - 1) >> BAND_SHIFT);
+}
+
+
+void TextDisplayList::computePlan()
+{
+  m_plan.clear();
+
+  // Assign each drawing operation a level, such that an operation's
+  // level is at least that of every earlier operation it overlaps,
+  // and strictly greater if their states differ.  Drawing level by
+  // level, and within a level state by state in recorded order,
+  // then keeps every overlapping pair in recorded order.
+  //
+  // To find earlier overlapping operations quickly, operations are
+  // bucketed by the horizontal bands their bboxes cover.  Text is
+  // laid out in lines, so a band holds only a few lines' worth.
+  std::vector<int> level(m_ops.length(), 0);
+  std::map<int, std::vector<int> > bands;
+
+  for (int j=0; j < m_ops.length(); j++) {
+    Op const &op = m_ops[j];
+    if (op.bbox.isEmpty()) {
+      continue;
+    }
+
+    int firstBand = bandOf(op.bbox.top());
+    int lastBand = bandOf(op.bbox.bottom());
+
+    int lev = 0;
+    for (int b = firstBand; b <= lastBand; b++) {
+      std::vector<int> const &band = bands[b];
+      for (size_t k=0; k < band.size(); k++) {
+        Op const &prev = m_ops[band[k]];
+        if (prev.bbox.intersects(op.bbox)) {
+          int need = level[band[k]] +
+                     (prev.stateIndex == op.stateIndex? 0 : 1);
+          lev = max(lev, need);
+        }
+      }
+    }
+    level[j] = lev;
+
+    for (int b = firstBand; b <= lastBand; b++) {
+      bands[b].push_back(j);
+    }
+    m_plan.push(j);
+  }
+
+  // Order by level, then state, then recorded order.
+  if (m_plan.isNotEmpty()) {
+    Op const *ops = &m_ops[0];
+    std::sort(&m_plan[0], &m_plan[0] + m_plan.length(),
+      [&level, ops](int a, int b) {
+        if (level[a] != level[b]) {
+          return level[a] < level[b];
+        }
+        if (ops[a].stateIndex != ops[b].stateIndex) {
+          return ops[a].stateIndex < ops[b].stateIndex;
+        }
+        return a < b;
+      });
+  }
+
+  m_planValid = true;
+}
+
+
+void TextDisplayList::replay(QPainter &dest)
+{
+  if (!m_planValid) {
+    computePlan();
+  }
+
+  // Remember the fonts' attributes so they can be restored.
+  ArrayStack<QtBDFFont*> fonts;
+  ArrayStack<QColor> fgColors;
+  ArrayStack<QColor> bgColors;
+  ArrayStack<bool> transparents;
+  for (int i=0; i < m_states.length(); i++) {
+    QtBDFFont *font = m_states[i].font;
+    bool seen = false;
+    for (int f=0; f < fonts.length(); f++) {
+      seen = seen || fonts[f] == font;
+    }
+    if (!seen) {
+      fonts.push(font);
+      fgColors.push(font->getFgColor());
+      bgColors.push(font->getBgColor());
+      transparents.push(font->getTransparent());
+    }
+  }
+
+  m_lastStateChanges = 0;
+  int currentState = -1;
+  for (int k=0; k < m_plan.length(); k++) {
+    Op const &op = m_ops[m_plan[k]];
+    State const &state = m_states[op.stateIndex];
+    QtBDFFont &font = *(state.font);
+
+    if (op.stateIndex != currentState) {
+      font.setFgColor(QColor::fromRgba(state.fg));
+      if (!state.transparent) {
+        font.setBgColor(QColor::fromRgba(state.bg));
+      }
+      font.setTransparent(state.transparent);
+      currentState = op.stateIndex;
+      m_lastStateChanges++;
+    }
+
+    switch (op.kind) {
+      case OK_STRING:
+        font.drawChars(dest, op.pt, m_text.constData() + op.textStart,
+                       op.textLength);
+        break;
+
+      case OK_CHAR:
+        font.drawChar(dest, op.pt, op.codePoint);
+        break;
+
+      case OK_HEX_QUAD:
+        if (op.hexMainFont) {
+          op.hexMainFont->drawHexQuadCell(font, dest, op.pt,
+                                          op.codePoint);
+        }
+        else {
+          ::drawHexQuad(font, dest, op.hexBounds, op.codePoint);
+        }
+        break;
+    }
+  }
+
+  for (int f=0; f < fonts.length(); f++) {
+    fonts[f]->setFgColor(fgColors[f]);
+    fonts[f]->setBgColor(bgColors[f]);
+    fonts[f]->setTransparent(transparents[f]);
+  }
+}
+
+
+int TextDisplayList::recordedStateChanges() const
+{
+  int ret = 0;
+  int currentState = -1;
+  for (int i=0; i < m_ops.length(); i++) {
+    Op const &op = m_ops[i];
+    if (!op.bbox.isEmpty() && op.stateIndex != currentState) {
+      currentState = op.stateIndex;
+      ret++;
+    }
+  }
+  return ret;
+}
+
+
+// EOF
@@ -0,0 +1,175 @@
+// text-display-list.h
+// TextDisplayList class.
+
+#ifndef SMQTUTIL_TEXT_DISPLAY_LIST_H
+#define SMQTUTIL_TEXT_DISPLAY_LIST_H
+
+// smbase
+#include "array.h"                     // ArrayStack
+#include "sm-macros.h"                 // NO_OBJECT_COPIES
+#include "str.h"                       // rostring
+
+// Qt
+#include <QByteArray>
+#include <QColor>
+#include <QPoint>
+#include <QRect>
+
+class QPainter;                        // qpainter.h
+class QtBDFFont;                       // qtbdffont.h
+
+
+// Records QtBDFFont drawing operations, along with the font colors
+// and transparency in effect for each, so they can be drawn later,
+// possibly many times.
+//
+// The point of recording is that replay can reorder the operations.
+// Views such as syntax-highlighted text switch colors constantly, and
+// while each switch is cheap on its own, a frame with thousands of
+// them spends much of its time changing state and blitting from many
+// different color pixmaps.  Replay instead draws all operations with
+// one color state together, switching only when it has to.
+//
+// The reordering preserves the result: two operations whose
+// destination bounding boxes overlap are always drawn in their
+// recorded order, so the pixels are exactly those of drawing the
+// operations immediately.  Adjacent string draws with the same state
+// are merged as they are recorded.
+//
+// The fonts are not owned and must outlive the recorded operations.
+class TextDisplayList {
+  NO_OBJECT_COPIES(TextDisplayList);
+
+private:     // types
+  // Kinds of recorded operation.
+  enum OpKind {
+    OK_STRING,                         // bytes as character indices
+    OK_CHAR,                           // one character index
+    OK_HEX_QUAD,                       // 'drawHexQuad'
+  };
+
+  // Font and colors in effect for an operation.
+  class State {
+  public:    // data
+    QtBDFFont *font;
+    QRgb fg;
+    QRgb bg;                           // 0 if 'transparent'
+    bool transparent;
+
+  public:
+    State();
+    explicit State(QtBDFFont *font);
+
+    bool operator== (State const &obj) const;
+    bool operator!= (State const &obj) const
+      { return !operator==(obj); }
+  };
+
+  // One recorded operation.
+  class Op {
+  public:    // data
+    OpKind kind;
+
+    // Index into 'm_states'.
+    int stateIndex;
+
+    // For OK_STRING and OK_CHAR, the origin of the first character.
+    // For OK_HEX_QUAD with a 'hexMainFont', the origin of its cell.
+    QPoint pt;
+
+    // For OK_HEX_QUAD, the 'bounds' argument.  Otherwise, unused.
+    QRect hexBounds;
+
+    // For OK_HEX_QUAD recorded by 'drawCharOrHexQuad', the main font,
+    // so replay can use its 'drawHexQuadCell' cache.  Otherwise NULL.
+    QtBDFFont *hexMainFont;
+
+    // For OK_CHAR and OK_HEX_QUAD, the character index.
+    int codePoint;
+
+    // For OK_STRING, the characters are
+    // 'm_text[textStart, textStart+textLength)'.
+    int textStart;
+    int textLength;
+
+    // For OK_STRING and OK_CHAR, the origin just past the last
+    // character.  Used to merge continuations.
+    QPoint endPt;
+
+    // Destination area that drawing may touch.  Empty if nothing is
+    // drawn.
+    QRect bbox;
+
+  public:
+    Op();
+  };
+
+private:     // data
+  // Recorded operations, in order.
+  ArrayStack<Op> m_ops;
+
+  // Distinct states used by 'm_ops', in order of first use.
+  ArrayStack<State> m_states;
+
+  // Characters of OK_STRING operations.
+  QByteArray m_text;
+
+  // Indices into 'm_ops' in replay order.  Only operations that draw
+  // something are included.  Valid if 'm_planValid'.
+  ArrayStack<int> m_plan;
+  bool m_planValid;
+
+  // Number of state changes made by the most recent 'replay'.
+  int m_lastStateChanges;
+
+private:     // funcs
+  int stateIndexFor(QtBDFFont &font);
+  Op &addOp(OpKind kind, QtBDFFont &font);
+  void computePlan();
+
+public:      // funcs
+  TextDisplayList();
+  ~TextDisplayList();
+
+  // Discard all recorded operations.
+  void clear();
+
+  // Number of recorded operations.  Adjacent string draws that
+  // continue one another with the same state are merged when they are
+  // recorded, so this may be less than the number of calls.
+  int numOps() const { return m_ops.length(); }
+
+  // Record the equivalent of the global 'drawString', using the
+  // current colors and transparency of 'font'.  Return the origin
+  // for the next character.
+  QPoint drawString(QtBDFFont &font, QPoint pt, rostring str);
+
+  // Same, for [str,str+len).
+  QPoint drawChars(QtBDFFont &font, QPoint pt, char const *str, int len);
+
+  // Record 'font.drawChar(dest, pt, index)'.  Return the origin for
+  // the next character.
+  QPoint drawChar(QtBDFFont &font, QPoint pt, int index);
+
+  // Record the equivalent of the global 'drawHexQuad'.
+  void drawHexQuad(QtBDFFont &font, QRect const &bounds, int codePoint);
+
+  // Record the equivalent of the global 'drawCharOrHexQuad'.
+  QPoint drawCharOrHexQuad(QtBDFFont &mainFont, QtBDFFont &minihexFont,
+                           QPoint pt, int codePoint);
+
+  // Draw the recorded operations on 'dest', grouped by state as
+  // described above.  The replay order is computed on the first replay
+  // after a change and reused after that.  Afterward, each font has
+  // the colors and transparency it had before.
+  void replay(QPainter &dest);
+
+  // Number of times the most recent 'replay' changed state.
+  int lastStateChanges() const { return m_lastStateChanges; }
+
+  // Number of state changes that drawing in recorded order would make.
+  int recordedStateChanges() const;
+};
+
+
+#endif // SMQTUTIL_TEXT_DISPLAY_LIST_H
@@ -0,0 +1,449 @@
+// text-grid-widget.cc
+// code for text-grid-widget.h; tests are in test-qtbdffont.cc
+
+#include "text-grid-widget.h"          // this module
+
+// this directory
+#include "qtbdffont.h"                 // QtBDFFont
+
+// smbase
+#include "xassert.h"                   // xassert
+
+// Qt
+#include <QPainter>
+#include <QPaintEvent>
+#include <QVarLengthArray>
+
+// libc++
+#include <algorithm>                   // std::copy, std::copy_backward
+
+
+// ------------------------ TextGridCell --------------------------
+TextGridCell::TextGridCell()
+  : m_codePoint(' '),
+    m_fg(qRgb(0,0,0)),
+    m_bg(qRgb(255,255,255)),
+    m_style(TS_REGULAR)
+{}
+
+
+TextGridCell::TextGridCell(int codePoint, QRgb fg, QRgb bg,
+                           TextStyle style)
+  : m_codePoint(codePoint),
+    m_fg(fg),
+    m_bg(bg),
+    m_style(style)
+{}
+
+
+bool TextGridCell::operator== (TextGridCell const &obj) const
+{
+  return m_codePoint == obj.m_codePoint &&
+         sameAttributes(obj);
+}
+
+
+bool TextGridCell::sameAttributes(TextGridCell const &obj) const
+{
+  return m_fg == obj.m_fg &&
+         m_bg == obj.m_bg &&
+         m_style == obj.m_style;
+}
+
+
+// ------------------------ TextGridWidget ------------------------
+// Cell value stored in 'm_drawnCells' to mean the backbuffer contents
+// there are unknown.
+static TextGridCell const invalidCell(-1, 0, 0);
+
+
+TextGridWidget::TextGridWidget(QWidget *parent)
+  : QWidget(parent),
+    m_fonts(),
+    m_minihexFont(nullptr),
+    m_rows(0),
+    m_cols(0),
+    m_cellSize(1, 1),
+    m_cellOrigin(0, 0),
+    m_marginColor(Qt::white),
+    m_cells(),
+    m_drawnCells(),
+    m_rowDirty(),
+    m_backbuffer(),
+    m_marginDirty(true),
+    m_lastRedrawnCells(0)
+{
+  // Every pixel is painted from the backbuffer, so Qt does not need
+  // to erase first.
+  setAttribute(Qt::WA_OpaquePaintEvent);
+}
+
+
+TextGridWidget::~TextGridWidget()
+{}
+
+
+void TextGridWidget::recomputeCellGeometry()
+{
+  if (!m_fonts.isEmpty()) {
+    QtBDFFont &font = m_fonts.forStyle(TS_REGULAR);
+
+    // The width is the nominal cell width, while the height is the
+    // line height used by 'drawMultilineString', which covers every
+    // glyph vertically.
+    QRect cell = font.getNominalCharCell(QPoint(0,0));
+    QRect allChars = font.getAllCharsBBox();
+    m_cellSize = QSize(cell.width(), allChars.height())
+                   .expandedTo(QSize(1,1));
+    m_cellOrigin = QPoint(-cell.left(), -allChars.top());
+  }
+  else {
+    m_cellSize = QSize(1,1);
+    m_cellOrigin = QPoint(0,0);
+  }
+  updateGeometry();
+}
+
+
+void TextGridWidget::invalidateAllCells()
+{
+  m_drawnCells.fill(invalidCell);
+  m_rowDirty.fill(true);
+  m_marginDirty = true;
+}
+
+
+void TextGridWidget::setFonts(QtBDFFont *regular, QtBDFFont *bold,
+                              QtBDFFont *italic)
+{
+  m_fonts = StyledFonts(regular, bold, italic);
+  recomputeCellGeometry();
+  invalidateAllCells();
+  update();
+}
+
+
+void TextGridWidget::setMinihexFont(QtBDFFont *minihexFont)
+{
+  m_minihexFont = minihexFont;
+  invalidateAllCells();
+  update();
+}
+
+
+void TextGridWidget::setMarginColor(QColor const &color)
+{
+  m_marginColor = color;
+  m_marginDirty = true;
+  update();
+}
+
+
+void TextGridWidget::setGridSize(int rows, int cols)
+{
+  xassert(rows >= 0 && cols >= 0);
+
+  QVector<TextGridCell> newCells(rows * cols);
+  QVector<TextGridCell> newDrawnCells(rows * cols, invalidCell);
+
+  // Keep the contents of cells that remain.
+  int keepRows = min(rows, m_rows);
+  int keepCols = min(cols, m_cols);
+  for (int r=0; r < keepRows; r++) {
+    for (int c=0; c < keepCols; c++) {
+      newCells[r*cols + c] = m_cells[r*m_cols + c];
+      newDrawnCells[r*cols + c] = m_drawnCells[r*m_cols + c];
+    }
+  }
+
+  m_cells.swap(newCells);
+  m_drawnCells.swap(newDrawnCells);
+  m_rowDirty.fill(true, rows);
+  m_rows = rows;
+  m_cols = cols;
+
+  // The grid boundary moved, so the margin has to be repainted.
+  m_marginDirty = true;
+  updateGeometry();
+  update();
+}
+
+
+QRect TextGridWidget::cellRect(int row, int col) const
+{
+  return QRect(QPoint(col * m_cellSize.width(),
+                      row * m_cellSize.height()),
+               m_cellSize);
+}
+
+
+TextGridCell const &TextGridWidget::getCell(int row, int col) const
+{
+  xassert(0 <= row && row < m_rows &&
+          0 <= col && col < m_cols);
+  return m_cells[row*m_cols + col];
+}
+
+
+void TextGridWidget::setCell(int row, int col, TextGridCell const &cell)
+{
+  xassert(0 <= row && row < m_rows &&
+          0 <= col && col < m_cols);
+
+  TextGridCell &dest = m_cells[row*m_cols + col];
+  if (dest == cell) {
+    return;
+  }
+  dest = cell;
+
+  // Only the first change in a row needs to tell Qt; the whole row is
+  // then scheduled for repainting, and diffing at paint time finds
+  // the cells that actually changed.  This keeps the update region
+  // simple when the client rewrites a whole frame.
+  if (!m_rowDirty[row]) {
+    m_rowDirty[row] = true;
+    update(QRect(cellRect(row, 0).topLeft(),
+                 QSize(m_cols * m_cellSize.width(),
+                       m_cellSize.height())));
+  }
+}
+
+
+void TextGridWidget::setText(int row, int col, rostring text,
+                             QRgb fg, QRgb bg, TextStyle style)
+{
+  char const *p = text.c_str();
+  int len = text.length();
+  for (int i=0; i < len && col+i < m_cols; i++) {
+    setCell(row, col+i,
+            TextGridCell((unsigned char)p[i], fg, bg, style));
+  }
+}
+
+
+void TextGridWidget::fillCells(TextGridCell const &cell)
+{
+  for (int r=0; r < m_rows; r++) {
+    for (int c=0; c < m_cols; c++) {
+      setCell(r, c, cell);
+    }
+  }
+}
+
+
+void TextGridWidget::scrollRows(int n, TextGridCell const &fill)
+{
+  if (n == 0 || m_rows == 0) {
+    return;
+  }
+  if (n >= m_rows || -n >= m_rows) {
+    // Nothing survives, so this is just a fill.
+    fillCells(fill);
+    return;
+  }
+
+  // Shift the cell arrays.  Rows keep their dirty flags, since a row
+  // whose changes were not yet drawn still needs drawing after it
+  // moves.
+  int keepRows = m_rows - (n>0? n : -n);
+  int keepCells = keepRows * m_cols;
+  int shiftCells = n * m_cols;
+  TextGridCell *cells = m_cells.data();
+  TextGridCell *drawn = m_drawnCells.data();
+  bool *dirty = m_rowDirty.data();
+  int exposedRow;
+  if (n > 0) {
+    std::copy(cells + shiftCells, cells + shiftCells + keepCells, cells);
+    std::copy(drawn + shiftCells, drawn + shiftCells + keepCells, drawn);
+    std::copy(dirty + n, dirty + m_rows, dirty);
+    exposedRow = keepRows;
+  }
+  else {
+    std::copy_backward(cells, cells + keepCells, cells + m_cells.size());
+    std::copy_backward(drawn, drawn + keepCells, drawn + m_drawnCells.size());
+    std::copy_backward(dirty, dirty + keepRows, dirty + m_rows);
+    exposedRow = 0;
+  }
+
+  // The newly exposed rows get 'fill', and have nothing drawn.
+  for (int r = exposedRow; r < exposedRow + (m_rows - keepRows); r++) {
+    for (int c=0; c < m_cols; c++) {
+      cells[r*m_cols + c] = fill;
+      drawn[r*m_cols + c] = invalidCell;
+    }
+    dirty[r] = true;
+  }
+
+  // Move the pixels that are still valid.
+  QRect gridRect(QPoint(0,0), sizeHint());
+  int dy = -n * m_cellSize.height();
+  if (!m_backbuffer.isNull() && m_backbuffer.size() == size()) {
+    m_backbuffer.scroll(0, dy, gridRect);
+  }
+
+  // Let Qt do the same on screen.  It schedules a repaint of the
+  // exposed area, which is where the exposed rows are.  Other dirty
+  // rows may have moved relative to the update region that was
+  // requested for them, so ask again.
+  QWidget::scroll(0, dy, gridRect);
+  for (int r=0; r < m_rows; r++) {
+    if (dirty[r]) {
+      update(QRect(cellRect(r, 0).topLeft(),
+                   QSize(m_cols * m_cellSize.width(),
+                         m_cellSize.height())));
+    }
+  }
+}
+
+
+// Draw the cells in [startCol,endCol) of 'row', which all have the
+// same attributes, into the backbuffer.
+void TextGridWidget::drawRun(QPainter &paint, int row,
+                             int startCol, int endCol)
+{
+  TextGridCell const *cells = m_cells.constData() + row*m_cols;
+  TextGridCell const &first = cells[startCol];
+  int cellWidth = m_cellSize.width();
+
+  // Glyphs may extend outside their cells, for example in italic
+  // fonts.  Clipping to the run makes the result the same no matter
+  // which neighbors are being redrawn, which is what makes it valid
+  // to redraw only the changed cells.
+  QRect runRect(cellRect(row, startCol).topLeft(),
+                QSize((endCol - startCol) * cellWidth,
+                      m_cellSize.height()));
+  paint.setClipRect(runRect);
+  paint.fillRect(runRect, QColor(first.m_bg));
+
+  if (m_fonts.isEmpty()) {
+    return;
+  }
+  QtBDFFont *font = &m_fonts.forStyle(first.m_style);
+  font->setFgColor(QColor(first.m_fg));
+  font->setTransparent(true);
+  if (m_minihexFont) {
+    m_minihexFont->setFgColor(QColor(first.m_fg));
+    m_minihexFont->setTransparent(true);
+  }
+
+  // Consecutive single-byte glyphs whose advance equals the cell
+  // width are accumulated into 'bytes' and drawn with one 'drawChars'
+  // call, starting at 'bytesOrigin'.
+  QPoint const cellAdvance(cellWidth, 0);
+  QVarLengthArray<char, 256> bytes;
+  QPoint bytesOrigin;
+
+  QPoint pt = runRect.topLeft() + m_cellOrigin;
+  for (int col = startCol; col < endCol; col++, pt += cellAdvance) {
+    int codePoint = cells[col].m_codePoint;
+
+    if (0 <= codePoint && codePoint <= 255 &&
+        font->hasChar(codePoint) &&
+        font->getCharOffset(codePoint) == cellAdvance) {
+      if (bytes.isEmpty()) {
+        bytesOrigin = pt;
+      }
+      bytes.append((char)codePoint);
+      continue;
+    }
+
+    if (!bytes.isEmpty()) {
+      font->drawChars(paint, bytesOrigin, bytes.constData(), bytes.size());
+      bytes.clear();
+    }
+
+    if (font->hasChar(codePoint)) {
+      font->drawChar(paint, pt, codePoint);
+    }
+    else if (m_minihexFont) {
+      // The quad is cached by the font, so a screen full of missing
+      // characters costs one blit each.
+      font->drawHexQuadCell(*m_minihexFont, paint, pt, codePoint);
+    }
+  }
+
+  if (!bytes.isEmpty()) {
+    font->drawChars(paint, bytesOrigin, bytes.constData(), bytes.size());
+  }
+}
+
+
+void TextGridWidget::updateBackbuffer()
+{
+  m_lastRedrawnCells = 0;
+
+  // Resizing discards the old contents, since it is rare and the
+  // exposed area would have to be redrawn anyway.
+  if (m_backbuffer.size() != size()) {
+    m_backbuffer = QPixmap(size());
+    invalidateAllCells();
+  }
+  if (m_backbuffer.isNull()) {
+    return;
+  }
+
+  QPainter paint(&m_backbuffer);
+
+  if (m_marginDirty) {
+    int gridWidth = m_cols * m_cellSize.width();
+    int gridHeight = m_rows * m_cellSize.height();
+    paint.fillRect(QRect(gridWidth, 0,
+                         width() - gridWidth, height()),
+                   m_marginColor);
+    paint.fillRect(QRect(0, gridHeight,
+                         gridWidth, height() - gridHeight),
+                   m_marginColor);
+    m_marginDirty = false;
+  }
+
+  for (int row=0; row < m_rows; row++) {
+    if (!m_rowDirty[row]) {
+      continue;
+    }
+    m_rowDirty[row] = false;
+
+    TextGridCell const *cells = m_cells.constData() + row*m_cols;
+    TextGridCell *drawn = m_drawnCells.data() + row*m_cols;
+
+    int col = 0;
+    while (col < m_cols) {
+      if (cells[col] == drawn[col]) {
+        col++;
+        continue;
+      }
+
+      // Extend the run over changed cells with the same attributes.
+      int start = col++;
+      while (col < m_cols &&
+             cells[col] != drawn[col] &&
+             cells[col].sameAttributes(cells[start])) {
+        col++;
+      }
+
+      drawRun(paint, row, start, col);
+      for (int c = start; c < col; c++) {
+        drawn[c] = cells[c];
+      }
+      m_lastRedrawnCells += col - start;
+    }
+  }
+}
+
+
+void TextGridWidget::paintEvent(QPaintEvent *event)
+{
+  updateBackbuffer();
+
+  QPainter paint(this);
+  paint.drawPixmap(event->rect(), m_backbuffer, event->rect());
+}
+
+
+QSize TextGridWidget::sizeHint() const
+{
+  return QSize(m_cols * m_cellSize.width(),
+               m_rows * m_cellSize.height());
+}
+
+
+// EOF
@@ -0,0 +1,193 @@
+// text-grid-widget.h
+// TextGridWidget class.
+
+#ifndef SMQTUTIL_TEXT_GRID_WIDGET_H
+#define SMQTUTIL_TEXT_GRID_WIDGET_H
+
+// this directory
+#include "styled-fonts.h"              // StyledFonts, TextStyle
+
+// smbase
+#include "sm-macros.h"                 // NO_OBJECT_COPIES
+#include "str.h"                       // rostring
+
+// Qt
+#include <QColor>
+#include <QPixmap>
+#include <QVector>
+#include <QWidget>
+
+class QtBDFFont;                       // qtbdffont.h
+
+
+// Contents of one cell of a TextGridWidget.
+class TextGridCell {
+public:      // data
+  // Character to show, interpreted by the style's QtBDFFont.  A
+  // negative value never matches a real cell; the widget uses that to
+  // force cells to be redrawn.
+  int m_codePoint;
+
+  // Foreground and background colors.
+  QRgb m_fg;
+  QRgb m_bg;
+
+  // Font to use.
+  TextStyle m_style;
+
+public:      // funcs
+  // Blank: a space, black on white, regular.
+  TextGridCell();
+
+  TextGridCell(int codePoint, QRgb fg, QRgb bg,
+               TextStyle style = TS_REGULAR);
+
+  bool operator== (TextGridCell const &obj) const;
+  bool operator!= (TextGridCell const &obj) const
+    { return !operator==(obj); }
+
+  // True if this cell has the same colors and style as 'obj', and so
+  // can be drawn in the same run.
+  bool sameAttributes(TextGridCell const &obj) const;
+};
+
+
+// Widget showing a fixed-pitch grid of characters, each with its own
+// colors and style, drawn with QtBDFFont.  This is meant as the basis
+// for terminal-style views such as a text editor.
+//
+// The client writes cells whenever it likes.  The widget remembers
+// what it last drew into an offscreen backbuffer, and when it paints,
+// it compares the two and redraws only runs of cells that changed.
+// Thus the cost of a frame is proportional to what changed, not to
+// the size of the grid.
+//
+// Drawing changes the colors and transparency of the fonts, so they
+// should not be shared with code that depends on those staying put.
+class TextGridWidget : public QWidget {
+  NO_OBJECT_COPIES(TextGridWidget);
+
+private:     // data
+  // Font for each style.  Not owned.  If empty, nothing is drawn.
+  StyledFonts m_fonts;
+
+  // If not NULL, used to draw hex quads for characters missing from
+  // the font.  Not owned.
+  QtBDFFont *m_minihexFont;
+
+  // Grid dimensions in cells.
+  int m_rows;
+  int m_cols;
+
+  // Size of one cell in pixels.  The width comes from the regular
+  // font's nominal metrics, and the height is its line height, the
+  // height of 'getAllCharsBBox()'.
+  QSize m_cellSize;
+
+  // Location of the glyph origin relative to the upper-left corner of
+  // a cell.
+  QPoint m_cellOrigin;
+
+  // Color of the area outside the grid.
+  QColor m_marginColor;
+
+  // Desired contents, 'm_rows' * 'm_cols', row-major.
+  QVector<TextGridCell> m_cells;
+
+  // What is currently drawn in 'm_backbuffer', same layout.
+  QVector<TextGridCell> m_drawnCells;
+
+  // For each row, true if 'm_cells' might differ from 'm_drawnCells'
+  // there.  A row is marked when a cell in it is changed.
+  QVector<bool> m_rowDirty;
+
+  // Offscreen copy of the widget contents.
+  QPixmap m_backbuffer;
+
+  // True if the area outside the grid in 'm_backbuffer' needs to be
+  // filled with 'm_marginColor'.
+  bool m_marginDirty;
+
+  // Number of cells redrawn by the last 'updateBackbuffer'.
+  int m_lastRedrawnCells;
+
+private:     // funcs
+  void recomputeCellGeometry();
+
+  // Forget what is in the backbuffer, so the next update redraws
+  // everything.
+  void invalidateAllCells();
+  void drawRun(QPainter &paint, int row, int startCol, int endCol);
+
+protected:   // funcs
+  // QWidget methods.
+  virtual void paintEvent(QPaintEvent *event) override;
+
+public:      // funcs
+  TextGridWidget(QWidget *parent = nullptr);
+  virtual ~TextGridWidget() override;
+
+  // Set the fonts as for StyledFonts.  This redraws everything.
+  void setFonts(QtBDFFont *regular, QtBDFFont *bold,
+                QtBDFFont *italic);
+
+  // Set the font used for hex quads, or NULL to draw nothing for
+  // missing characters.
+  void setMinihexFont(QtBDFFont *minihexFont);
+
+  // Set the color of the area outside the grid.
+  void setMarginColor(QColor const &color);
+
+  // Change the grid dimensions.  Cells that remain in bounds keep
+  // their contents; new cells are blank.
+  void setGridSize(int rows, int cols);
+
+  int rows() const { return m_rows; }
+  int cols() const { return m_cols; }
+
+  // Size of one cell in pixels.
+  QSize cellSize() const { return m_cellSize; }
+
+  // Rectangle covered by a cell, in widget coordinates.
+  QRect cellRect(int row, int col) const;
+
+  // Get and set a cell.  The coordinates must be in bounds.
+  TextGridCell const &getCell(int row, int col) const;
+  void setCell(int row, int col, TextGridCell const &cell);
+
+  // Set cells starting at (row,col) to the bytes of 'text', clipping
+  // at the end of the row.
+  void setText(int row, int col, rostring text, QRgb fg, QRgb bg,
+               TextStyle style = TS_REGULAR);
+
+  // Set every cell to 'cell'.
+  void fillCells(TextGridCell const &cell);
+
+  // Move the contents up by 'n' rows, or down if 'n' is negative, as
+  // when scrolling a document down or up.  Rows scrolled in from the
+  // edge are set to 'fill'.
+  //
+  // The pixels of the rows that remain visible are shifted, both in
+  // the backbuffer and on screen via QWidget::scroll, so only the
+  // exposed rows get redrawn.  This is much cheaper than rewriting
+  // every cell, which would make every row differ from what is drawn.
+  void scrollRows(int n, TextGridCell const &fill = TextGridCell());
+
+  // Bring 'm_backbuffer' up to date with the cells.  This happens
+  // automatically when painting; it is public for testing and for
+  // clients that want to grab the image.
+  void updateBackbuffer();
+
+  // The offscreen image.  Call 'updateBackbuffer' first for it to
+  // reflect the latest cells.
+  QPixmap const &backbuffer() const { return m_backbuffer; }
+
+  // Number of cells redrawn by the most recent 'updateBackbuffer'.
+  int lastRedrawnCells() const { return m_lastRedrawnCells; }
+
+  // QWidget methods.
+  virtual QSize sizeHint() const override;
+};
+
+
+#endif // SMQTUTIL_TEXT_GRID_WIDGET_H
@@ -0,0 +1,311 @@
+// text-wrap-layout.cc
+// code for text-wrap-layout.h; tests are in test-qtbdffont.cc
+
+#include "text-wrap-layout.h"          // this module
+
+// this directory
+#include "qtbdffont.h"                 // QtBDFFont
+
+// smbase
+#include "xassert.h"                   // xassert
+
+// libc++
+#include <algorithm>                   // std::upper_bound
+
+
+// --------------------- TextWrapLayout::Paragraph -------------------
+TextWrapLayout::Paragraph::Paragraph(QByteArray const &text)
+  : m_text(text),
+    m_breaks(),
+    m_wrapped(false)
+{}
+
+
+// -------------------------- TextWrapLayout -------------------------
+TextWrapLayout::TextWrapLayout(QtBDFFont &font, int width)
+  : m_font(font),
+    m_width(width),
+    m_paragraphs(),
+    m_firstLine(),
+    m_numLinesValid(0),
+    m_numWraps(0)
+{
+  m_paragraphs.push_back(Paragraph(QByteArray()));
+  m_firstLine.assign(2, 0);
+}
+
+
+TextWrapLayout::~TextWrapLayout()
+{}
+
+
+void TextWrapLayout::setWidth(int width)
+{
+  if (width != m_width) {
+    m_width = width;
+    for (size_t p=0; p < m_paragraphs.size(); p++) {
+      m_paragraphs[p].m_wrapped = false;
+    }
+    invalidateFrom(0);
+  }
+}
+
+
+void TextWrapLayout::setText(rostring text)
+{
+  m_paragraphs.clear();
+
+  char const *start = text.c_str();
+  char const *end = start + text.length();
+  char const *p = start;
+  while (true) {
+    char const *nl = p;
+    while (nl < end && *nl != '\n') {
+      nl++;
+    }
+
+    char const *lineEnd = nl;
+    if (lineEnd > p && lineEnd[-1] == '\r') {
+      lineEnd--;
+    }
+    m_paragraphs.push_back(Paragraph(QByteArray(p, lineEnd - p)));
+
+    if (nl == end) {
+      break;
+    }
+    p = nl+1;
+  }
+
+  m_firstLine.assign(m_paragraphs.size() + 1, 0);
+  m_numLinesValid = 0;
+}
+
+
+QByteArray const &TextWrapLayout::paragraphText(int p) const
+{
+  xassert(0 <= p && p < numParagraphs());
+  return m_paragraphs[p].m_text;
+}
+
+
+void TextWrapLayout::setParagraph(int p, rostring text)
+{
+  xassert(0 <= p && p < numParagraphs());
+  m_paragraphs[p] = Paragraph(QByteArray(text.c_str(), text.length()));
+  invalidateFrom(p);
+}
+
+
+void TextWrapLayout::insertParagraph(int p, rostring text)
+{
+  xassert(0 <= p && p <= numParagraphs());
+  m_paragraphs.insert(m_paragraphs.begin() + p,
+    Paragraph(QByteArray(text.c_str(), text.length())));
+  m_firstLine.push_back(0);
+  invalidateFrom(p);
+}
+
+
+void TextWrapLayout::removeParagraph(int p)
+{
+  xassert(0 <= p && p < numParagraphs());
+  m_paragraphs.erase(m_paragraphs.begin() + p);
+  m_firstLine.pop_back();
+
+  if (m_paragraphs.empty()) {
+    m_paragraphs.push_back(Paragraph(QByteArray()));
+    m_firstLine.push_back(0);
+  }
+  invalidateFrom(p);
+}
+
+
+// Line numbers of paragraphs after 'p' may have changed.
+void TextWrapLayout::invalidateFrom(int p)
+{
+  // 'm_firstLine[p]' itself depends only on earlier paragraphs.
+  if (m_numLinesValid > p) {
+    m_numLinesValid = p;
+  }
+}
+
+
+void TextWrapLayout::wrapParagraph(Paragraph &para)
+{
+  para.m_breaks.clear();
+
+  unsigned char const *text = (unsigned char const*)para.m_text.constData();
+  int len = para.m_text.size();
+  int const *advance = m_font.getByteAdvances();
+
+  int lineStart = 0;
+
+  // Width of [lineStart,i), including any trailing spaces.
+  int x = 0;
+
+  // Position just after the most recent run of spaces on this line,
+  // where the line could break, or -1; and the value of 'x' there.
+  int breakPos = -1;
+  int breakX = 0;
+
+  for (int i=0; i < len; i++) {
+    int c = text[i];
+    int adv = advance[c];
+
+    if (c == ' ') {
+      // Spaces never force a break; they hang past the width.
+      x += adv;
+      breakPos = i+1;
+      breakX = x;
+      continue;
+    }
+
+    if (x + adv > m_width && i > lineStart) {
+      if (breakPos > lineStart) {
+        // Break after the spaces, moving the word in progress to the
+        // next line.
+        lineStart = breakPos;
+        x -= breakX;
+        para.m_breaks.push_back(lineStart);
+        breakPos = -1;
+      }
+
+      if (x + adv > m_width && i > lineStart) {
+        // The word alone is too wide; break within it.
+        lineStart = i;
+        x = 0;
+        para.m_breaks.push_back(lineStart);
+      }
+    }
+
+    x += adv;
+  }
+
+  para.m_wrapped = true;
+  m_numWraps++;
+}
+
+
+// Make 'm_firstLine' valid up to and including entry 'p'.
+void TextWrapLayout::extendLineNumbers(int p)
+{
+  while (m_numLinesValid < p) {
+    Paragraph &para = m_paragraphs[m_numLinesValid];
+    if (!para.m_wrapped) {
+      wrapParagraph(para);
+    }
+    m_firstLine[m_numLinesValid+1] =
+      m_firstLine[m_numLinesValid] + para.numLines();
+    m_numLinesValid++;
+  }
+}
+
+
+int TextWrapLayout::paragraphNumLines(int p)
+{
+  xassert(0 <= p && p < numParagraphs());
+  Paragraph &para = m_paragraphs[p];
+  if (!para.m_wrapped) {
+    wrapParagraph(para);
+  }
+  return para.numLines();
+}
+
+
+int TextWrapLayout::paragraphFirstLine(int p)
+{
+  xassert(0 <= p && p <= numParagraphs());
+  extendLineNumbers(p);
+  return m_firstLine[p];
+}
+
+
+int TextWrapLayout::numLines()
+{
+  return paragraphFirstLine(numParagraphs());
+}
+
+
+bool TextWrapLayout::wrapMore(long maxBytes)
+{
+  long bytes = 0;
+  while (m_numLinesValid < numParagraphs() && bytes < maxBytes) {
+    bytes += m_paragraphs[m_numLinesValid].m_text.size() + 1;
+    extendLineNumbers(m_numLinesValid + 1);
+  }
+  return m_numLinesValid == numParagraphs();
+}
+
+
+// Wrap paragraphs until 'line' is known to exist or not, and return
+// true if it exists.
+bool TextWrapLayout::hasLine(int line)
+{
+  while (m_numLinesValid < numParagraphs() &&
+         m_firstLine[m_numLinesValid] <= line) {
+    extendLineNumbers(m_numLinesValid + 1);
+  }
+  return 0 <= line && line < m_firstLine[m_numLinesValid];
+}
+
+
+// Return the paragraph containing 'line'.
+int TextWrapLayout::paragraphForLine(int line)
+{
+  bool exists = hasLine(line);
+  xassert(exists);
+
+  // Last paragraph whose first line is at or before 'line'.
+  std::vector<int>::const_iterator begin = m_firstLine.begin();
+  int p = std::upper_bound(begin, begin + m_numLinesValid + 1, line) -
+          begin - 1;
+  return p;
+}
+
+
+char const *TextWrapLayout::lineText(int line, int &length, int *para)
+{
+  int p = paragraphForLine(line);
+  Paragraph const &paragraph = m_paragraphs[p];
+
+  int index = line - m_firstLine[p];
+  xassert(index < paragraph.numLines());
+
+  int start = (index == 0)? 0 : paragraph.m_breaks[index-1];
+  int end = (index+1 < paragraph.numLines())?
+              paragraph.m_breaks[index] : paragraph.m_text.size();
+
+  length = end - start;
+  if (para) {
+    *para = p;
+  }
+  return paragraph.m_text.constData() + start;
+}
+
+
+int TextWrapLayout::lineHeight() const
+{
+  return m_font.getAllCharsBBox().height();
+}
+
+
+void TextWrapLayout::drawLines(QPainter &dest, QPoint upLeft,
+                               int firstLine, int count)
+{
+  QRect const &ext = m_font.getAllCharsBBox();
+
+  // Baseline origin of the first line.
+  QPoint pt = upLeft - ext.topLeft();
+
+  // Only wrap as far as the lines being drawn.
+  for (int line = firstLine; line < firstLine+count && hasLine(line);
+       line++) {
+    int length;
+    char const *text = lineText(line, length);
+    m_font.drawChars(dest, pt, text, length);
+    pt.setY(pt.y() + ext.height());
+  }
+}
+
+
+// EOF
@@ -0,0 +1,152 @@
+// text-wrap-layout.h
+// TextWrapLayout class.
+
+#ifndef SMQTUTIL_TEXT_WRAP_LAYOUT_H
+#define SMQTUTIL_TEXT_WRAP_LAYOUT_H
+
+// smbase
+#include "sm-macros.h"                 // NO_OBJECT_COPIES
+#include "str.h"                       // rostring
+
+// Qt
+#include <QByteArray>
+#include <QPoint>
+
+// libc++
+#include <vector>                      // std::vector
+
+class QPainter;                        // qpainter.h
+class QtBDFFont;                       // qtbdffont.h
+
+
+// Breaks paragraphs of text into lines that fit a given width when
+// drawn with a QtBDFFont, and draws them.
+//
+// The text is a sequence of paragraphs, separated by newlines in
+// 'setText'.  Each paragraph is wrapped greedily: a line ends after
+// the last space that keeps the line within the width, or, for a word
+// wider than the whole width, in the middle of the word.  Spaces at a
+// break stay at the end of the line and do not count toward its
+// width, as in most editors.  As in 'drawString', each byte is a
+// character index and missing glyphs have no width.
+//
+// Wrapping is lazy and incremental.  The break positions of each
+// paragraph are kept until it is edited or the width changes, and a
+// paragraph is only wrapped when something asks about its lines or
+// those after it.  So after a resize, drawing the top of a large
+// document wraps only the paragraphs on screen, and an edit re-wraps
+// only the edited paragraph; the line numbers of the paragraphs after
+// it are recomputed from their cached line counts.  'wrapMore' lets a
+// client finish the job in small steps, for example from an idle
+// timer, so that it never stalls the GUI thread.
+class TextWrapLayout {
+  NO_OBJECT_COPIES(TextWrapLayout);
+
+private:     // types
+  class Paragraph {
+  public:    // data
+    QByteArray m_text;
+
+    // Byte offsets at which the second and later lines start.
+    std::vector<int> m_breaks;
+
+    // True if 'm_breaks' is correct for the layout's current width.
+    bool m_wrapped;
+
+  public:
+    explicit Paragraph(QByteArray const &text);
+
+    int numLines() const { return (int)m_breaks.size() + 1; }
+  };
+
+private:     // data
+  // Font whose advances determine the breaks.  Not owned.
+  QtBDFFont &m_font;
+
+  // Maximum line width in pixels.
+  int m_width;
+
+  // The text.
+  std::vector<Paragraph> m_paragraphs;
+
+  // 'm_firstLine[p]' is the number of lines before paragraph 'p'.
+  // Valid for 'p' in [0,m_numLinesValid]; entry 'numParagraphs()', if
+  // valid, is the total.  Paragraphs before 'm_numLinesValid' are
+  // all wrapped.
+  std::vector<int> m_firstLine;
+  int m_numLinesValid;
+
+  // Number of paragraph wraps done since construction.
+  long m_numWraps;
+
+private:     // funcs
+  void wrapParagraph(Paragraph &para);
+  void invalidateFrom(int p);
+  void extendLineNumbers(int p);
+  bool hasLine(int line);
+  int paragraphForLine(int line);
+
+public:      // funcs
+  // Lay out with 'font', which must outlive this object, in 'width'
+  // pixels.  Initially there is one empty paragraph.
+  TextWrapLayout(QtBDFFont &font, int width);
+  ~TextWrapLayout();
+
+  // Get and set the width.  Changing it discards all breaks; nothing
+  // is re-wrapped until needed.
+  int width() const { return m_width; }
+  void setWidth(int width);
+
+  // Replace the text with 'text', splitting it into paragraphs at
+  // each '\n'.  A "\r\n" counts as one separator.
+  void setText(rostring text);
+
+  // Number of paragraphs.  Always at least one.
+  int numParagraphs() const { return (int)m_paragraphs.size(); }
+
+  // Text of paragraph 'p'.
+  QByteArray const &paragraphText(int p) const;
+
+  // Edit operations on paragraphs.  Each invalidates the breaks of the
+  // affected paragraph only.
+  void setParagraph(int p, rostring text);
+  void insertParagraph(int p, rostring text);
+  void removeParagraph(int p);
+
+  // Number of lines in paragraph 'p'.  Wraps it if necessary.
+  int paragraphNumLines(int p);
+
+  // Index of the first line of paragraph 'p'.  Wraps the paragraphs
+  // before it if necessary.
+  int paragraphFirstLine(int p);
+
+  // Total number of lines.  This wraps everything not yet wrapped.
+  int numLines();
+
+  // Wrap paragraphs in order until at least 'maxBytes' bytes of text
+  // have been wrapped, or everything has.  Return true if everything
+  // is now wrapped, so that 'numLines' is cheap.
+  bool wrapMore(long maxBytes);
+
+  // Get the text of 'line', which must be in [0,numLines()), as a
+  // range of bytes in its paragraph.  Also return its paragraph index
+  // in 'para' if that is not NULL.
+  char const *lineText(int line, int &length, int *para = nullptr);
+
+  // Height of a line in pixels, the same as 'drawMultilineString'.
+  int lineHeight() const;
+
+  // Draw lines [firstLine,firstLine+count) with the top of the first
+  // at 'upLeft.y()' and all starting at 'upLeft.x()', using the
+  // font's current colors.  Lines beyond the end are ignored, and
+  // paragraphs are wrapped only as far as the last line drawn.
+  // Unlike 'drawMultilineString', empty lines take up space.
+  void drawLines(QPainter &dest, QPoint upLeft, int firstLine, int count);
+
+  // Number of times a paragraph has been wrapped.  For testing and
+  // performance monitoring.
+  long numWraps() const { return m_numWraps; }
+};
+
+
+#endif // SMQTUTIL_TEXT_WRAP_LAYOUT_H